@@ -1,759 +1,1316 @@
-#include <libavformat/avformat.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-#include "libavfilter/avfilter.h"
-#include "libavfilter/buffersink.h"
-#include "libavfilter/buffersrc.h"
-#include "libavutil/opt.h"
+#include "libavutil/avstring.h"
+#include "libavutil/avutil.h"
+#include "libavutil/bprint.h"
+#include "libavutil/cpu.h"
+#include "libavutil/parseutils.h"
+#include "libavutil/time.h"
 
-// The number of output channels
-#define OUTPUT_CHANNELS 2
-// The audio sample output format
-#define OUTPUT_SAMPLE_FORMAT AV_SAMPLE_FMT_S16
+#include "mixer.h"
 
-AVFormatContext *output_format_context = NULL;
-AVCodecContext *output_codec_context = NULL;
+static void usage(void)
+{
+    MixerOptions defaults;
+
+    mixer_options_default(&defaults);
+    printf("usage: ./audio_mixer [options] audio_input1.wav audio_input2.wav [audio_input3.wav ...] audio_output.wav\n"
+           "       ./audio_mixer [options] --timeline clips audio_output.wav\n"
+           "       ./audio_mixer [options] --batch manifest\n"
+           "options:\n"
+           "  --threads N          1 decodes, mixes and encodes on one thread (default);\n"
+           "                       more than 1 runs one decoder thread per input, the mix\n"
+           "                       on the main thread and the encoder on its own thread\n"
+           "  --pipeline-depth N   number of frames buffered between two pipeline stages (default %d)\n"
+           "  --block-size N       samples per channel of every frame sent to PCM encoders\n"
+           "                       (default %d); other codecs take their own frame size\n"
+           "  --input-lead N       samples every input of amix is read ahead of the mix\n"
+           "                       (default %d)\n"
+           "  --memory-budget MIB  stop reading inputs ahead while amix holds more than MIB\n"
+           "                       (default 0: no limit)\n"
+           "  --engine NAME        amix mixes through the libavfilter amix filter (default);\n"
+           "                       native mixes with the built-in SSE2/AVX2 engine\n"
+           "  --submix-size N      native engine: mix inputs in groups of N on threads of\n"
+           "                       their own, then sum the groups (default %d, 0: one thread)\n"
+           "  --weights W1,W2,...  mixing weight of every input (default 1 each)\n"
+           "  --layout NAME        channel layout of the output: mono, stereo, 5.1, 7.1...\n"
+           "                       (default auto: the one most inputs have)\n"
+           "  --matrix I=G,G,.../G,G,...\n"
+           "                       native engine only: route input I (from 0) to the output,\n"
+           "                       one row of gains per output channel, one gain per input\n"
+           "                       channel; may be repeated\n"
+           "  --overflow MODE      native engine only: saturate clamps integer outputs to their\n"
+           "                       range (default), clip also clips float outputs to [-1, 1]\n"
+           "  --debug-alloc        report the allocations of the mixing loop every second\n"
+           "  --decoder-threads N  threads of every decoder that supports frame or slice\n"
+           "                       threading (default 0: picked by libavcodec)\n"
+           "  --no-mmap            read PCM WAV inputs through libavformat instead of mapping them\n"
+           "  --read-ahead KIB     size of the blocks a thread reads ahead of every input\n"
+           "                       (default %d; 0 reads on the decoder thread)\n"
+           "  --read-ahead-depth N number of blocks read ahead of every input (default %d)\n"
+           "  --probe-cache DIR    keep what probing learns of every input in DIR, so that the\n"
+           "                       next opens of an unchanged file skip probing\n"
+           "  --probe-cache-validate\n"
+           "                       only use a cached entry when the header of the file agrees\n"
+           "  --pcm-cache DIR      keep the decoded samples of compressed inputs in DIR and map\n"
+           "                       them in the next mixes instead of decoding again\n"
+           "  --pcm-cache-size MIB size DIR is kept under (default %d)\n"
+           "  --segments N         split mixes longer than a minute into up to N segments of at\n"
+           "                       least 30 s mixed in parallel (default 0: one segment)\n"
+           "  --start TIME         start the mix at TIME of the inputs ([HH:]MM:SS[.m] or seconds)\n"
+           "  --duration TIME      only mix TIME from the start (default: to the end)\n"
+           "  --quiet              only log errors\n"
+           "  --verbose            also log every frame going through the mix\n"
+           "  --stats-json FILE    write a JSON summary of the mix, with the time spent in every\n"
+           "                       stage, to FILE (- for stdout); a batch writes one line per job\n"
+           "  --trace FILE         write a timeline of the stages of the mix as a Chrome trace\n"
+           "  --output FILE[,codec=NAME][,bitrate=RATE]\n"
+           "                       also encode the mix to FILE, with the encoder NAME (default:\n"
+           "                       that of the container) at RATE bit/s (k and M suffixes);\n"
+           "                       may be repeated, every output encodes on its own thread\n"
+           "  --timeline FILE      mix the clips of FILE, one per line (file, offset, gain, in,\n"
+           "                       out as TSV or JSON), opening each one only while it plays\n"
+           "  --batch FILE         run every job of a JSON lines or TSV manifest; the options\n"
+           "                       above but --weights are the defaults of every job\n"
+           "  --jobs N             number of jobs a batch or the daemon runs at once\n"
+           "                       (default: one per CPU)\n"
+           "  --listen PATH        run as a daemon taking jobs, one per line as in a manifest,\n"
+           "                       on the Unix socket PATH\n"
+           "  --warm N             daemon only: filter graphs and encoders kept ready for\n"
+           "                       every format seen (default 1)\n",
+           defaults.pipeline_depth, defaults.block_size, defaults.input_lead, defaults.submix_size,
+           defaults.read_ahead, defaults.read_ahead_depth, defaults.pcm_cache_size);
+}
 
-AVFormatContext *input_format_context_0 = NULL;
-AVCodecContext *input_codec_context_0 = NULL;
-AVFormatContext *input_format_context_1 = NULL;
-AVCodecContext *input_codec_context_1 = NULL;
+// The options without a short name below 256 are MixerOptions, set by their long name.
+enum {
+    OPT_WEIGHTS = 256,
+    OPT_BATCH,
+    OPT_JOBS,
+    OPT_LISTEN,
+    OPT_WARM,
+    OPT_STATS_JSON,
+    OPT_TRACE,
+    OPT_TIMELINE,
+    OPT_OUTPUT,
+    OPT_MATRIX,
+    OPT_MIXER,
+};
 
-AVFilterGraph *graph;
-AVFilterContext *src0;
-AVFilterContext *src1;
-AVFilterContext *sink;
+static const struct option long_options[] = {
+    { "threads",        required_argument, NULL, OPT_MIXER },
+    { "pipeline-depth", required_argument, NULL, OPT_MIXER },
+    { "block-size",     required_argument, NULL, OPT_MIXER },
+    { "input-lead",     required_argument, NULL, OPT_MIXER },
+    { "memory-budget",  required_argument, NULL, OPT_MIXER },
+    { "engine",         required_argument, NULL, OPT_MIXER },
+    { "weights",        required_argument, NULL, OPT_WEIGHTS },
+    { "layout",         required_argument, NULL, OPT_MIXER },
+    { "submix-size",    required_argument, NULL, OPT_MIXER },
+    { "matrix",         required_argument, NULL, OPT_MATRIX },
+    { "overflow",       required_argument, NULL, OPT_MIXER },
+    { "debug-alloc",    no_argument,       NULL, OPT_MIXER },
+    { "decoder-threads", required_argument, NULL, OPT_MIXER },
+    { "no-mmap",        no_argument,       NULL, OPT_MIXER },
+    { "read-ahead",     required_argument, NULL, OPT_MIXER },
+    { "read-ahead-depth", required_argument, NULL, OPT_MIXER },
+    { "probe-cache",    required_argument, NULL, OPT_MIXER },
+    { "probe-cache-validate", no_argument, NULL, OPT_MIXER },
+    { "pcm-cache",      required_argument, NULL, OPT_MIXER },
+    { "pcm-cache-size", required_argument, NULL, OPT_MIXER },
+    { "segments",       required_argument, NULL, OPT_MIXER },
+    { "start",          required_argument, NULL, OPT_MIXER },
+    { "duration",       required_argument, NULL, OPT_MIXER },
+    { "batch",          required_argument, NULL, OPT_BATCH },
+    { "jobs",           required_argument, NULL, OPT_JOBS },
+    { "listen",         required_argument, NULL, OPT_LISTEN },
+    { "warm",           required_argument, NULL, OPT_WARM },
+    { "quiet",          no_argument,       NULL, 'q' },
+    { "verbose",        no_argument,       NULL, 'v' },
+    { "stats-json",     required_argument, NULL, OPT_STATS_JSON },
+    { "trace",          required_argument, NULL, OPT_TRACE },
+    { "timeline",       required_argument, NULL, OPT_TIMELINE },
+    { "output",         required_argument, NULL, OPT_OUTPUT },
+    { "help",           no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
 
-static char *const get_error_text(const int error)
+// Parse the comma separated weight of each of the nb_inputs inputs; NULL weighs them all 1.0.
+static int parse_weights(const char *str, float *weights, int nb_inputs)
 {
-    static char error_buffer[255];
-    av_strerror(error, error_buffer, sizeof(error_buffer));
+    for (int i = 0 ; i < nb_inputs ; i++) {
+        char *end;
+        
+        weights[i] = 1.0f;
+        if (!str)
+            continue;
+        
+        weights[i] = strtof(str, &end);
+        if (end == str || *end != (i < nb_inputs - 1 ? ',' : '\0')) {
+            av_log(NULL, AV_LOG_ERROR, "--weights needs one number per input\n");
+            return AVERROR(EINVAL);
+        }
+        str = end + 1;
+    }
 
-    return error_buffer;
+    return 0;
 }
 
-static int init_filter_graph(AVFilterGraph **graph, AVFilterContext **src0, AVFilterContext **src1, AVFilterContext **sink)
+/**
+ * Add the output of an --output switch, FILE[,codec=NAME][,bitrate=RATE]
+ * with RATE in bit/s and an optional k or M suffix.
+ */
+static int add_output(MixerContext *ctx, const char *spec)
 {
-    AVFilterGraph *filter_graph;
-    AVFilterContext *abuffer1_ctx;
-    const AVFilter  *abuffer1;
-    AVFilterContext *abuffer0_ctx;
-    const AVFilter  *abuffer0;
-    AVFilterContext *mix_ctx;
-    const AVFilter  *mix_filter;
-    AVFilterContext *abuffersink_ctx;
-    const AVFilter  *abuffersink;
-    
-    char args[512];
+    char *str = av_strdup(spec);
+    char *filename, *field, *saveptr = NULL;
+    const char *codec = NULL;
+    int64_t bit_rate = 0;
     int error;
-    
-    // Create a new filtergraph, which will contain all the filters.
-    filter_graph = avfilter_graph_alloc();
-    if (!filter_graph) {
-        av_log(NULL, AV_LOG_ERROR, "Unable to create filter graph.\n");
-        return AVERROR(ENOMEM);
-    }
-    
-    /****** abuffer 0 ********/
-    
-    // Create the abuffer filter;
-    // it will be used for feeding the data into the graph.
-    abuffer0 = avfilter_get_by_name("abuffer");
-    if (!abuffer0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find the abuffer filter.\n");
-        return AVERROR_FILTER_NOT_FOUND;
-    }
-    
-    // buffer audio source: the decoded frames from the decoder will be inserted here.
-    if (!input_codec_context_0->channel_layout)
-        input_codec_context_0->channel_layout = av_get_default_channel_layout(input_codec_context_0->channels);
-    snprintf(args, sizeof(args),
-             "sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
-             input_codec_context_0->sample_rate,
-             av_get_sample_fmt_name(input_codec_context_0->sample_fmt), input_codec_context_0->channel_layout);
-    
-    
-    error = avfilter_graph_create_filter(&abuffer0_ctx, abuffer0, "src0",
-                                       args, NULL, filter_graph);
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer source\n");
-        return error;
-    }
-    
-    // abuffer 1
-    
-    // Create the abuffer filter;
-    // it will be used for feeding the data into the graph.
-    abuffer1 = avfilter_get_by_name("abuffer");
-    if (!abuffer1) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find the abuffer filter.\n");
-        return AVERROR_FILTER_NOT_FOUND;
-    }
-    
-    // buffer audio source: the decoded frames from the decoder will be inserted here.
-    if (!input_codec_context_1->channel_layout)
-        input_codec_context_1->channel_layout = av_get_default_channel_layout(input_codec_context_1->channels);
-
-    snprintf(args, sizeof(args), "sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
-             input_codec_context_1->sample_rate,
-             av_get_sample_fmt_name(input_codec_context_1->sample_fmt), input_codec_context_1->channel_layout);
-    
-    error = avfilter_graph_create_filter(&abuffer1_ctx, abuffer1, "src1", args, NULL, filter_graph);
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer source\n");
-        return error;
-    }
-    
-    // amix
-    // Create mix filter.
-    mix_filter = avfilter_get_by_name("amix");
-    if (!mix_filter) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find the mix filter.\n");
-        return AVERROR_FILTER_NOT_FOUND;
-    }
-    
-    snprintf(args, sizeof(args), "inputs=2");
-    
-    error = avfilter_graph_create_filter(&mix_ctx, mix_filter, "amix", args, NULL, filter_graph);
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot create audio amix filter\n");
-        return error;
-    }
-    
-    // Finally create the abuffersink filter;
-    // it will be used to get the filtered data out of the graph.
 
-    abuffersink = avfilter_get_by_name("abuffersink");
-    if (!abuffersink) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find the abuffersink filter.\n");
-        return AVERROR_FILTER_NOT_FOUND;
-    }
-    
-    abuffersink_ctx = avfilter_graph_alloc_filter(filter_graph, abuffersink, "sink");
-    if (!abuffersink_ctx) {
-        av_log(NULL, AV_LOG_ERROR, "Could not allocate the abuffersink instance.\n");
+    if (!str)
         return AVERROR(ENOMEM);
+
+    filename = av_strtok(str, ",", &saveptr);
+    while ((field = av_strtok(NULL, ",", &saveptr))) {
+        if (!strncmp(field, "codec=", 6) && field[6]) {
+            codec = field + 6;
+        } else if (!strncmp(field, "bitrate=", 8)) {
+            char *end;
+            double rate = strtod(field + 8, &end);
+
+            if (*end == 'k' || *end == 'M')
+                rate *= *end++ == 'k' ? 1e3 : 1e6;
+            if (end == field + 8 || *end || rate <= 0)
+                break;
+            bit_rate = rate;
+        } else {
+            break;
+        }
     }
-    
-    // Same sample fmts as the output file.
-    error = av_opt_set_int_list(abuffersink_ctx, "sample_fmts",
-                              ((int[]){ AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_NONE }),
-                              AV_SAMPLE_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
-    
-    uint8_t ch_layout[64];
-    av_get_channel_layout_string(ch_layout, sizeof(ch_layout), 0, OUTPUT_CHANNELS);
-    av_opt_set(abuffersink_ctx, "channel_layout", ch_layout, AV_OPT_SEARCH_CHILDREN);
-    
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could set options to the abuffersink instance.\n");
-        return error;
+
+    if (!filename || field) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid output '%s'\n", spec);
+        error = AVERROR(EINVAL);
+    } else {
+        error = mixer_add_output(ctx, filename, codec, bit_rate);
     }
-    
-    error = avfilter_init_str(abuffersink_ctx, NULL);
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not initialize the abuffersink instance.\n");
-        return error;
+    av_free(str);
+
+    return error;
+}
+
+/**
+ * Set the routing matrix of a --matrix switch, I=ROW/ROW/... with one row
+ * per output channel of comma separated gains, one per input channel.
+ */
+static int set_matrix(MixerContext *ctx, const char *spec)
+{
+    double *matrix = NULL;
+    int nb_gains = 0, nb_rows = 1, nb_cols = 0, row_size = 0;
+    char *end;
+    long i = strtol(spec, &end, 10);
+    const char *p = end;
+    int error = AVERROR(EINVAL);
+
+    if (end == spec || *p++ != '=')
+        goto end;
+
+    while (1) {
+        double gain = strtod(p, &end);
+
+        if (end == p || av_dynarray2_add((void **)&matrix, &nb_gains, sizeof(*matrix), (uint8_t *)&gain) == NULL) {
+            if (end != p)
+                error = AVERROR(ENOMEM);
+            goto end;
+        }
+        row_size++;
+        p = end;
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        // Every row has as many gains as the first one.
+        if (nb_cols && row_size != nb_cols)
+            goto end;
+        nb_cols  = row_size;
+        row_size = 0;
+        if (!*p)
+            break;
+        if (*p++ != '/')
+            goto end;
+        nb_rows++;
     }
-    
-    // Connect the filters
-    
-    error = avfilter_link(abuffer0_ctx, 0, mix_ctx, 0);
-    if (error >= 0)
-        error = avfilter_link(abuffer1_ctx, 0, mix_ctx, 1);
-    if (error >= 0)
-        error = avfilter_link(mix_ctx, 0, abuffersink_ctx, 0);
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error connecting filters\n");
-        return error;
+
+    error = mixer_set_input_matrix(ctx, i, matrix, nb_rows, nb_cols);
+
+    end:
+        if (error == AVERROR(EINVAL))
+            av_log(NULL, AV_LOG_ERROR, "Invalid matrix '%s'\n", spec);
+        av_free(matrix);
+
+    return error;
+}
+
+// Add every input with its weight to a mixer, set their routing matrices and run it.
+static int run_mix(MixerContext *ctx, char * const *inputs, const float *weights, int nb_inputs,
+                   const char **matrices, int nb_matrices)
+{
+    int error;
+
+    for (int i = 0 ; i < nb_inputs ; i++) {
+        if ((error = mixer_add_input(ctx, inputs[i], weights[i])) < 0)
+            return error;
     }
-    
-    // Configure the graph.
-    error = avfilter_graph_config(filter_graph, NULL);
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while configuring graph : %s\n", get_error_text(error));
-        return error;
+    for (int i = 0 ; i < nb_matrices ; i++) {
+        if ((error = set_matrix(ctx, matrices[i])) < 0)
+            return error;
     }
-    
-    char* dump =avfilter_graph_dump(filter_graph, NULL);
-    av_log(NULL, AV_LOG_ERROR, "Graph :\n%s\n", dump);
-    
-    *graph = filter_graph;
-    *src0  = abuffer0_ctx;
-    *src1  = abuffer1_ctx;
-    *sink  = abuffersink_ctx;
-    
-    return 0;
+
+    return mixer_run(ctx);
 }
 
-// Open an input file and the required decoder.
-static int open_input_file(const char *filename,
-                           AVFormatContext **input_format_context,
-                           AVCodecContext **input_codec_context)
+// Write the JSON summary of the last run of ctx as one line of f.
+static int write_stats_json(FILE *f, const MixerContext *ctx)
 {
-    AVCodec *input_codec;
-    AVStream *in_stream;
-    AVCodecParameters *in_codecpar;
-    enum AVCodecID audio_codec_id;
+    char *json;
     int error;
-    
-    // Open the input file to read from it.
-    if ((error = avformat_open_input(input_format_context, filename, NULL, NULL)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not open input file '%s' (error '%s')\n",
-               filename, get_error_text(error));
-        *input_format_context = NULL;
-        return error;
-    }
-    
-    // Get information on the input file (number of streams etc.).
-    if ((error = avformat_find_stream_info(*input_format_context, NULL)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not open find stream info (error '%s')\n",
-               get_error_text(error));
-        avformat_close_input(input_format_context);
+
+    if ((error = mixer_get_stats_json(ctx, &json)) < 0)
         return error;
-    }
-    
-    // Make sure that there is only one stream in the input file.
-    if ((*input_format_context)->nb_streams != 1) {
-        av_log(NULL, AV_LOG_ERROR, "Expected one audio input stream, but found %d\n",
-               (*input_format_context)->nb_streams);
-        avformat_close_input(input_format_context);
-        return AVERROR_EXIT;
-    }
+    fprintf(f, "%s\n", json);
+    fflush(f);
+    av_free(json);
 
-    av_dump_format((*input_format_context), 0, filename, 0);
+    return 0;
+}
 
-    in_stream = (*input_format_context)->streams[0];
-    in_codecpar = in_stream->codecpar;
-    if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
-        av_log(NULL, AV_LOG_ERROR, "File input has no stream audio -> %s\n", filename);
-        return -1;
-    }
+// One line of a batch manifest.
+typedef struct BatchJob {
+    int line;
+    MixerOptions options;
+    char **inputs;
+    int nb_inputs;
+    char *output;
+    // Given as a string, parsed into input_weights once all the inputs are known.
+    char *weights;
+    float *input_weights;
+} BatchJob;
 
-    audio_codec_id = in_codecpar->codec_id;
-    
-    // Find a decoder for the audio stream.
-    if (!(input_codec = avcodec_find_decoder(audio_codec_id))) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find input codec\n");
-        avformat_close_input(input_format_context);
-        return AVERROR_EXIT;
-    }
+static void batch_job_free(BatchJob *job)
+{
+    for (int i = 0 ; i < job->nb_inputs ; i++)
+        av_freep(&job->inputs[i]);
+    av_freep(&job->inputs);
+    // Freeing a job twice is harmless.
+    job->nb_inputs = 0;
+    av_freep(&job->output);
+    av_freep(&job->weights);
+    av_freep(&job->input_weights);
+}
 
-    // Creating codec context for the input file
-    *input_codec_context = avcodec_alloc_context3(input_codec);
-    if (!(*input_codec_context)) {
-        av_log(NULL, AV_LOG_ERROR, "Could not alloc memory for input codec context\n");
-        return -1;
-    }
+static int batch_job_add_input(BatchJob *job, const char *filename)
+{
+    char *input = av_strdup(filename);
 
-    error = avcodec_parameters_to_context((*input_codec_context), (*input_format_context)->streams[0]->codecpar);
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Can't copy codecpar values to input codec context (error '%s')\n",
-               get_error_text(error));
-        return error;
+    if (!input)
+        return AVERROR(ENOMEM);
+    if (av_dynarray_add_nofree(&job->inputs, &job->nb_inputs, input) < 0) {
+        av_free(input);
+        return AVERROR(ENOMEM);
     }
 
-    av_log(NULL, AV_LOG_INFO, "*** input bitrate -> %" PRIu64 "\n", (*input_codec_context)->bit_rate);
-    
-    // Open the decoder for the audio stream to use it later.
-    if ((error = avcodec_open2((*input_codec_context), input_codec, NULL)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not open input codec (error '%s')\n", get_error_text(error));
-        avformat_close_input(input_format_context);
-        return error;
-    }
-    
     return 0;
 }
 
 /**
- * Open an output file and the required encoder.
- * Also set some basic encoder parameters.
- * Some of these parameters are based on the input file's parameters.
+ * Set a field of a manifest line: "output", "weights", or one of the mixer
+ * options by the long name of its command line switch. value is NULL for
+ * a switch without argument.
  */
-static int open_output_file(const char *filename,
-                            AVCodecContext *input_codec_context,
-                            AVFormatContext **output_format_context,
-                            AVCodecContext **output_codec_context)
-{
-    AVIOContext *output_io_context = NULL;
-    AVStream *stream               = NULL;
-    AVCodec *output_codec          = NULL;
-    int error;
-    
-    // Open the output file to write to it.
-    if ((error = avio_open(&output_io_context, filename,
-                           AVIO_FLAG_WRITE)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not open output file '%s' (error '%s')\n",
-               filename, get_error_text(error));
-        return error;
-    }
-    
-    // Create a new format context for the output container format.
-    if (!(*output_format_context = avformat_alloc_context())) {
-        av_log(NULL, AV_LOG_ERROR, "Could not allocate output format context\n");
-        return AVERROR(ENOMEM);
-    }
-    
-    // Associate the output file (pointer) with the container format context.
-    (*output_format_context)->pb = output_io_context;
-    
-    // Guess the desired container format based on the file extension.
-    if (!((*output_format_context)->oformat = av_guess_format(NULL, filename, NULL))) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find output file format\n");
-        goto cleanup;
-    }
-
-    av_dump_format((*output_format_context), 0, filename, 1);
-
-    AVOutputFormat *outputFormat = (*output_format_context)->oformat;
-    enum AVCodecID audio_codec_id = outputFormat->audio_codec;
-   
-    // Find the encoder to be used by its name.
-    if (!(output_codec = avcodec_find_encoder(audio_codec_id))) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find the encoder required.\n");
-        goto cleanup;
-    }
-    
-    // Create a new audio stream in the output file container.
-    if (!(stream = avformat_new_stream(*output_format_context, output_codec))) {
-        av_log(NULL, AV_LOG_ERROR, "Could not create new stream\n");
-        error = AVERROR(ENOMEM);
-        goto cleanup;
-    }
-
-    *output_codec_context = avcodec_alloc_context3(output_codec);
-    if (!(*output_codec_context)) {
-        av_log(NULL, AV_LOG_ERROR, "Can't alloc memory for output codec context\n");
-        return -1;
-    }
-    stream->codecpar->codec_tag = 0;
-    stream->id = (*output_format_context)->nb_streams - 1;
-
-    // Set the basic encoder parameters.
-    (*output_codec_context)->channels       = OUTPUT_CHANNELS;
-    (*output_codec_context)->channel_layout = av_get_default_channel_layout(OUTPUT_CHANNELS);
-    (*output_codec_context)->sample_rate    = input_codec_context->sample_rate;
-    (*output_codec_context)->sample_fmt     = OUTPUT_SAMPLE_FORMAT;
-    (*output_codec_context)->bit_rate       = input_codec_context->bit_rate;
-
-    av_log(NULL, AV_LOG_INFO, "output bitrate %" PRIu64 "\n", (*output_codec_context)->bit_rate);
-    
-    // Some container formats (like MP4) require global headers to be present
-    // Mark the encoder so that it behaves accordingly.
-
-    if ((*output_format_context)->oformat->flags & AVFMT_GLOBALHEADER)
-        (*output_codec_context)->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    
-    // Open the encoder for the audio stream to use it later.
-    if ((error = avcodec_open2(*output_codec_context, output_codec, NULL)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not open output codec (error '%s')\n",
-               get_error_text(error));
-        goto cleanup;
-    }
-
-    error = avcodec_parameters_from_context(stream->codecpar, (*output_codec_context));
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not copy codecpar from codec context (error '%s')\n",
-               get_error_text(error));
-        return error;
-    } 
-    
+static int batch_job_set(BatchJob *job, const char *name, const char *value)
+{
+    char **field = !strcmp(name, "output")  ? &job->output :
+                   !strcmp(name, "weights") ? &job->weights : NULL;
+
+    if (!field)
+        return mixer_options_set(&job->options, name, value);
+
+    av_free(*field);
+    if (!value || !(*field = av_strdup(value)))
+        return value ? AVERROR(ENOMEM) : AVERROR(EINVAL);
+
     return 0;
-    
-    cleanup:
-        avio_close((*output_format_context)->pb);
-        avformat_free_context(*output_format_context);
-        *output_format_context = NULL;
+}
 
-    return error < 0 ? error : AVERROR_EXIT;
+static void skip_json_space(const char **p)
+{
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')
+        (*p)++;
 }
 
-// Initialize one audio frame for reading from the input file
-static int init_input_frame(AVFrame **frame)
+// Parse a JSON string and append its unescaped contents to out.
+static int parse_json_string(const char **p, AVBPrint *out)
 {
-    if (!(*frame = av_frame_alloc())) {
-        av_log(NULL, AV_LOG_ERROR, "Could not allocate input frame\n");
-        return AVERROR(ENOMEM);
+    const char *s = *p;
+
+    if (*s++ != '"')
+        return AVERROR_INVALIDDATA;
+
+    while (*s != '"') {
+        unsigned int c;
+
+        if (!*s)
+            return AVERROR_INVALIDDATA;
+        if (*s != '\\') {
+            av_bprint_chars(out, *s++, 1);
+            continue;
+        }
+
+        switch (*++s) {
+        case '"':
+        case '\\':
+        case '/': c = *s;   break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'u':
+            if (sscanf(s + 1, "%4x", &c) != 1 || strspn(s + 1, "0123456789abcdefABCDEF") < 4)
+                return AVERROR_INVALIDDATA;
+            s += 4;
+            // A high surrogate followed by a low one makes one code point.
+            if (c >= 0xD800 && c < 0xDC00 && s[1] == '\\' && s[2] == 'u') {
+                unsigned int low;
+                if (sscanf(s + 3, "%4x", &low) == 1 && low >= 0xDC00 && low < 0xE000) {
+                    c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    s += 6;
+                }
+            }
+            {
+                uint8_t tmp;
+                PUT_UTF8(c, tmp, av_bprint_chars(out, tmp, 1);)
+            }
+            s++;
+            continue;
+        default:
+            return AVERROR_INVALIDDATA;
+        }
+        av_bprint_chars(out, c, 1);
+        s++;
     }
+
+    *p = s + 1;
+
     return 0;
 }
 
-// Decode one audio frame from the input file.
-static int decode_audio_frame(AVFrame *frame,
-                              AVFormatContext *input_format_context,
-                              AVCodecContext *input_codec_context,
-                              int *data_present, int *finished)
+/**
+ * Parse a JSON scalar, or an array of scalars, into items: one string per
+ * scalar. Numbers and booleans are kept as written; null adds nothing.
+ */
+static int parse_json_value(const char **p, char ***items, int *nb_items)
 {
-    /*
-    // Devel version
-    // Packet used for temporary storage.
-    AVPacket *input_packet = av_packet_alloc();
-    int error;
-    
-    // Read one audio frame from the input file into a temporary packet.
-    if ((error = av_read_frame(input_format_context, input_packet)) < 0) {
-        // If we are the the end of the file, flush the decoder below.
-        if (error == AVERROR_EOF)
-            *finished = 1;
-        else {
-            av_log(NULL, AV_LOG_ERROR, "Could not read frame (error '%s')\n",
-                   get_error_text(error));
-            return error;
+    int array = **p == '[';
+    int error = 0;
+
+    if (array) {
+        (*p)++;
+        skip_json_space(p);
+        if (**p == ']') {
+            (*p)++;
+            return 0;
         }
     }
 
-    // submit the packet to the decoder
-    error = avcodec_send_packet(input_codec_context, input_packet);
-    if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while sending packet to decode (error '%s')\n",
-               get_error_text(error));
-        return error;
-    }
+    while (1) {
+        AVBPrint item;
+        char *str;
 
-    // get all the available frames from the decoder
-    while (error >= 0) {
-        error = avcodec_receive_frame(input_codec_context, frame);
+        av_bprint_init(&item, 0, AV_BPRINT_SIZE_UNLIMITED);
+        skip_json_space(p);
+        if (**p == '"') {
+            error = parse_json_string(p, &item);
+        } else {
+            size_t len = strcspn(*p, ",]} \t\r\n");
+            if (!len || **p == '[' || **p == '{')
+                error = AVERROR_INVALIDDATA;
+            else
+                av_bprint_append_data(&item, *p, len);
+            *p += len;
+        }
+        if (error >= 0 && !av_bprint_is_complete(&item))
+            error = AVERROR(ENOMEM);
         if (error < 0) {
-            // those two return values are special and mean there is no output
-            // frame available, but there were no errors during decoding
-            if (error == AVERROR_EOF || error == AVERROR(EAGAIN)) {
-                return error;
-            }
-
+            av_bprint_finalize(&item, NULL);
             return error;
         }
 
-        *data_present = 0;
-        if (frame) {
-            *data_present = 1;
-            break;
+        if (strcmp(item.str, "null") || item.len != 4) {
+            av_bprint_finalize(&item, &str);
+            if (!str || av_dynarray_add_nofree(items, nb_items, str) < 0) {
+                av_free(str);
+                return AVERROR(ENOMEM);
+            }
+        } else {
+            av_bprint_finalize(&item, NULL);
+        }
+
+        if (!array)
+            return 0;
+        skip_json_space(p);
+        if (**p == ']') {
+            (*p)++;
+            return 0;
         }
+        if (*(*p)++ != ',')
+            return AVERROR_INVALIDDATA;
     }
+}
 
-    // If the decoder has not been flushed completely, we are not finished,
-    // so that this function has to be called again.
-    if (*finished && *data_present)
-        *finished = 0;
-    av_packet_unref(input_packet);
+/**
+ * Parse one flat JSON object, handing every key to set with the scalars of
+ * its value: one for a scalar, any number for an array.
+ */
+static int parse_json_object(const char *line, void *opaque,
+                             int (*set)(void *opaque, const char *key, char **items, int nb_items))
+{
+    const char *p = line;
+    int error = 0;
 
-    return 0;
-    */
-    
-    // Deprecated version
-    // Packet used for temporary storage. 
-    AVPacket *input_packet = av_packet_alloc();
-    int error;
-	
-    /// Read one audio frame from the input file into a temporary packet. 
-    if ((error = av_read_frame(input_format_context, input_packet)) < 0) {
-        // If we are the the end of the file, flush the decoder below. 
-        if (error == AVERROR_EOF)
-            *finished = 1;
-        else {
-            av_log(NULL, AV_LOG_ERROR, "Could not read frame (error '%s')\n",
-                   get_error_text(error));
-            return error;
+    skip_json_space(&p);
+    if (*p++ != '{')
+        return AVERROR_INVALIDDATA;
+    skip_json_space(&p);
+    if (*p == '}')
+        return 0;
+
+    while (error >= 0) {
+        AVBPrint key;
+        char **items = NULL;
+        int nb_items = 0;
+
+        av_bprint_init(&key, 0, AV_BPRINT_SIZE_UNLIMITED);
+
+        skip_json_space(&p);
+        if ((error = parse_json_string(&p, &key)) >= 0) {
+            skip_json_space(&p);
+            if (*p++ != ':')
+                error = AVERROR_INVALIDDATA;
         }
+        if (error >= 0)
+            error = parse_json_value(&p, &items, &nb_items);
+        if (error >= 0)
+            error = set(opaque, key.str, items, nb_items);
+
+        for (int i = 0 ; i < nb_items ; i++)
+            av_free(items[i]);
+        av_free(items);
+        av_bprint_finalize(&key, NULL);
+
+        if (error < 0)
+            break;
+        skip_json_space(&p);
+        if (*p == '}')
+            break;
+        if (*p++ != ',')
+            error = AVERROR_INVALIDDATA;
     }
 
-     // Decode the audio frame stored in the temporary packet.
-     // The input audio stream decoder is used to do this.
-     // If we are at the end of the file, pass an empty packet to the decoder
-     // to flush it.
-    
-    if ((error = avcodec_decode_audio4(input_codec_context, frame,
-                                       data_present, input_packet)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not decode frame (error '%s')\n",
-               get_error_text(error));   
-        av_packet_unref(input_packet);
+    return error;
+}
+
+static int set_json_job_field(void *opaque, const char *key, char **items, int nb_items)
+{
+    BatchJob *job = opaque;
+    AVBPrint value;
+    int error = 0;
 
+    if (!strcmp(key, "inputs")) {
+        for (int i = 0 ; i < nb_items && error >= 0 ; i++)
+            error = batch_job_add_input(job, items[i]);
         return error;
     }
-	
-    
-     // If the decoder has not been flushed completely, we are not finished,
-     // so that this function has to be called again.
-     
-    if (*finished && *data_present)
-        *finished = 0;
 
-    av_packet_unref(input_packet);
+    av_bprint_init(&value, 0, AV_BPRINT_SIZE_UNLIMITED);
+    for (int i = 0 ; i < nb_items ; i++)
+        av_bprintf(&value, "%s%s", i ? "," : "", items[i]);
+    error = batch_job_set(job, key, nb_items ? value.str : NULL);
+    av_bprint_finalize(&value, NULL);
 
-    return 0;
+    return error;
+}
+
+/**
+ * Parse a JSON manifest line: one flat object with an "inputs" array, an
+ * "output" string and any per-job option by its long name, e.g.
+ * {"inputs": ["a.wav", "b.mp3"], "output": "mix.wav", "weights": [1, 0.5]}.
+ * Arrays given to options are joined with commas.
+ */
+static int parse_json_job(const char *line, BatchJob *job)
+{
+    return parse_json_object(line, job, set_json_job_field);
 }
 
-// Encode one frame worth of audio to the output file.
-static int encode_audio_frame(AVFrame *frame,
-                              AVFormatContext *output_format_context,
-                              AVCodecContext *output_codec_context,
-                              int *data_present)
+/**
+ * Parse a TSV manifest line: the same arguments as the command line, one
+ * per field. Fields starting with "--" are options ("--engine=native",
+ * "--no-mmap"); the others are the inputs, followed by the output.
+ */
+static int parse_tsv_job(char *line, BatchJob *job)
 {
-    // Packet used for temporary storage.
-    AVPacket *output_packet = av_packet_alloc();
+    char *saveptr = NULL;
     int error;
-    *data_present = 0;
-  
-    // send the frame for encoding
-    error = avcodec_send_frame(output_codec_context, frame);
-    if (error == AVERROR_EOF) {
-        error = 0;
-        goto cleanup;
-    } else if (error < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not send frame for encoding (error '%s')\n",
-               av_err2str(error));
-        goto cleanup;
-    }
-
-    // read all the available output packets (in general there may be any number of them 
-    while (1) {
-        error = avcodec_receive_packet(output_codec_context, output_packet);
-        if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
-            return error;
-        } else if (error < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Unexpected error (error '%s')\n",
-                   av_err2str(error));
-            return error;
+
+    for (char *field = strtok_r(line, "\t", &saveptr) ; field ; field = strtok_r(NULL, "\t", &saveptr)) {
+        if (!strncmp(field, "--", 2)) {
+            char *value = strchr(field, '=');
+            if (value)
+                *value++ = '\0';
+            error = batch_job_set(job, field + 2, value);
+        } else {
+            error = batch_job_add_input(job, field);
         }
+        if (error < 0)
+            return error;
+    }
+
+    // The last file is the output.
+    if (job->nb_inputs) {
+        job->output = job->inputs[--job->nb_inputs];
+        job->inputs[job->nb_inputs] = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse one job: a line starting with '{' is a JSON job, any other one a
+ * TSV job. The job starts from the defaults. Returns 0 without filling the
+ * job for empty lines and lines starting with '#'.
+ */
+static int parse_job_line(char *line, const MixerOptions *defaults, BatchJob *job)
+{
+    char *p = line;
+    int error;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (!*p || *p == '#')
+        return 0;
+
+    job->options = *defaults;
+    error = *p == '{' ? parse_json_job(p, job) : parse_tsv_job(p, job);
+    if (error >= 0 && (job->nb_inputs < 2 || !job->output)) {
+        av_log(NULL, AV_LOG_ERROR, "A job needs at least two inputs and an output\n");
+        error = AVERROR(EINVAL);
+    }
+    if (error >= 0 && !(job->input_weights = av_calloc(job->nb_inputs, sizeof(*job->input_weights))))
+        error = AVERROR(ENOMEM);
+    if (error >= 0)
+        error = parse_weights(job->weights, job->input_weights, job->nb_inputs);
+    if (error < 0)
+        batch_job_free(job);
+
+    return error;
+}
 
-        if (output_packet) {
-            if ((error = av_write_frame(output_format_context, output_packet)) < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Could not write frame (error '%s')\n",
-                       get_error_text(error));
-                av_packet_unref(output_packet);
-                return error;
+/**
+ * Run one job with a mixer that is created on the first job and then
+ * reopened for every following one, keeping its pools.
+ */
+static int run_job(MixerContext **ctx, MixerCache *cache, const BatchJob *job, MixerStats *stats)
+{
+    int error;
+
+    memset(stats, 0, sizeof(*stats));
+
+    error = *ctx ? mixer_reopen(*ctx, job->output, &job->options) :
+                   mixer_open(ctx, job->output, &job->options);
+    if (error < 0)
+        return error;
+
+    mixer_set_cache(*ctx, cache);
+    error = run_mix(*ctx, job->inputs, job->input_weights, job->nb_inputs, NULL, 0);
+    mixer_get_stats(*ctx, stats);
+
+    return error;
+}
+
+// Print how a job ended, e.g. "ok: mix.wav, 441000 samples (10.00 s) in 0.084 s, 119.0x realtime".
+static void print_job_status(FILE *f, const BatchJob *job, int error,
+                             const MixerStats *stats, double elapsed)
+{
+    if (error < 0)
+        fprintf(f, "failed: %s: %s\n", job->output, av_err2str(error));
+    else
+        fprintf(f, "ok: %s, %" PRId64 " samples (%.2f s) in %.3f s, %.1fx realtime\n",
+                job->output, stats->nb_samples, stats->duration, elapsed,
+                elapsed > 0 ? stats->duration / elapsed : 0.0);
+    fflush(f);
+}
+
+/**
+ * Read every job of a manifest, one per line as parse_job_line() takes
+ * them. Every job starts from the defaults.
+ */
+static int read_manifest(const char *filename, const MixerOptions *defaults,
+                         BatchJob **jobs, int *nb_jobs)
+{
+    FILE *f = fopen(filename, "r");
+    char *line = NULL;
+    size_t size = 0;
+    int line_number = 0;
+    int error = 0;
+
+    if (!f) {
+        error = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not open manifest '%s' (error '%s')\n",
+               filename, av_err2str(error));
+        return error;
+    }
+
+    while (getline(&line, &size, f) >= 0) {
+        BatchJob job = { .line = ++line_number };
+
+        error = parse_job_line(line, defaults, &job);
+        if (error >= 0 && !job.output)
+            continue;
+        if (error >= 0) {
+            BatchJob *grown = av_realloc_array(*jobs, *nb_jobs + 1, sizeof(**jobs));
+            if (grown) {
+                *jobs = grown;
+                (*jobs)[(*nb_jobs)++] = job;
+            } else {
+                error = AVERROR(ENOMEM);
             }
-    
-            av_packet_unref(output_packet);
-            *data_present = 1;
+        }
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "%s:%d: invalid job (error '%s')\n",
+                   filename, line_number, av_err2str(error));
+            batch_job_free(&job);
             break;
         }
     }
 
-    return 0;
+    free(line);
+    fclose(f);
+
+    return error;
+}
+
+// One line of a timeline: a clip and where it plays.
+typedef struct ClipLine {
+    char *file;
+    int64_t offset;
+    int64_t in;
+    int64_t out;
+    float gain;
+} ClipLine;
+
+/**
+ * Set a field of a timeline line: "file", "gain", or one of the times
+ * "offset", "in" and "out", given as [HH:]MM:SS[.m...] or seconds.
+ */
+static int clip_line_set(ClipLine *clip, const char *name, const char *value)
+{
+    char *end;
+
+    if (!value) {
+        av_log(NULL, AV_LOG_ERROR, "Clip field '%s' needs a value\n", name);
+        return AVERROR(EINVAL);
+    }
+
+    if (!strcmp(name, "file")) {
+        av_free(clip->file);
+        return (clip->file = av_strdup(value)) ? 0 : AVERROR(ENOMEM);
+    }
+    if (!strcmp(name, "gain")) {
+        clip->gain = strtof(value, &end);
+        if (end == value || *end) {
+            av_log(NULL, AV_LOG_ERROR, "Invalid gain '%s'\n", value);
+            return AVERROR(EINVAL);
+        }
+        return 0;
+    }
+    if (!strcmp(name, "offset") || !strcmp(name, "in") || !strcmp(name, "out")) {
+        int64_t *time = !strcmp(name, "offset") ? &clip->offset :
+                        !strcmp(name, "in")     ? &clip->in : &clip->out;
+        if (av_parse_time(time, value, 1) < 0 || *time < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Invalid %s '%s'\n", name, value);
+            return AVERROR(EINVAL);
+        }
+        return 0;
+    }
 
-    cleanup:
-        av_frame_free(&frame);
-        avcodec_free_context(&output_codec_context);
-        avformat_free_context(output_format_context);
+    av_log(NULL, AV_LOG_ERROR, "Unknown clip field '%s'\n", name);
+    return AVERROR(EINVAL);
+}
 
-    return error < 0 ? error : AVERROR_EXIT;
+static int set_json_clip_field(void *opaque, const char *key, char **items, int nb_items)
+{
+    return clip_line_set(opaque, key, nb_items == 1 ? items[0] : NULL);
 }
 
-static int process_all(){
+/**
+ * Parse one line of a timeline. A line starting with '{' is a JSON clip,
+ * {"file": "jingle.wav", "offset": "1:10.5", "gain": 0.8, "in": 0, "out": 2.5};
+ * any other one is TSV: file, offset, and optionally gain, in and out.
+ * Returns 0 without filling the clip for empty lines and lines starting with '#'.
+ */
+static int parse_clip_line(char *line, ClipLine *clip)
+{
+    static const char *const fields[] = { "file", "offset", "gain", "in", "out" };
+    char *p = line, *saveptr = NULL;
+    int nb_fields = 0;
     int error = 0;
-    
-    int data_present = 0;
-    int finished = 0;
-    
-    int nb_inputs = 2;
-    
-    AVFormatContext* input_format_contexts[2];
-    AVCodecContext* input_codec_contexts[2];
-    input_format_contexts[0] = input_format_context_0;
-    input_format_contexts[1] = input_format_context_1;
-    input_codec_contexts[0] = input_codec_context_0;
-    input_codec_contexts[1] = input_codec_context_1;
-    
-    AVFilterContext* buffer_contexts[2];
-    buffer_contexts[0] = src0;
-    buffer_contexts[1] = src1;
-    
-    int input_finished[2];
-    input_finished[0] = 0;
-    input_finished[1] = 0;
-    
-    int input_to_read[2];
-    input_to_read[0] = 1;
-    input_to_read[1] = 1;
-    
-    int total_samples[2];
-    total_samples[0] = 0;
-    total_samples[1] = 0;
-    
-    int total_out_samples = 0;
-    int nb_finished = 0;
-
-    while (nb_finished < nb_inputs) {
-        int data_present_in_graph = 0;
-        
-        for (int i = 0 ; i < nb_inputs ; i++) {
-            if (input_finished[i] || input_to_read[i] == 0) {
-                continue;
-            }
-            
-            input_to_read[i] = 0;
-            
-            AVFrame *frame = NULL;
-            
-            if (init_input_frame(&frame) > 0) {
-                goto end;
-            }
-            
-            // Decode one frame worth of audio samples.
-            if ((error = decode_audio_frame(frame, input_format_contexts[i], input_codec_contexts[i], &data_present, &finished))) {
-                goto end;
-            }
 
-            // If we are at the end of the file and there are no more samples
-            // in the decoder which are delayed, we are actually finished.
-            // This must not be treated as an error.
-            if (finished && !data_present) {
-                input_finished[i] = 1;
-                nb_finished++;
-                error = 0;
-                av_log(NULL, AV_LOG_INFO, "Input n°%d finished. Write NULL frame \n", i);
-                
-                error = av_buffersrc_write_frame(buffer_contexts[i], NULL);
-                if (error < 0) {
-                    av_log(NULL, AV_LOG_ERROR, "Error writing EOF null frame for input %d\n", i);
-                    goto end;
-                }
-            } else if (data_present) { // If there is decoded data, convert and store it
-                // push the audio data from decoded frame into the filtergraph
-                error = av_buffersrc_write_frame(buffer_contexts[i], frame);
-                if (error < 0) {
-                    av_log(NULL, AV_LOG_ERROR, "Error while feeding the audio filtergraph\n");
-                    goto end;
-                }
-                
-                av_log(NULL, AV_LOG_INFO, "add %d samples on input %d (%d Hz, time=%f, ttime=%f)\n",
-                       frame->nb_samples, i, input_codec_contexts[i]->sample_rate,
-                       (double)frame->nb_samples / input_codec_contexts[i]->sample_rate,
-                       (double)(total_samples[i] += frame->nb_samples) / input_codec_contexts[i]->sample_rate);
+    line[strcspn(line, "\r\n")] = '\0';
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (!*p || *p == '#')
+        return 0;
+
+    clip->gain = 1.0f;
+    if (*p == '{') {
+        error = parse_json_object(p, clip, set_json_clip_field);
+    } else {
+        for (char *field = strtok_r(p, "\t", &saveptr) ; field && error >= 0 ;
+             field = strtok_r(NULL, "\t", &saveptr)) {
+            if (nb_fields == FF_ARRAY_ELEMS(fields)) {
+                av_log(NULL, AV_LOG_ERROR, "A clip has at most %d fields\n", nb_fields);
+                error = AVERROR(EINVAL);
+            } else {
+                error = clip_line_set(clip, fields[nb_fields++], field);
             }
-            
-            av_frame_free(&frame);
-            
-            data_present_in_graph = data_present | data_present_in_graph;
         }
-        
-        if (data_present_in_graph) {
-            AVFrame *filt_frame = av_frame_alloc();
-            // pull filtered audio from the filtergraph
-            while (1) {
-                error = av_buffersink_get_frame(sink, filt_frame);
-                if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
-                    for (int i = 0 ; i < nb_inputs ; i++) {
-                        if (av_buffersrc_get_nb_failed_requests(buffer_contexts[i]) > 0) {
-                            input_to_read[i] = 1;
-                            av_log(NULL, AV_LOG_INFO, "Need to read input %d\n", i);
-                        }
-                    }
-                    
-                    break;
-                }
-                if (error < 0) {
-                    av_log(NULL, AV_LOG_ERROR, "Error while getting filt_frame from sink\n");
-                    goto end;
-                }
-                
-                av_log(NULL, AV_LOG_INFO, "remove %d samples from sink (%d Hz, time=%f, ttime=%f)\n",
-                       filt_frame->nb_samples, output_codec_context->sample_rate,
-                       (double)filt_frame->nb_samples / output_codec_context->sample_rate,
-                       (double)(total_out_samples += filt_frame->nb_samples) / output_codec_context->sample_rate);
-                
-                error = encode_audio_frame(filt_frame, output_format_context, output_codec_context, &data_present);
-                if (error < 0) {
-                    av_log(NULL, AV_LOG_ERROR, "Tracing error at encode_audio_frame() - (error '%s')\n",
-                           get_error_text(error));
-
-                    goto end;
-                }
-                
-                av_frame_unref(filt_frame);
-            }
-            
-            av_frame_free(&filt_frame);
+        if (error >= 0 && nb_fields < 2) {
+            av_log(NULL, AV_LOG_ERROR, "A clip needs a file and an offset\n");
+            error = AVERROR(EINVAL);
+        }
+    }
+    if (error >= 0 && !clip->file) {
+        av_log(NULL, AV_LOG_ERROR, "A clip needs a file\n");
+        error = AVERROR(EINVAL);
+    }
+    if (error < 0)
+        av_freep(&clip->file);
+
+    return error;
+}
+
+// Place every clip of a timeline file on the timeline of ctx.
+static int read_timeline(MixerContext *ctx, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    char *line = NULL;
+    size_t size = 0;
+    int line_number = 0;
+    int nb_clips = 0;
+    int error = 0;
+
+    if (!f) {
+        error = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not open timeline '%s' (error '%s')\n",
+               filename, av_err2str(error));
+        return error;
+    }
+
+    while (getline(&line, &size, f) >= 0) {
+        ClipLine clip = { 0 };
+
+        line_number++;
+        error = parse_clip_line(line, &clip);
+        if (error >= 0 && clip.file) {
+            error = mixer_add_clip(ctx, clip.file, clip.offset, clip.gain, clip.in, clip.out);
+            nb_clips++;
+        }
+        av_free(clip.file);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "%s:%d: invalid clip (error '%s')\n",
+                   filename, line_number, av_err2str(error));
+            break;
+        }
+    }
+    if (error >= 0 && !nb_clips) {
+        av_log(NULL, AV_LOG_ERROR, "Timeline '%s' has no clips\n", filename);
+        error = AVERROR(EINVAL);
+    }
+
+    free(line);
+    fclose(f);
+
+    return error;
+}
+
+/**
+ * Jobs of a manifest, shared by the batch workers. Each worker takes the
+ * next job that nobody has started yet until none is left.
+ */
+typedef struct Batch {
+    BatchJob *jobs;
+    int nb_jobs;
+    atomic_int next_job;
+    // Where every job writes its JSON summary, if anywhere.
+    FILE *stats_json;
+
+    // Held while printing a status line and adding up the totals.
+    pthread_mutex_t lock;
+    int nb_failed;
+    int64_t nb_samples;
+    double duration;
+} Batch;
+
+// Run jobs until the batch is done. The worker's mixer keeps its pools warm from one job to the next.
+static void *batch_worker(void *arg)
+{
+    Batch *batch = arg;
+    MixerContext *ctx = NULL;
+    int index;
+
+    while ((index = atomic_fetch_add(&batch->next_job, 1)) < batch->nb_jobs) {
+        BatchJob *job = &batch->jobs[index];
+        int64_t start_time = av_gettime_relative();
+        MixerStats stats;
+        int error = run_job(&ctx, NULL, job, &stats);
+        double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+
+        pthread_mutex_lock(&batch->lock);
+        if (error < 0) {
+            batch->nb_failed++;
         } else {
-            av_log(NULL, AV_LOG_INFO, "No data in graph\n");
-            for (int i=0; i<nb_inputs; i++) {
-                input_to_read[i] = 1;
-            }
+            batch->nb_samples += stats.nb_samples;
+            batch->duration   += stats.duration;
         }
+        printf("job %d (line %d) ", index + 1, job->line);
+        print_job_status(stdout, job, error, &stats, elapsed);
+        if (batch->stats_json && ctx)
+            write_stats_json(batch->stats_json, ctx);
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    mixer_close(&ctx);
+
+    return NULL;
+}
 
+/**
+ * Run every job of a manifest on nb_workers threads, print one status line
+ * per job as it ends and the aggregate throughput at the end. Fails if the
+ * manifest is invalid or any job failed.
+ */
+static int run_batch(const char *manifest, int nb_workers, const MixerOptions *defaults,
+                     FILE *stats_json)
+{
+    Batch batch = { .lock = PTHREAD_MUTEX_INITIALIZER, .stats_json = stats_json };
+    pthread_t *workers = NULL;
+    int nb_started = 0;
+    int64_t start_time = av_gettime_relative();
+    double elapsed;
+    int error;
+
+    if ((error = read_manifest(manifest, defaults, &batch.jobs, &batch.nb_jobs)) < 0)
+        goto end;
+
+    nb_workers = FFMAX(FFMIN(nb_workers, batch.nb_jobs), 1);
+    if (!(workers = av_calloc(nb_workers, sizeof(*workers)))) {
+        error = AVERROR(ENOMEM);
+        goto end;
     }
+    for (nb_started = 0 ; nb_started < nb_workers ; nb_started++) {
+        if (pthread_create(&workers[nb_started], NULL, batch_worker, &batch)) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start batch worker %d\n", nb_started);
+            break;
+        }
+    }
+    // The workers that did start still run every job.
+    if (!nb_started)
+        batch_worker(&batch);
+    for (int i = 0 ; i < nb_started ; i++)
+        pthread_join(workers[i], NULL);
+
+    elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    printf("batch: %d jobs, %d failed, %" PRId64 " samples (%.1f s) in %.3f s on %d workers: "
+           "%.0f samples/s, %.1fx realtime, %.2f jobs/s\n",
+           batch.nb_jobs, batch.nb_failed, batch.nb_samples, batch.duration, elapsed,
+           FFMAX(nb_started, 1),
+           elapsed > 0 ? batch.nb_samples / elapsed : 0.0,
+           elapsed > 0 ? batch.duration / elapsed : 0.0,
+           elapsed > 0 ? batch.nb_jobs / elapsed : 0.0);
+    if (batch.nb_failed)
+        error = AVERROR_EXTERNAL;
 
-    return 0;
-    
     end:
-        if (error < 0 && error != AVERROR_EOF) {
-            av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(error));
-            exit(1);
+        for (int i = 0 ; i < batch.nb_jobs ; i++)
+            batch_job_free(&batch.jobs[i]);
+        av_freep(&batch.jobs);
+        av_freep(&workers);
+
+    return error;
+}
+
+/**
+ * Daemon mode: clients connect to a Unix socket and send jobs, one per
+ * line as in a manifest, and get one status line back per job. The line
+ * "stats" returns the request latencies and the state of the cache instead.
+ * Every worker thread serves one connection at a time with its own mixer;
+ * all of them share the cache, which keeps filter graphs and encoders
+ * ready for the formats already seen.
+ */
+typedef struct Daemon {
+    int listen_fd;
+    MixerOptions defaults;
+    MixerCache *cache;
+
+    // Held while recording a request.
+    pthread_mutex_t lock;
+    double *latencies;
+    int nb_requests;
+    int nb_failed;
+} Daemon;
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_daemon_stats(Daemon *daemon, FILE *f)
+{
+    MixerCacheStats cache;
+    double p50 = 0, p99 = 0;
+
+    pthread_mutex_lock(&daemon->lock);
+    if (daemon->nb_requests) {
+        qsort(daemon->latencies, daemon->nb_requests, sizeof(*daemon->latencies), compare_doubles);
+        p50 = daemon->latencies[(daemon->nb_requests - 1) / 2];
+        p99 = daemon->latencies[(daemon->nb_requests - 1) * 99 / 100];
+    }
+    fprintf(f, "requests: %d, %d failed, latency p50 %.1f ms, p99 %.1f ms",
+            daemon->nb_requests, daemon->nb_failed, p50 * 1000, p99 * 1000);
+    pthread_mutex_unlock(&daemon->lock);
+
+    mixer_cache_get_stats(daemon->cache, &cache);
+    fprintf(f, "; cache: %" PRId64 " hits, %" PRId64 " misses, %d formats, %d spares ready\n",
+            cache.hits, cache.misses, cache.nb_keys, cache.nb_spares);
+    fflush(f);
+}
+
+static void record_request(Daemon *daemon, double latency, int error)
+{
+    double *latencies;
+
+    pthread_mutex_lock(&daemon->lock);
+    latencies = av_realloc_array(daemon->latencies, daemon->nb_requests + 1, sizeof(*latencies));
+    if (latencies) {
+        daemon->latencies = latencies;
+        daemon->latencies[daemon->nb_requests++] = latency;
+        daemon->nb_failed += error < 0;
+    }
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+// Run every job a client sends until it closes the connection.
+static void serve_connection(Daemon *daemon, int fd, MixerContext **ctx)
+{
+    FILE *in = fdopen(fd, "r");
+    FILE *out = in ? fdopen(dup(fd), "w") : NULL;
+    char *line = NULL;
+    size_t size = 0;
+
+    if (!out) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open a connection\n");
+        if (in)
+            fclose(in);
+        else
+            close(fd);
+        return;
+    }
+
+    while (getline(&line, &size, in) >= 0) {
+        int64_t start_time = av_gettime_relative();
+        BatchJob job = { 0 };
+        MixerStats stats;
+        double elapsed;
+        int error;
+
+        if (!strncmp(line, "stats", 5) && strspn(line + 5, " \t\r\n") == strlen(line + 5)) {
+            print_daemon_stats(daemon, out);
+            continue;
+        }
+
+        if ((error = parse_job_line(line, &daemon->defaults, &job)) < 0) {
+            fprintf(out, "failed: invalid job: %s\n", av_err2str(error));
+            fflush(out);
+            continue;
         }
-        exit(0);
+        if (!job.output)
+            continue;
+
+        error = run_job(ctx, daemon->cache, &job, &stats);
+        elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+        record_request(daemon, elapsed, error);
+        print_job_status(out, &job, error, &stats, elapsed);
+        batch_job_free(&job);
+    }
+
+    free(line);
+    fclose(out);
+    fclose(in);
 }
 
-// Write the header of the output file container
-static int write_output_file_header(AVFormatContext *output_format_context)
+static void *daemon_worker(void *arg)
 {
-    int error;
-    if ((error = avformat_write_header(output_format_context, NULL)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not write output file header (error '%s')\n",
-               get_error_text(error));
-        return error;
+    Daemon *daemon = arg;
+    MixerContext *ctx = NULL;
+    int fd;
+
+    // accept() fails for good once the daemon shuts the socket down.
+    while ((fd = accept(daemon->listen_fd, NULL, NULL)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+        if (fd >= 0)
+            serve_connection(daemon, fd, &ctx);
     }
 
-    return 0;
+    mixer_close(&ctx);
+
+    return NULL;
 }
 
-// Write the trailer of the output file container.
-static int write_output_file_trailer(AVFormatContext *output_format_context)
+/**
+ * Serve jobs on the Unix socket path with nb_workers threads until SIGINT
+ * or SIGTERM, then print the request and cache stats.
+ */
+static int run_daemon(const char *path, int nb_workers, int nb_spares, const MixerOptions *defaults)
 {
-    int error;
-    if ((error = av_write_trailer(output_format_context)) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not write output file trailer (error '%s')\n",
-               get_error_text(error));
+    Daemon daemon = { .listen_fd = -1, .defaults = *defaults, .lock = PTHREAD_MUTEX_INITIALIZER };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    pthread_t *workers = NULL;
+    int nb_started = 0;
+    sigset_t signals;
+    int error, sig;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        av_log(NULL, AV_LOG_ERROR, "Socket path '%s' is too long\n", path);
+        return AVERROR(EINVAL);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((error = mixer_cache_alloc(&daemon.cache, nb_spares)) < 0)
         return error;
+
+    unlink(path);
+    if ((daemon.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(daemon.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(daemon.listen_fd, SOMAXCONN) < 0) {
+        error = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not listen on '%s' (error '%s')\n", path, av_err2str(error));
+        goto end;
     }
 
-    return 0;
+    // Clients that hang up must not kill the daemon, and only this thread
+    // waits for the signals that stop it.
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (!(workers = av_calloc(nb_workers, sizeof(*workers)))) {
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (nb_started = 0 ; nb_started < nb_workers ; nb_started++) {
+        if (pthread_create(&workers[nb_started], NULL, daemon_worker, &daemon))
+            break;
+    }
+    if (!nb_started) {
+        av_log(NULL, AV_LOG_ERROR, "Could not start the daemon workers\n");
+        error = AVERROR(EAGAIN);
+        goto end;
+    }
+
+    av_log(NULL, AV_LOG_WARNING, "Listening on %s with %d workers\n", path, nb_started);
+    sigwait(&signals, &sig);
+
+    // Wake the workers up from accept(); connections being served are finished first.
+    shutdown(daemon.listen_fd, SHUT_RDWR);
+    for (int i = 0 ; i < nb_started ; i++)
+        pthread_join(workers[i], NULL);
+    print_daemon_stats(&daemon, stdout);
+
+    end:
+        if (daemon.listen_fd >= 0) {
+            close(daemon.listen_fd);
+            unlink(path);
+        }
+        mixer_cache_free(&daemon.cache);
+        av_freep(&daemon.latencies);
+        av_freep(&workers);
+
+    return error;
 }
 
-int main(int argc, const char * argv[])
+int main(int argc, char * argv[])
 {
-    if (argc < 4) {
-        printf("usage: ./audio_mixer audio_input1.wav audio_input2.wav audio_output.wav\n");
-        return 1;
+    MixerOptions options;
+    MixerContext *ctx = NULL;
+    const char *manifest = NULL;
+    const char *socket_path = NULL;
+    const char *stats_json = NULL;
+    const char *trace = NULL;
+    const char *timeline = NULL;
+    const char **outputs = NULL;
+    int nb_outputs = 0;
+    const char **matrices = NULL;
+    int nb_matrices = 0;
+    FILE *stats_file = NULL;
+    int log_level = AV_LOG_INFO;
+    const char *weights = NULL;
+    float *input_weights = NULL;
+    int nb_workers = 0;
+    int nb_spares = 1;
+    int nb_inputs;
+    int error;
+    int opt, index;
+
+    mixer_options_default(&options);
+
+    while ((opt = getopt_long(argc, argv, "hqv", long_options, &index)) != -1) {
+        switch (opt) {
+        case OPT_MIXER:
+            if (mixer_options_set(&options, long_options[index].name, optarg) < 0) {
+                usage();
+                return 1;
+            }
+            break;
+        case OPT_WEIGHTS:
+            weights = optarg;
+            break;
+        case OPT_BATCH:
+            manifest = optarg;
+            break;
+        case OPT_JOBS:
+            if ((nb_workers = atoi(optarg)) < 1) {
+                usage();
+                return 1;
+            }
+            break;
+        case OPT_LISTEN:
+            socket_path = optarg;
+            break;
+        case OPT_WARM:
+            if ((nb_spares = atoi(optarg)) < 1) {
+                usage();
+                return 1;
+            }
+            break;
+        case 'q':
+            log_level = AV_LOG_ERROR;
+            break;
+        case 'v':
+            log_level = AV_LOG_DEBUG;
+            break;
+        case OPT_STATS_JSON:
+            stats_json = optarg;
+            options.telemetry = 1;
+            break;
+        case OPT_TRACE:
+            trace = optarg;
+            options.trace = 1;
+            break;
+        case OPT_TIMELINE:
+            timeline = optarg;
+            break;
+        case OPT_OUTPUT:
+            if (av_dynarray_add_nofree(&outputs, &nb_outputs, optarg) < 0)
+                return 1;
+            break;
+        case OPT_MATRIX:
+            if (av_dynarray_add_nofree(&matrices, &nb_matrices, optarg) < 0)
+                return 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
     }
 
-    const char* audio_input1 = argv[1];
-    const char* audio_input2 = argv[2];
-    const char* audio_output = argv[3];
+    if (socket_path) {
+        if (optind < argc || weights || manifest || stats_json || trace || timeline || nb_outputs ||
+            nb_matrices) {
+            usage();
+            return 1;
+        }
+        // Per-frame logs of concurrent jobs would drown everything else.
+        av_log_set_level(FFMIN(log_level, AV_LOG_WARNING));
+        return run_daemon(socket_path, nb_workers ? nb_workers : av_cpu_count(), nb_spares, &options) < 0;
+    }
 
-    av_log_set_level(AV_LOG_VERBOSE);
-    int error;
-    
-    if (open_input_file(audio_input1, &input_format_context_0, &input_codec_context_0) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while opening file 1\n");
-        exit(1);
+    if (manifest ? optind < argc || weights || trace || timeline || nb_outputs || nb_matrices :
+        timeline ? argc - optind != 1 || weights || nb_matrices : argc - optind < 3) {
+        usage();
+        return 1;
     }
-    
-    if (open_input_file(audio_input2, &input_format_context_1, &input_codec_context_1) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while opening file 2\n");
-        exit(1);
+
+    if (stats_json && !(stats_file = strcmp(stats_json, "-") ? fopen(stats_json, "w") : stdout)) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open '%s'\n", stats_json);
+        return 1;
     }
-    
-    // Set up the filtergraph.
-    error = init_filter_graph(&graph, &src0, &src1, &sink);
-    printf("Init err = %d\n", error);
 
-    remove(audio_output);
-    
-    av_log(NULL, AV_LOG_INFO, "Output file : %s\n", audio_output);
-    
-    error = open_output_file(audio_output, input_codec_context_0, &output_format_context, &output_codec_context);
-    printf("open output file err : %d\n", error);
-    
-    if (write_output_file_header(output_format_context) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while writing header outputfile\n");
-        exit(1);
+    if (manifest) {
+        // Per-frame logs of concurrent jobs would drown the status lines.
+        av_log_set_level(FFMIN(log_level, AV_LOG_WARNING));
+        error = run_batch(manifest, nb_workers ? nb_workers : av_cpu_count(), &options, stats_file);
+        if (stats_file && stats_file != stdout)
+            fclose(stats_file);
+        return error < 0;
     }
 
-    process_all();
+    av_log_set_level(log_level);
 
-    
-    if (write_output_file_trailer(output_format_context) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error while writing header outputfile\n");
-        exit(1);
+    // Every argument but the last one is an input; the last one is the output.
+    nb_inputs = argc - optind - 1;
+    if (!(input_weights = av_calloc(nb_inputs, sizeof(*input_weights)))) {
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((error = parse_weights(weights, input_weights, nb_inputs)) < 0 ||
+        (error = mixer_open(&ctx, argv[argc - 1], &options)) < 0)
+        goto end;
+    for (int i = 0 ; i < nb_outputs ; i++) {
+        if ((error = add_output(ctx, outputs[i])) < 0)
+            goto end;
     }
 
-    return 0;
+    if (!timeline)
+        error = run_mix(ctx, argv + optind, input_weights, nb_inputs, matrices, nb_matrices);
+    else if ((error = read_timeline(ctx, timeline)) >= 0)
+        error = mixer_run(ctx);
+
+    // The summary and the trace also tell where a failed mix spent its time.
+    if (stats_file)
+        write_stats_json(stats_file, ctx);
+    if (trace && mixer_write_trace(ctx, trace) < 0 && error >= 0)
+        error = AVERROR(EIO);
+
+    end:
+        mixer_close(&ctx);
+        av_freep(&input_weights);
+        av_freep(&outputs);
+        av_freep(&matrices);
+        if (stats_file && stats_file != stdout)
+            fclose(stats_file);
+        if (error < 0)
+            av_log(NULL, AV_LOG_ERROR, "Mixing failed (error '%s')\n", av_err2str(error));
+
+    return error < 0;
 }
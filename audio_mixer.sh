@@ -1,2 +1,4 @@
 export LD_LIBRARY_PATH=/usr/local/ffmpeg/lib
-gcc -I/usr/local/ffmpeg/include -L/usr/local/ffmpeg/lib audio_mixer.c -o audio_mixer -lavfilter -lavformat -lavcodec -lavutil -lmp3lame -lswresample -lswscale -lavdevice -lpostproc -lpthread -lm -ldl
+# Outputs are written with io_uring when liburing is installed.
+URING=$(pkg-config --exists liburing && echo "-DHAVE_LIBURING=1 $(pkg-config --cflags --libs liburing)")
+gcc -O2 -I/usr/local/ffmpeg/include -L/usr/local/ffmpeg/lib audio_mixer.c mixer.c mixer_cache.c mixer_io.c mixer_pcm_cache.c mixer_probe.c mixer_telemetry.c mix_engine.c -o audio_mixer $URING -lavfilter -lavformat -lavcodec -lavutil -lmp3lame -lswresample -lswscale -lavdevice -lpostproc -lpthread -lm -ldl
@@ -0,0 +1,199 @@
+#!/bin/bash
+# Throughput benchmark of the mixer.
+# Generates synthetic inputs with ffmpeg (tones and noise over several sample
+# rates, channel counts, sample formats, durations and codecs), mixes every
+# case with every engine it supports, and prints the median samples/s,
+# realtime factor, peak RSS and allocations of the runs. The results are
+# compared with a stored baseline; a case that got slower, bigger or
+# allocates more than the threshold allows fails the run.
+#
+# usage: ./benchmark.sh [--runs N] [--threshold PERCENT] [--baseline FILE] [--save-baseline] [--case NAME]
+#
+# FFMPEG is the ffmpeg command used to generate the inputs (default: ffmpeg),
+# BENCH_DIR where they are kept between runs (default: /tmp/audio_mixer_bench).
+export LD_LIBRARY_PATH=/usr/local/ffmpeg/lib
+
+FFMPEG=${FFMPEG:-ffmpeg}
+BENCH_DIR=${BENCH_DIR:-/tmp/audio_mixer_bench}
+MIXER=./audio_mixer
+RUNS=3
+THRESHOLD=10
+BASELINE=benchmark_baseline.tsv
+SAVE_BASELINE=0
+ONLY_CASE=
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+    --runs)          RUNS=$2; shift ;;
+    --threshold)     THRESHOLD=$2; shift ;;
+    --baseline)      BASELINE=$2; shift ;;
+    --save-baseline) SAVE_BASELINE=1 ;;
+    --case)          ONLY_CASE=$2; shift ;;
+    *)
+        sed -n 's/^# usage: //p' "$0"
+        exit 1 ;;
+    esac
+    shift
+done
+
+if [ ! -x "$MIXER" ]; then
+    echo "$MIXER not found, build it with ./audio_mixer.sh first" >&2
+    exit 1
+fi
+
+# GNU time reports the peak RSS; without it the column stays empty.
+TIME=
+if /usr/bin/time -f %M -o /dev/null true 2>/dev/null; then
+    TIME=/usr/bin/time
+fi
+
+mkdir -p "$BENCH_DIR/inputs"
+
+# gen NAME SOURCE RATE CHANNELS SECONDS CODEC
+# Generate one input once; the noise has a fixed seed so that every run mixes the same samples.
+gen() {
+    local file="$BENCH_DIR/inputs/$1"
+    [ -s "$file" ] && return
+    "$FFMPEG" -nostdin -loglevel error -y -f lavfi -i "$2:sample_rate=$3:duration=$5" \
+              -ac "$4" -c:a "$6" -fflags +bitexact -map_metadata -1 "$file" || exit 1
+}
+
+TONE="sine=frequency=440"
+TONE2="sine=frequency=997"
+NOISE="anoisesrc=color=pink:seed=42:amplitude=0.3"
+NOISE2="anoisesrc=color=white:seed=7:amplitude=0.1"
+
+gen tone_44k_s16_st.wav    "$TONE"   44100 2 60 pcm_s16le
+gen noise_44k_s16_st.wav   "$NOISE"  44100 2 60 pcm_s16le
+gen tone2_44k_s16_st.wav   "$TONE2"  44100 2 60 pcm_s16le
+gen noise2_44k_s16_st.wav  "$NOISE2" 44100 2 60 pcm_s16le
+gen tone_44k_s32_st.wav    "$TONE"   44100 2 60 pcm_s32le
+gen noise_44k_s32_st.wav   "$NOISE"  44100 2 60 pcm_s32le
+gen tone_48k_flt_st.wav    "$TONE"   48000 2 60 pcm_f32le
+gen noise_48k_flt_st.wav   "$NOISE"  48000 2 60 pcm_f32le
+gen tone_44k_s16_mono.wav  "$TONE"   44100 1 60 pcm_s16le
+gen noise_48k_s16_st.wav   "$NOISE"  48000 2 60 pcm_s16le
+gen tone_44k_st.mp3        "$TONE"   44100 2 60 libmp3lame
+gen noise_44k_st.mp3       "$NOISE"  44100 2 60 libmp3lame
+gen tone_44k_st.flac       "$TONE"   44100 2 60 flac
+gen noise_44k_st.flac      "$NOISE"  44100 2 60 flac
+gen jingle_44k_s16_st.wav  "$TONE2"  44100 2 2  pcm_s16le
+gen voice_44k_s16_st.wav   "$NOISE2" 44100 2 2  pcm_s16le
+
+# name|engines|options|inputs
+# The native engine falls back to amix when the formats differ, so cases
+# with mixed formats only run amix.
+CASES=(
+    "pcm16_2in|amix native||tone_44k_s16_st.wav noise_44k_s16_st.wav"
+    "pcm16_2in_threads|amix native|--threads 2|tone_44k_s16_st.wav noise_44k_s16_st.wav"
+    "pcm16_8in|amix native||tone_44k_s16_st.wav noise_44k_s16_st.wav tone2_44k_s16_st.wav noise2_44k_s16_st.wav tone_44k_s16_st.wav noise_44k_s16_st.wav tone2_44k_s16_st.wav noise2_44k_s16_st.wav"
+    "pcm16_2in_no_mmap|amix native|--no-mmap|tone_44k_s16_st.wav noise_44k_s16_st.wav"
+    "pcm32_2in|amix native||tone_44k_s32_st.wav noise_44k_s32_st.wav"
+    "float48k_2in|amix native||tone_48k_flt_st.wav noise_48k_flt_st.wav"
+    "mixed_rates_layouts|amix||tone_44k_s16_mono.wav noise_48k_s16_st.wav"
+    "mp3_2in|amix native||tone_44k_st.mp3 noise_44k_st.mp3"
+    "mp3_2in_threads|amix native|--threads 3|tone_44k_st.mp3 noise_44k_st.mp3"
+    "flac_2in|amix||tone_44k_st.flac noise_44k_st.flac"
+    "jingle_2in|amix native||jingle_44k_s16_st.wav voice_44k_s16_st.wav"
+)
+
+# median of the numbers on stdin
+median() {
+    sort -g | awk '{ v[NR] = $1 } END { if (NR) print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# run_case NAME ENGINE OPTIONS INPUTS
+# Print "name engine samples/s realtime peak_rss_kb allocations" with the medians of RUNS runs.
+run_case() {
+    local work="$BENCH_DIR/run" inputs=() rates= realtimes= rss= allocs=
+    mkdir -p "$work"
+    for input in $4; do
+        inputs+=("$BENCH_DIR/inputs/$input")
+    done
+
+    for run in $(seq "$RUNS"); do
+        rm -f "$work/stats.json" "$work/rss" "$work/log"
+        if [ -n "$TIME" ]; then
+            $TIME -f %M -o "$work/rss" "$MIXER" --engine "$2" $3 --debug-alloc \
+                  --stats-json "$work/stats.json" "${inputs[@]}" "$work/out.wav" 2>"$work/log"
+        else
+            "$MIXER" --engine "$2" $3 --debug-alloc \
+                     --stats-json "$work/stats.json" "${inputs[@]}" "$work/out.wav" 2>"$work/log"
+        fi
+        if [ $? -ne 0 ] || [ ! -s "$work/stats.json" ]; then
+            echo "$1/$2 failed:" >&2
+            tail -5 "$work/log" >&2
+            return 1
+        fi
+
+        # The summary is one line of JSON; its first samples and elapsed keys are the totals.
+        samples=$(grep -o '"samples": [0-9]*' "$work/stats.json" | head -1 | cut -d' ' -f2)
+        elapsed=$(grep -o '"elapsed": [0-9.]*' "$work/stats.json" | head -1 | cut -d' ' -f2)
+        rates="$rates $(awk -v s="$samples" -v e="$elapsed" 'BEGIN { print (e > 0 ? s / e : 0) }')"
+        realtimes="$realtimes $(grep -o '"realtime": [0-9.]*' "$work/stats.json" | cut -d' ' -f2)"
+        [ -s "$work/rss" ] && rss="$rss $(tail -1 "$work/rss")"
+        # alloc total: 0.0 allocations/s (total: F frames, P packets, B buffers)
+        allocs="$allocs $(sed -n 's/.*alloc total.*total: \([0-9]*\) frames, \([0-9]*\) packets, \([0-9]*\) buffers.*/\1 \2 \3/p' "$work/log" |
+                          awk '{ print $1 + $2 + $3 }')"
+    done
+
+    printf "%s\t%s\t%.0f\t%.1f\t%s\t%s\n" "$1" "$2" \
+           "$(echo $rates | tr ' ' '\n' | median)" \
+           "$(echo $realtimes | tr ' ' '\n' | median)" \
+           "$(echo $rss | tr ' ' '\n' | median)" \
+           "$(echo $allocs | tr ' ' '\n' | median)"
+}
+
+RESULTS="$BENCH_DIR/results.tsv"
+: > "$RESULTS"
+failed=0
+
+for entry in "${CASES[@]}"; do
+    IFS='|' read -r name engines options inputs <<< "$entry"
+    [ -n "$ONLY_CASE" ] && [ "$ONLY_CASE" != "$name" ] && continue
+    for engine in $engines; do
+        run_case "$name" "$engine" "$options" "$inputs" >> "$RESULTS" || failed=1
+    done
+done
+
+# Print every result next to its baseline, and fail on regressions: fewer
+# samples/s, a bigger peak RSS or more allocations than the threshold allows.
+# The allocation counts move a little with thread timing, hence their slack.
+awk -F'\t' -v threshold="$THRESHOLD" -v baseline="$BASELINE" '
+    BEGIN {
+        while ((getline line < baseline) > 0) {
+            split(line, b, "\t")
+            base[b[1] "/" b[2]] = line
+        }
+        printf "%-24s %-7s %14s %9s %10s %8s   %s\n",
+               "case", "engine", "samples/s", "realtime", "rss (kB)", "allocs", "vs baseline"
+    }
+    {
+        key = $1 "/" $2
+        diff = ""
+        if (key in base) {
+            split(base[key], b, "\t")
+            rate = b[3] > 0 ? ($3 - b[3]) * 100 / b[3] : 0
+            diff = sprintf("%+.1f%% samples/s", rate)
+            if (rate < -threshold) { diff = diff " SLOWER"; regressions++ }
+            if (b[5] != "" && $5 > b[5] * (1 + threshold / 100)) { diff = diff ", rss " b[5] " -> " $5; regressions++ }
+            if (b[6] != "" && $6 > b[6] * (1 + threshold / 100) + 16) { diff = diff ", allocs " b[6] " -> " $6; regressions++ }
+        } else {
+            diff = "new"
+        }
+        printf "%-24s %-7s %14.0f %9.1f %10s %8s   %s\n", $1, $2, $3, $4, $5, $6, diff
+    }
+    END {
+        if (regressions) {
+            printf "%d regressions beyond %s%%\n", regressions, threshold
+            exit 1
+        }
+    }
+' "$RESULTS" || failed=1
+
+if [ "$SAVE_BASELINE" = 1 ]; then
+    cp "$RESULTS" "$BASELINE"
+    echo "Saved the baseline to $BASELINE"
+fi
+
+exit $failed
@@ -0,0 +1,8 @@
+# Mix the same inputs with the amix filter graph and with the native engine,
+# then print the throughput of both runs.
+# usage: ./compare_engines.sh audio_input1.wav audio_input2.wav [audio_input3.wav ...]
+export LD_LIBRARY_PATH=/usr/local/ffmpeg/lib
+
+for engine in amix native; do
+    ./audio_mixer --engine $engine "$@" /tmp/compare_engines_$engine.wav 2>&1 | grep "^Mixed"
+done
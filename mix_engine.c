@@ -0,0 +1,527 @@
+#include <math.h>
+#include <string.h>
+
+#include "libavutil/common.h"
+#include "libavutil/cpu.h"
+#include "libavutil/mem.h"
+
+#include "mix_engine.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIX_ENGINE_X86 1
+#else
+#define MIX_ENGINE_X86 0
+#endif
+
+// Scale factors between integer samples and full scale.
+#define S16_SCALE 32768.0f
+#define S32_SCALE 2147483648.0
+
+/****** C kernels ********/
+
+static void acc_s16_c(float *acc, const int16_t *src, float weight, int n)
+{
+    for (int i = 0 ; i < n ; i++)
+        acc[i] += src[i] * weight;
+}
+
+static void acc_s32_c(double *acc, const int32_t *src, double weight, int n)
+{
+    for (int i = 0 ; i < n ; i++)
+        acc[i] += src[i] * weight;
+}
+
+static void acc_flt_c(float *acc, const float *src, float weight, int n)
+{
+    for (int i = 0 ; i < n ; i++)
+        acc[i] += src[i] * weight;
+}
+
+static void store_s16_c(int16_t *dst, const float *acc, int n)
+{
+    for (int i = 0 ; i < n ; i++)
+        dst[i] = av_clip_int16(lrintf(av_clipf(acc[i] * S16_SCALE, -S16_SCALE, S16_SCALE)));
+}
+
+static void store_s32_c(int32_t *dst, const double *acc, int n)
+{
+    for (int i = 0 ; i < n ; i++)
+        dst[i] = av_clipl_int32(llrint(av_clipd(acc[i] * S32_SCALE, -S32_SCALE, S32_SCALE)));
+}
+
+static void store_flt_c(float *dst, const float *acc, int n, int clip)
+{
+    if (!clip) {
+        memcpy(dst, acc, n * sizeof(*dst));
+        return;
+    }
+    for (int i = 0 ; i < n ; i++)
+        dst[i] = av_clipf(acc[i], -1.0f, 1.0f);
+}
+
+// Stores between accumulator and output types that only occur when the
+// input and output formats differ in precision; they are not vectorized.
+
+static void store_s32_from_flt_c(int32_t *dst, const float *acc, int n)
+{
+    for (int i = 0 ; i < n ; i++)
+        dst[i] = av_clipl_int32(llrint(av_clipd(acc[i] * S32_SCALE, -S32_SCALE, S32_SCALE)));
+}
+
+static void store_s16_from_dbl_c(int16_t *dst, const double *acc, int n)
+{
+    for (int i = 0 ; i < n ; i++)
+        dst[i] = av_clip_int16(lrint(av_clipd(acc[i] * S16_SCALE, -S16_SCALE, S16_SCALE)));
+}
+
+static void store_flt_from_dbl_c(float *dst, const double *acc, int n, int clip)
+{
+    for (int i = 0 ; i < n ; i++)
+        dst[i] = clip ? av_clipd(acc[i], -1.0, 1.0) : acc[i];
+}
+
+#if MIX_ENGINE_X86
+
+/****** SSE2 kernels ********/
+
+__attribute__((target("sse2")))
+static void acc_s16_sse2(float *acc, const int16_t *src, float weight, int n)
+{
+    const __m128 w = _mm_set1_ps(weight);
+    int i = 0;
+
+    for (; i + 8 <= n ; i += 8) {
+        __m128i s  = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(acc + i,     _mm_add_ps(_mm_loadu_ps(acc + i),     _mm_mul_ps(_mm_cvtepi32_ps(lo), w)));
+        _mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4), _mm_mul_ps(_mm_cvtepi32_ps(hi), w)));
+    }
+    acc_s16_c(acc + i, src + i, weight, n - i);
+}
+
+__attribute__((target("sse2")))
+static void acc_s32_sse2(double *acc, const int32_t *src, double weight, int n)
+{
+    const __m128d w = _mm_set1_pd(weight);
+    int i = 0;
+
+    for (; i + 4 <= n ; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128d lo = _mm_cvtepi32_pd(s);
+        __m128d hi = _mm_cvtepi32_pd(_mm_srli_si128(s, 8));
+        _mm_storeu_pd(acc + i,     _mm_add_pd(_mm_loadu_pd(acc + i),     _mm_mul_pd(lo, w)));
+        _mm_storeu_pd(acc + i + 2, _mm_add_pd(_mm_loadu_pd(acc + i + 2), _mm_mul_pd(hi, w)));
+    }
+    acc_s32_c(acc + i, src + i, weight, n - i);
+}
+
+__attribute__((target("sse2")))
+static void acc_flt_sse2(float *acc, const float *src, float weight, int n)
+{
+    const __m128 w = _mm_set1_ps(weight);
+    int i = 0;
+
+    for (; i + 8 <= n ; i += 8) {
+        _mm_storeu_ps(acc + i,     _mm_add_ps(_mm_loadu_ps(acc + i),     _mm_mul_ps(_mm_loadu_ps(src + i),     w)));
+        _mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4), _mm_mul_ps(_mm_loadu_ps(src + i + 4), w)));
+    }
+    acc_flt_c(acc + i, src + i, weight, n - i);
+}
+
+__attribute__((target("sse2")))
+static void store_s16_sse2(int16_t *dst, const float *acc, int n)
+{
+    const __m128 scale = _mm_set1_ps(S16_SCALE);
+    const __m128 min   = _mm_set1_ps(-S16_SCALE);
+    const __m128 max   = _mm_set1_ps(S16_SCALE);
+    int i = 0;
+
+    // The clamp keeps the conversion in range; packs saturates the rest.
+    for (; i + 8 <= n ; i += 8) {
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(acc + i),     scale), min), max);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(acc + i + 4), scale), min), max);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+    }
+    store_s16_c(dst + i, acc + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void store_s32_sse2(int32_t *dst, const double *acc, int n)
+{
+    const __m128d scale = _mm_set1_pd(S32_SCALE);
+    const __m128d min   = _mm_set1_pd(-S32_SCALE);
+    const __m128d max   = _mm_set1_pd(S32_SCALE - 1.0);
+    int i = 0;
+
+    for (; i + 4 <= n ; i += 4) {
+        __m128d a = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(acc + i),     scale), min), max);
+        __m128d b = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(acc + i + 2), scale), min), max);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi64(_mm_cvtpd_epi32(a), _mm_cvtpd_epi32(b)));
+    }
+    store_s32_c(dst + i, acc + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void store_flt_sse2(float *dst, const float *acc, int n, int clip)
+{
+    const __m128 min = _mm_set1_ps(-1.0f);
+    const __m128 max = _mm_set1_ps(1.0f);
+    int i = 0;
+
+    if (!clip) {
+        memcpy(dst, acc, n * sizeof(*dst));
+        return;
+    }
+    for (; i + 4 <= n ; i += 4)
+        _mm_storeu_ps(dst + i, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(acc + i), min), max));
+    store_flt_c(dst + i, acc + i, n - i, clip);
+}
+
+/****** AVX2 kernels ********/
+
+__attribute__((target("avx2")))
+static void acc_s16_avx2(float *acc, const int16_t *src, float weight, int n)
+{
+    const __m256 w = _mm256_set1_ps(weight);
+    int i = 0;
+
+    for (; i + 16 <= n ; i += 16) {
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i))));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i + 8))));
+        _mm256_storeu_ps(acc + i,     _mm256_add_ps(_mm256_loadu_ps(acc + i),     _mm256_mul_ps(lo, w)));
+        _mm256_storeu_ps(acc + i + 8, _mm256_add_ps(_mm256_loadu_ps(acc + i + 8), _mm256_mul_ps(hi, w)));
+    }
+    acc_s16_c(acc + i, src + i, weight, n - i);
+}
+
+__attribute__((target("avx2")))
+static void acc_s32_avx2(double *acc, const int32_t *src, double weight, int n)
+{
+    const __m256d w = _mm256_set1_pd(weight);
+    int i = 0;
+
+    for (; i + 8 <= n ; i += 8) {
+        __m256d lo = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(src + i)));
+        __m256d hi = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(src + i + 4)));
+        _mm256_storeu_pd(acc + i,     _mm256_add_pd(_mm256_loadu_pd(acc + i),     _mm256_mul_pd(lo, w)));
+        _mm256_storeu_pd(acc + i + 4, _mm256_add_pd(_mm256_loadu_pd(acc + i + 4), _mm256_mul_pd(hi, w)));
+    }
+    acc_s32_c(acc + i, src + i, weight, n - i);
+}
+
+__attribute__((target("avx2")))
+static void acc_flt_avx2(float *acc, const float *src, float weight, int n)
+{
+    const __m256 w = _mm256_set1_ps(weight);
+    int i = 0;
+
+    for (; i + 16 <= n ; i += 16) {
+        _mm256_storeu_ps(acc + i,     _mm256_add_ps(_mm256_loadu_ps(acc + i),     _mm256_mul_ps(_mm256_loadu_ps(src + i),     w)));
+        _mm256_storeu_ps(acc + i + 8, _mm256_add_ps(_mm256_loadu_ps(acc + i + 8), _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), w)));
+    }
+    acc_flt_c(acc + i, src + i, weight, n - i);
+}
+
+__attribute__((target("avx2")))
+static void store_s16_avx2(int16_t *dst, const float *acc, int n)
+{
+    const __m256 scale = _mm256_set1_ps(S16_SCALE);
+    const __m256 min   = _mm256_set1_ps(-S16_SCALE);
+    const __m256 max   = _mm256_set1_ps(S16_SCALE);
+    int i = 0;
+
+    for (; i + 16 <= n ; i += 16) {
+        __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(acc + i),     scale), min), max);
+        __m256 b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(acc + i + 8), scale), min), max);
+        // packs works within 128-bit lanes; restore the sample order afterwards.
+        __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+    store_s16_c(dst + i, acc + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void store_s32_avx2(int32_t *dst, const double *acc, int n)
+{
+    const __m256d scale = _mm256_set1_pd(S32_SCALE);
+    const __m256d min   = _mm256_set1_pd(-S32_SCALE);
+    const __m256d max   = _mm256_set1_pd(S32_SCALE - 1.0);
+    int i = 0;
+
+    for (; i + 4 <= n ; i += 4) {
+        __m256d a = _mm256_min_pd(_mm256_max_pd(_mm256_mul_pd(_mm256_loadu_pd(acc + i), scale), min), max);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtpd_epi32(a));
+    }
+    store_s32_c(dst + i, acc + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void store_flt_avx2(float *dst, const float *acc, int n, int clip)
+{
+    const __m256 min = _mm256_set1_ps(-1.0f);
+    const __m256 max = _mm256_set1_ps(1.0f);
+    int i = 0;
+
+    if (!clip) {
+        memcpy(dst, acc, n * sizeof(*dst));
+        return;
+    }
+    for (; i + 8 <= n ; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(acc + i), min), max));
+    store_flt_c(dst + i, acc + i, n - i, clip);
+}
+
+#endif // MIX_ENGINE_X86
+
+int mix_engine_supports(enum AVSampleFormat sample_fmt)
+{
+    switch (av_get_packed_sample_fmt(sample_fmt)) {
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S32:
+    case AV_SAMPLE_FMT_FLT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int mix_engine_init(MixEngine *engine, enum AVSampleFormat in_fmt,
+                    enum AVSampleFormat out_fmt, int channels,
+                    enum MixOverflow overflow)
+{
+    int cpu_flags = av_get_cpu_flags();
+
+    if (!mix_engine_supports(in_fmt) || !mix_engine_supports(out_fmt) || channels <= 0)
+        return AVERROR(EINVAL);
+
+    memset(engine, 0, sizeof(*engine));
+    engine->in_fmt     = in_fmt;
+    engine->out_fmt    = out_fmt;
+    engine->channels   = channels;
+    engine->overflow   = overflow;
+    engine->use_double = av_get_packed_sample_fmt(in_fmt) == AV_SAMPLE_FMT_S32;
+
+    engine->isa       = "c";
+    engine->acc_s16   = acc_s16_c;
+    engine->acc_s32   = acc_s32_c;
+    engine->acc_flt   = acc_flt_c;
+    engine->store_s16 = store_s16_c;
+    engine->store_s32 = store_s32_c;
+    engine->store_flt = store_flt_c;
+
+#if MIX_ENGINE_X86
+    if (cpu_flags & AV_CPU_FLAG_SSE2) {
+        engine->isa       = "sse2";
+        engine->acc_s16   = acc_s16_sse2;
+        engine->acc_s32   = acc_s32_sse2;
+        engine->acc_flt   = acc_flt_sse2;
+        engine->store_s16 = store_s16_sse2;
+        engine->store_s32 = store_s32_sse2;
+        engine->store_flt = store_flt_sse2;
+    }
+    if (cpu_flags & AV_CPU_FLAG_AVX2) {
+        engine->isa       = "avx2";
+        engine->acc_s16   = acc_s16_avx2;
+        engine->acc_s32   = acc_s32_avx2;
+        engine->acc_flt   = acc_flt_avx2;
+        engine->store_s16 = store_s16_avx2;
+        engine->store_s32 = store_s32_avx2;
+        engine->store_flt = store_flt_avx2;
+    }
+#else
+    (void)cpu_flags;
+#endif
+
+    return 0;
+}
+
+void mix_engine_uninit(MixEngine *engine)
+{
+    av_freep(&engine->acc);
+    engine->acc_samples = 0;
+}
+
+// Size in bytes of one accumulator element.
+static int acc_bytes(const MixEngine *engine)
+{
+    return engine->use_double ? sizeof(double) : sizeof(float);
+}
+
+// Start of the accumulator of one plane (planar outputs) or of all channels.
+// Planes are acc_samples elements apart, whatever the current block size.
+static uint8_t *acc_plane(const MixEngine *engine, int plane)
+{
+    return (uint8_t *)engine->acc + (size_t)plane * engine->acc_samples * acc_bytes(engine);
+}
+
+int mix_engine_begin(MixEngine *engine, int nb_samples)
+{
+    // Packed outputs use a single plane holding every channel.
+    int planar = av_sample_fmt_is_planar(engine->out_fmt);
+
+    if (nb_samples > engine->acc_samples) {
+        av_freep(&engine->acc);
+        engine->acc = av_malloc_array((size_t)nb_samples * engine->channels, acc_bytes(engine));
+        if (!engine->acc) {
+            engine->acc_samples = 0;
+            return AVERROR(ENOMEM);
+        }
+        engine->acc_samples = nb_samples;
+    }
+
+    engine->nb_samples = nb_samples;
+    for (int p = 0 ; p < (planar ? engine->channels : 1) ; p++)
+        memset(acc_plane(engine, p), 0,
+               (size_t)nb_samples * (planar ? 1 : engine->channels) * acc_bytes(engine));
+
+    return 0;
+}
+
+// Accumulate n contiguous samples of the input format.
+static void add_contiguous(MixEngine *engine, uint8_t *acc, const uint8_t *src,
+                           int n, float weight)
+{
+    switch (av_get_packed_sample_fmt(engine->in_fmt)) {
+    case AV_SAMPLE_FMT_S16:
+        engine->acc_s16((float *)acc, (const int16_t *)src, weight / S16_SCALE, n);
+        break;
+    case AV_SAMPLE_FMT_S32:
+        engine->acc_s32((double *)acc, (const int32_t *)src, weight / S32_SCALE, n);
+        break;
+    default:
+        engine->acc_flt((float *)acc, (const float *)src, weight, n);
+        break;
+    }
+}
+
+// Accumulate n samples of one channel, interleaving or deinterleaving on the way.
+static void add_strided(MixEngine *engine, uint8_t *acc, int acc_stride,
+                        const uint8_t *src, int src_stride, int n, float weight)
+{
+    switch (av_get_packed_sample_fmt(engine->in_fmt)) {
+    case AV_SAMPLE_FMT_S16: {
+        const int16_t *s = (const int16_t *)src;
+        float *a = (float *)acc;
+        float w = weight / S16_SCALE;
+        for (int i = 0 ; i < n ; i++)
+            a[i * acc_stride] += s[i * src_stride] * w;
+        break;
+    }
+    case AV_SAMPLE_FMT_S32: {
+        const int32_t *s = (const int32_t *)src;
+        double *a = (double *)acc;
+        double w = weight / S32_SCALE;
+        for (int i = 0 ; i < n ; i++)
+            a[i * acc_stride] += s[i * src_stride] * w;
+        break;
+    }
+    default: {
+        const float *s = (const float *)src;
+        float *a = (float *)acc;
+        for (int i = 0 ; i < n ; i++)
+            a[i * acc_stride] += s[i * src_stride] * weight;
+        break;
+    }
+    }
+}
+
+void mix_engine_add(MixEngine *engine, const uint8_t * const *src,
+                    int nb_samples, int offset, float weight)
+{
+    int in_planar  = av_sample_fmt_is_planar(engine->in_fmt);
+    int out_planar = av_sample_fmt_is_planar(engine->out_fmt);
+    int channels   = engine->channels;
+    int bps        = av_get_bytes_per_sample(engine->in_fmt);
+    int abps       = acc_bytes(engine);
+
+    nb_samples = FFMIN(nb_samples, engine->nb_samples - offset);
+    if (nb_samples <= 0)
+        return;
+
+    if (in_planar == out_planar) {
+        if (in_planar) {
+            for (int c = 0 ; c < channels ; c++)
+                add_contiguous(engine, acc_plane(engine, c) + (size_t)offset * abps,
+                               src[c], nb_samples, weight);
+        } else {
+            add_contiguous(engine, acc_plane(engine, 0) + (size_t)offset * channels * abps,
+                           src[0], nb_samples * channels, weight);
+        }
+        return;
+    }
+
+    for (int c = 0 ; c < channels ; c++) {
+        const uint8_t *s = in_planar ? src[c] : src[0] + c * bps;
+        uint8_t *a = out_planar ? acc_plane(engine, c) + (size_t)offset * abps
+                                : acc_plane(engine, 0) + ((size_t)offset * channels + c) * abps;
+        add_strided(engine, a, out_planar ? 1 : channels,
+                    s, in_planar ? 1 : channels, nb_samples, weight);
+    }
+}
+
+void mix_engine_add_routed(MixEngine *engine, const uint8_t * const *src, int in_channels,
+                           int nb_samples, int offset, const float *matrix)
+{
+    int in_planar  = av_sample_fmt_is_planar(engine->in_fmt);
+    int out_planar = av_sample_fmt_is_planar(engine->out_fmt);
+    int channels   = engine->channels;
+    int bps        = av_get_bytes_per_sample(engine->in_fmt);
+    int abps       = acc_bytes(engine);
+
+    nb_samples = FFMIN(nb_samples, engine->nb_samples - offset);
+    if (nb_samples <= 0)
+        return;
+
+    for (int o = 0 ; o < channels ; o++) {
+        uint8_t *a = out_planar ? acc_plane(engine, o) + (size_t)offset * abps
+                                : acc_plane(engine, 0) + ((size_t)offset * channels + o) * abps;
+
+        for (int c = 0 ; c < in_channels ; c++) {
+            const uint8_t *s = in_planar ? src[c] : src[0] + c * bps;
+            float gain = matrix[o * in_channels + c];
+
+            if (gain == 0.0f)
+                continue;
+            if (in_planar && out_planar)
+                add_contiguous(engine, a, s, nb_samples, gain);
+            else
+                add_strided(engine, a, out_planar ? 1 : channels,
+                            s, in_planar ? 1 : in_channels, nb_samples, gain);
+        }
+    }
+}
+
+void mix_engine_end(MixEngine *engine, uint8_t * const *dst)
+{
+    int planar = av_sample_fmt_is_planar(engine->out_fmt);
+    int planes = planar ? engine->channels : 1;
+    int n      = planar ? engine->nb_samples : engine->nb_samples * engine->channels;
+    int clip   = engine->overflow == MIX_OVERFLOW_CLIP;
+
+    for (int p = 0 ; p < planes ; p++) {
+        const uint8_t *acc = acc_plane(engine, p);
+
+        switch (av_get_packed_sample_fmt(engine->out_fmt)) {
+        case AV_SAMPLE_FMT_S16:
+            if (engine->use_double)
+                store_s16_from_dbl_c((int16_t *)dst[p], (const double *)acc, n);
+            else
+                engine->store_s16((int16_t *)dst[p], (const float *)acc, n);
+            break;
+        case AV_SAMPLE_FMT_S32:
+            if (engine->use_double)
+                engine->store_s32((int32_t *)dst[p], (const double *)acc, n);
+            else
+                store_s32_from_flt_c((int32_t *)dst[p], (const float *)acc, n);
+            break;
+        default:
+            if (engine->use_double)
+                store_flt_from_dbl_c((float *)dst[p], (const double *)acc, n, clip);
+            else
+                engine->store_flt((float *)dst[p], (const float *)acc, n, clip);
+            break;
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef MIX_ENGINE_H
+#define MIX_ENGINE_H
+
+#include <libavutil/samplefmt.h>
+
+/**
+ * Native mixing engine.
+ * Sums blocks of PCM samples without going through libavfilter. The inputs
+ * are accumulated in full scale floating point (float for S16 and float
+ * inputs, double for S32 inputs) and then stored in the output format.
+ * S16, S32 and float are supported, planar or packed, for both the inputs
+ * and the output. Inputs with other channels than the output are routed
+ * through a matrix while they are summed. The SSE2 or AVX2 kernels are picked at runtime from
+ * av_get_cpu_flags(); the C kernels are used everywhere else.
+ */
+
+// What happens to samples that end up beyond full scale.
+enum MixOverflow {
+    // The sum itself cannot overflow. Integer outputs saturate at the limits
+    // of their format; float outputs are left unbounded, as amix does.
+    MIX_OVERFLOW_SATURATE,
+    // Every output, float included, is clipped to [-1.0, 1.0].
+    MIX_OVERFLOW_CLIP,
+};
+
+typedef struct MixEngine {
+    enum AVSampleFormat in_fmt;
+    enum AVSampleFormat out_fmt;
+    int channels;
+    enum MixOverflow overflow;
+
+    // Accumulator of the current block, laid out like the output format.
+    // acc_samples is its capacity in samples per channel.
+    void *acc;
+    int acc_samples;
+    int nb_samples;
+    int use_double;
+
+    // Name of the instruction set of the selected kernels.
+    const char *isa;
+
+    void (*acc_s16)(float *acc, const int16_t *src, float weight, int n);
+    void (*acc_s32)(double *acc, const int32_t *src, double weight, int n);
+    void (*acc_flt)(float *acc, const float *src, float weight, int n);
+    void (*store_s16)(int16_t *dst, const float *acc, int n);
+    void (*store_s32)(int32_t *dst, const double *acc, int n);
+    void (*store_flt)(float *dst, const float *acc, int n, int clip);
+} MixEngine;
+
+// Whether the engine can read or write this sample format.
+int mix_engine_supports(enum AVSampleFormat sample_fmt);
+
+int mix_engine_init(MixEngine *engine, enum AVSampleFormat in_fmt,
+                    enum AVSampleFormat out_fmt, int channels,
+                    enum MixOverflow overflow);
+
+void mix_engine_uninit(MixEngine *engine);
+
+// Start a new block of nb_samples silent samples per channel.
+int mix_engine_begin(MixEngine *engine, int nb_samples);
+
+/**
+ * Add nb_samples samples of one input, scaled by weight, to the current
+ * block starting at sample offset. src holds one pointer per plane, in the
+ * input format of the engine.
+ */
+void mix_engine_add(MixEngine *engine, const uint8_t * const *src,
+                    int nb_samples, int offset, float weight);
+
+/**
+ * Like mix_engine_add(), for an input of in_channels channels routed to the
+ * channels of the output through matrix: matrix[o * in_channels + c] is the
+ * gain, weight included, of input channel c in output channel o. Every
+ * output channel accumulates its input channels straight from src, so a
+ * downmix or upmix costs no pass of its own; zero gains are skipped.
+ */
+void mix_engine_add_routed(MixEngine *engine, const uint8_t * const *src, int in_channels,
+                           int nb_samples, int offset, const float *matrix);
+
+// Store the current block into dst, one pointer per plane of the output format.
+void mix_engine_end(MixEngine *engine, uint8_t * const *dst);
+
+#endif // MIX_ENGINE_H
@@ -0,0 +1,4794 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+
+#include "libavfilter/avfilter.h"
+#include "libavfilter/buffersink.h"
+#include "libavfilter/buffersrc.h"
+#include "libavutil/audio_fifo.h"
+#include "libavutil/avstring.h"
+#include "libavutil/avconfig.h"
+#include "libavutil/bprint.h"
+#include "libavutil/cpu.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/opt.h"
+#include "libavutil/parseutils.h"
+#include "libavutil/time.h"
+#include "libswresample/swresample.h"
+
+#include "mixer.h"
+#include "mixer_cache.h"
+#include "mixer_io.h"
+#include "mixer_pcm_cache.h"
+#include "mixer_probe.h"
+#include "mixer_telemetry.h"
+
+// The default number of frames each pipeline queue can hold
+#define DEFAULT_PIPELINE_DEPTH 8
+// The default number of samples per channel of the frames sent to encoders without a frame size
+#define DEFAULT_BLOCK_SIZE 16384
+// The bounds of options.block_size
+#define MIN_BLOCK_SIZE 64
+#define MAX_BLOCK_SIZE 262144
+// The default number of samples every amix input is kept ahead of the mix
+#define DEFAULT_INPUT_LEAD 8192
+// The default number of inputs of every submix of the native engine
+#define DEFAULT_SUBMIX_SIZE 16
+// The default size in KiB and number of the blocks read ahead of every input
+#define DEFAULT_READ_AHEAD 256
+#define DEFAULT_READ_AHEAD_DEPTH 4
+// The largest block read ahead, in KiB
+#define MAX_READ_AHEAD 65536
+// The default size of the PCM cache, in MiB
+#define DEFAULT_PCM_CACHE_SIZE 1024
+// The most frames handed over from one input in a single read
+#define MAX_DECODED_FRAMES 16
+// The number of samples per channel of every frame cut out of a mapped input
+#define MAPPED_FRAME_SIZE 4096
+// The shortest segment a segmented mix is split into, in seconds
+#define MIN_SEGMENT_SECONDS 30
+// How far before the first sample they need decoded inputs are sought, in seconds
+#define SEEK_PREROLL 1
+
+/**
+ * PCM WAV or RF64 input read straight from a memory mapping of the file,
+ * without demuxer nor decoder. Frames point into the mapping and every one
+ * of them holds a reference on it, so the file stays mapped until the last
+ * frame is gone.
+ */
+typedef struct MappedInput {
+    AVBufferRef *map;
+    const uint8_t *data;    // first sample of the data chunk
+    int64_t nb_samples;     // samples per channel in the data chunk
+    int64_t pos;            // next sample to hand out
+    int block_align;
+} MappedInput;
+
+/**
+ * One part of a segmented mix (MixerOptions.segments). Every segment is
+ * mixed by a context of its own on its own thread: its inputs are sought to
+ * the start of the segment and its encoded packets are spilled to a
+ * temporary file, which the parent context muxes into the output once all
+ * the segments before it are done. A mix of a time window that is not
+ * split is a single segment mixed by the context itself, without spill.
+ * Lossy encoders are warmed up with preroll samples before the start and
+ * followed by postroll samples after the end; only the packets of the
+ * segment itself are kept, by their pts. PCM needs neither.
+ */
+typedef struct MixSegment {
+    int index;
+    // Sample of the inputs, at the output rate, where the mix starts (MixerOptions.start).
+    int64_t origin;
+    // Output samples the segment contributes: [start, end), counted from
+    // origin. end is INT64_MAX for the last segment of a mix that runs to
+    // the end of the inputs.
+    int64_t start;
+    int64_t end;
+    int64_t preroll;
+    int64_t postroll;
+    // Next output sample to be mixed.
+    int64_t next_pos;
+    // Encoder delay of the segment's encoder; packet pts are that early.
+    int64_t delay;
+    int done;
+
+    // First sample of every input to mix, and the position of the next
+    // decoded one, unknown (AV_NOPTS_VALUE) until the first frame after the seek.
+    int64_t *input_start;
+    int64_t *input_pos;
+
+    FILE *spill;
+    // Output samples of [start, end) the segment mixed.
+    int64_t nb_samples;
+
+    struct MixerContext *ctx;
+    pthread_t thread;
+    int started;
+    int error;
+    // Set by the parent when a segment failed, so that the others stop early.
+    atomic_int *aborted;
+} MixSegment;
+
+// What the spill file of a segment holds in front of the data of every packet.
+typedef struct SpilledPacket {
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    int size;
+    int flags;
+} SpilledPacket;
+
+// Gains set with mixer_set_input_matrix(): nb_rows output channels of nb_cols input channels.
+typedef struct RoutingMatrix {
+    double *coeffs;
+    int nb_rows;
+    int nb_cols;
+} RoutingMatrix;
+
+/**
+ * A clip placed on the timeline of a mix (mixer_add_clip()). Its file and
+ * codecs are only open while it overlaps the block being mixed.
+ */
+typedef struct TimelineClip {
+    char *filename;
+    // Position on the output and part of the clip played, in AV_TIME_BASE
+    // units; out is 0 to play the clip to its end.
+    int64_t offset;
+    int64_t in;
+    int64_t out;
+    float gain;
+
+    // Output samples the clip covers: [start, end). end is INT64_MAX for a
+    // clip without out point until its last sample has been decoded.
+    int64_t start;
+    int64_t end;
+    // First sample played, and position of the next decoded one, at the rate of the clip.
+    int64_t first;
+    int64_t pos;
+
+    AVFormatContext *format_context;
+    AVCodecContext *codec_context;
+    AVPacket *packet;
+    // Converts the decoded samples to the rate, layout and float planar format the engine mixes.
+    SwrContext *resampler;
+    AVAudioFifo *fifo;
+    int finished;
+} TimelineClip;
+
+/**
+ * Allocation counters of the mixing loop (--debug-alloc).
+ * They count the frames, packets and sample buffers the loop allocates
+ * itself; once the pools are warm they should stop moving. Allocations made
+ * inside the decoders, encoders and filters are not seen here. The counters
+ * are shared by all the contexts of the process.
+ */
+typedef struct AllocStats {
+    atomic_llong frames;
+    atomic_llong packets;
+    atomic_llong buffers;
+    pthread_mutex_t report_lock;
+    int64_t last_report;
+    long long last_total;
+} AllocStats;
+
+static AllocStats alloc_stats = { .report_lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Print the number of allocations of the last second, at most once a second.
+static void alloc_stats_report(int enabled, int final)
+{
+    int64_t now = av_gettime_relative();
+    long long frames  = atomic_load(&alloc_stats.frames);
+    long long packets = atomic_load(&alloc_stats.packets);
+    long long buffers = atomic_load(&alloc_stats.buffers);
+    long long total   = frames + packets + buffers;
+
+    if (!enabled)
+        return;
+    // Contexts report in turn; one that finds another one reporting skips.
+    if (pthread_mutex_trylock(&alloc_stats.report_lock))
+        return;
+    if (!alloc_stats.last_report) {
+        alloc_stats.last_report = now;
+    } else if (final || now - alloc_stats.last_report >= 1000000) {
+        av_log(NULL, AV_LOG_INFO, "%s: %.1f allocations/s (total: %lld frames, %lld packets, %lld buffers)\n",
+               final ? "alloc total" : "alloc", (total - alloc_stats.last_total) * 1000000.0 /
+               FFMAX(now - alloc_stats.last_report, 1), frames, packets, buffers);
+        alloc_stats.last_report = now;
+        alloc_stats.last_total  = total;
+    }
+    pthread_mutex_unlock(&alloc_stats.report_lock);
+}
+
+// av_buffer_alloc() for AVBufferPool, counting every buffer it creates.
+static AVBufferRef *counted_buffer_alloc(int size)
+{
+    atomic_fetch_add(&alloc_stats.buffers, 1);
+    return av_buffer_alloc(size);
+}
+
+/**
+ * Free list of frames shared by all the stages.
+ * Frames are unreferenced when they are given back, so only the AVFrame
+ * structures are kept; their samples live in the buffer pools of the
+ * decoders, the filters and the native engine.
+ */
+typedef struct FramePool {
+    pthread_mutex_t lock;
+    AVFrame **frames;
+    int nb_frames;
+    int size;
+} FramePool;
+
+// Let the pool keep up to size frames. The frames it already holds are kept.
+static int frame_pool_reserve(FramePool *pool, int size)
+{
+    AVFrame **frames;
+
+    if (size <= pool->size)
+        return 0;
+
+    pthread_mutex_lock(&pool->lock);
+    frames = av_realloc_array(pool->frames, size, sizeof(*pool->frames));
+    if (frames) {
+        pool->frames = frames;
+        pool->size = size;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return frames ? 0 : AVERROR(ENOMEM);
+}
+
+static void frame_pool_uninit(FramePool *pool)
+{
+    while (pool->nb_frames)
+        av_frame_free(&pool->frames[--pool->nb_frames]);
+    av_freep(&pool->frames);
+    pool->size = 0;
+}
+
+static AVFrame *frame_pool_get(FramePool *pool)
+{
+    AVFrame *frame = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nb_frames)
+        frame = pool->frames[--pool->nb_frames];
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!frame) {
+        atomic_fetch_add(&alloc_stats.frames, 1);
+        frame = av_frame_alloc();
+    }
+
+    return frame;
+}
+
+// Give a frame back, dropping its data; the frame is freed if the pool is full.
+static void frame_pool_put(FramePool *pool, AVFrame **frame)
+{
+    if (!*frame)
+        return;
+
+    av_frame_unref(*frame);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nb_frames < pool->size) {
+        pool->frames[pool->nb_frames++] = *frame;
+        *frame = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    av_frame_free(frame);
+}
+
+/**
+ * Attach a buffer from pool to an audio frame whose format, channels and
+ * nb_samples are set. All the planes share one buffer of the pool.
+ */
+static int frame_get_pooled_buffer(AVFrame *frame, AVBufferPool *pool)
+{
+    int planes = av_sample_fmt_is_planar(frame->format) ? frame->channels : 1;
+    int error;
+
+    if (planes > AV_NUM_DATA_POINTERS)
+        return av_frame_get_buffer(frame, 0);
+
+    if (!(frame->buf[0] = av_buffer_pool_get(pool)))
+        return AVERROR(ENOMEM);
+
+    frame->extended_data = frame->data;
+    error = av_samples_fill_arrays(frame->extended_data, frame->linesize, frame->buf[0]->data,
+                                   frame->channels, frame->nb_samples, frame->format, 0);
+
+    return error < 0 ? error : 0;
+}
+
+/**
+ * Scratch samples a resampler converts into before they go to a FIFO: the
+ * clips of a timeline share one, and every extra output has its own.
+ */
+typedef struct SampleBuffer {
+    uint8_t **samples;
+    int size;
+    int channels;
+    enum AVSampleFormat sample_fmt;
+} SampleBuffer;
+
+static int sample_buffer_reserve(SampleBuffer *buffer, int nb_samples)
+{
+    int error;
+
+    if (nb_samples <= buffer->size)
+        return 0;
+
+    if (buffer->samples)
+        av_freep(&buffer->samples[0]);
+    av_freep(&buffer->samples);
+    buffer->size = 0;
+    if ((error = av_samples_alloc_array_and_samples(&buffer->samples, NULL, buffer->channels,
+                                                    nb_samples, buffer->sample_fmt, 0)) < 0)
+        return error;
+    buffer->size = nb_samples;
+
+    return 0;
+}
+
+static void sample_buffer_free(SampleBuffer *buffer)
+{
+    if (buffer->samples)
+        av_freep(&buffer->samples[0]);
+    av_freep(&buffer->samples);
+    buffer->size = 0;
+}
+
+// Packet buffers for encoders that let the caller allocate them (AV_CODEC_CAP_DR1).
+typedef struct PacketBufferPool {
+    AVBufferPool *pool;
+    int size;
+} PacketBufferPool;
+
+/**
+ * Everything one mix works on. The files and codecs are opened by
+ * mixer_run() and closed again before it returns; the frame and packet
+ * buffer pools outlive the run, so that a context reopened for one mix after
+ * the other reuses them.
+ */
+struct MixerContext {
+    MixerOptions options;
+    char *output;
+    char **input_filenames;
+    // Mixing weight of every input.
+    float *input_weights;
+    // Routing matrix of every input; coeffs is NULL for the default one.
+    RoutingMatrix *input_matrices;
+    int nb_inputs;
+    // Clips of a timeline, mixed instead of whole inputs, and the most of them the last run had open at once.
+    TimelineClip *clips;
+    int nb_clips;
+    int max_open_clips;
+
+    // One format/codec context pair per input file, indexed like the abuffer sources.
+    AVFormatContext **input_format_contexts;
+    AVCodecContext **input_codec_contexts;
+    // Mapped state of every input; NULL for the inputs that go through libavformat.
+    MappedInput **mapped_inputs;
+    // Packets reused by every read of each input and by every encoded frame.
+    AVPacket **input_packets;
+    AVPacket *output_packet;
+
+    AVFormatContext *output_format_context;
+    AVCodecContext *output_codec_context;
+    // Samples per channel of every frame sent to the encoder but the last one.
+    int frame_size;
+    // Outputs added with mixer_add_output(), fed the frames of this one.
+    struct MixerOutput *outputs;
+    int nb_outputs;
+
+    AVFilterGraph *graph;
+    AVFilterContext **srcs;
+    AVFilterContext *sink;
+    MixEngine engine;
+
+    // Set while the mix runs with more than one thread.
+    struct Pipeline *pipeline;
+    // Set on the contexts mixing one segment of a segmented mix.
+    MixSegment *segment;
+
+    MixerCache *cache;
+
+    FramePool frame_pool;
+    PacketBufferPool packet_buffer_pool;
+
+    MixerStats stats;
+    // Inputs of the last run mapped from the PCM cache and decoded into it,
+    // and the bytes of samples mapped instead of decoded.
+    int pcm_cache_hits;
+    int pcm_cache_misses;
+    int64_t pcm_cache_bytes;
+    // Timings and counters of the last run, and the engine it mixed with.
+    Telemetry telemetry;
+    const char *engine_name;
+};
+
+static int get_pooled_encode_buffer(AVCodecContext *avctx, AVPacket *pkt, int flags)
+{
+    PacketBufferPool *pool = avctx->opaque;
+    int size = pkt->size + AV_INPUT_BUFFER_PADDING_SIZE;
+
+    // Packets of most audio encoders have a fixed upper size, so the pool
+    // only has to grow a few times during warm-up.
+    if (size > pool->size) {
+        int pool_size = 1024;
+        while (pool_size < size)
+            pool_size *= 2;
+        av_buffer_pool_uninit(&pool->pool);
+        if (!(pool->pool = av_buffer_pool_init(pool_size, counted_buffer_alloc)))
+            return AVERROR(ENOMEM);
+        pool->size = pool_size;
+    }
+
+    if (!(pkt->buf = av_buffer_pool_get(pool->pool)))
+        return AVERROR(ENOMEM);
+    pkt->data = pkt->buf->data;
+    memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    return 0;
+}
+
+
+static char *const get_error_text(const int error)
+{
+    // One buffer per thread, as jobs may fail on several threads at once.
+    static _Thread_local char error_buffer[255];
+    av_strerror(error, error_buffer, sizeof(error_buffer));
+
+    return error_buffer;
+}
+
+/**
+ * Formats a filter graph is built for: those of the abuffer source of every
+ * input, with its amix weight, and those of the sink. Graphs built for keys
+ * with the same bytes are interchangeable, so keys must be allocated zeroed.
+ */
+typedef struct GraphKey {
+    enum AVSampleFormat out_sample_fmt;
+    int out_sample_rate;
+    int nb_inputs;
+    uint64_t out_channel_layout;
+    struct {
+        int sample_rate;
+        enum AVSampleFormat sample_fmt;
+        uint64_t channel_layout;
+        float weight;
+    } inputs[];
+} GraphKey;
+
+static size_t graph_key_size(int nb_inputs)
+{
+    return sizeof(GraphKey) + nb_inputs * sizeof(((GraphKey *)NULL)->inputs[0]);
+}
+
+static int init_filter_graph(const GraphKey *key, AVFilterGraph **graph, AVFilterContext ***srcs,
+                             AVFilterContext **sink)
+{
+    AVFilterGraph *filter_graph;
+    AVFilterContext **abuffer_ctxs;
+    const AVFilter  *abuffer;
+    AVFilterContext *mix_ctx;
+    const AVFilter  *mix_filter;
+    AVFilterContext *abuffersink_ctx;
+    const AVFilter  *abuffersink;
+    
+    char args[512];
+    int error;
+    
+    // Create a new filtergraph, which will contain all the filters.
+    filter_graph = avfilter_graph_alloc();
+    if (!filter_graph) {
+        av_log(NULL, AV_LOG_ERROR, "Unable to create filter graph.\n");
+        return AVERROR(ENOMEM);
+    }
+    
+    abuffer_ctxs = av_calloc(key->nb_inputs, sizeof(*abuffer_ctxs));
+    if (!abuffer_ctxs) {
+        av_log(NULL, AV_LOG_ERROR, "Unable to allocate the audio buffer sources.\n");
+        avfilter_graph_free(&filter_graph);
+        return AVERROR(ENOMEM);
+    }
+    
+    /****** abuffer sources ********/
+    
+    // Create the abuffer filter;
+    // it will be used for feeding the data into the graph.
+    abuffer = avfilter_get_by_name("abuffer");
+    if (!abuffer) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find the abuffer filter.\n");
+        error = AVERROR_FILTER_NOT_FOUND;
+        goto fail;
+    }
+    
+    // One buffer audio source per input: the decoded frames from the
+    // decoder of input i will be inserted into "src<i>".
+    for (int i = 0 ; i < key->nb_inputs ; i++) {
+        char name[32];
+        
+        snprintf(args, sizeof(args),
+                 "sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
+                 key->inputs[i].sample_rate,
+                 av_get_sample_fmt_name(key->inputs[i].sample_fmt), key->inputs[i].channel_layout);
+        snprintf(name, sizeof(name), "src%d", i);
+        
+        error = avfilter_graph_create_filter(&abuffer_ctxs[i], abuffer, name,
+                                           args, NULL, filter_graph);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Cannot create audio buffer source %d\n", i);
+            goto fail;
+        }
+    }
+    
+    // amix
+    // Create mix filter.
+    mix_filter = avfilter_get_by_name("amix");
+    if (!mix_filter) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find the mix filter.\n");
+        error = AVERROR_FILTER_NOT_FOUND;
+        goto fail;
+    }
+    
+    // The weights list grows with the number of inputs, so it does not go through args.
+    AVBPrint mix_args;
+    av_bprint_init(&mix_args, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&mix_args, "inputs=%d:weights=", key->nb_inputs);
+    for (int i = 0 ; i < key->nb_inputs ; i++)
+        av_bprintf(&mix_args, "%s%g", i ? " " : "", key->inputs[i].weight);
+    if (!av_bprint_is_complete(&mix_args)) {
+        av_bprint_finalize(&mix_args, NULL);
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    
+    error = avfilter_graph_create_filter(&mix_ctx, mix_filter, "amix", mix_args.str, NULL, filter_graph);
+    av_bprint_finalize(&mix_args, NULL);
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create audio amix filter\n");
+        goto fail;
+    }
+    
+    // Finally create the abuffersink filter;
+    // it will be used to get the filtered data out of the graph.
+
+    abuffersink = avfilter_get_by_name("abuffersink");
+    if (!abuffersink) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find the abuffersink filter.\n");
+        error = AVERROR_FILTER_NOT_FOUND;
+        goto fail;
+    }
+    
+    abuffersink_ctx = avfilter_graph_alloc_filter(filter_graph, abuffersink, "sink");
+    if (!abuffersink_ctx) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate the abuffersink instance.\n");
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    
+    // Same sample fmt and rate as the output file.
+    error = av_opt_set_int_list(abuffersink_ctx, "sample_fmts",
+                              ((int[]){ key->out_sample_fmt, AV_SAMPLE_FMT_NONE }),
+                              AV_SAMPLE_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+    if (error >= 0)
+        error = av_opt_set_int_list(abuffersink_ctx, "sample_rates",
+                                    ((int[]){ key->out_sample_rate, -1 }),
+                                    -1, AV_OPT_SEARCH_CHILDREN);
+    
+    uint8_t ch_layout[64];
+    av_get_channel_layout_string(ch_layout, sizeof(ch_layout), 0, key->out_channel_layout);
+    av_opt_set(abuffersink_ctx, "channel_layout", ch_layout, AV_OPT_SEARCH_CHILDREN);
+    
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could set options to the abuffersink instance.\n");
+        goto fail;
+    }
+    
+    error = avfilter_init_str(abuffersink_ctx, NULL);
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not initialize the abuffersink instance.\n");
+        goto fail;
+    }
+    
+    // Connect the filters
+    
+    error = 0;
+    for (int i = 0 ; i < key->nb_inputs && error >= 0 ; i++)
+        error = avfilter_link(abuffer_ctxs[i], 0, mix_ctx, i);
+    if (error >= 0)
+        error = avfilter_link(mix_ctx, 0, abuffersink_ctx, 0);
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error connecting filters\n");
+        goto fail;
+    }
+    
+    // Configure the graph.
+    error = avfilter_graph_config(filter_graph, NULL);
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while configuring graph : %s\n", get_error_text(error));
+        goto fail;
+    }
+    
+    *graph = filter_graph;
+    *srcs  = abuffer_ctxs;
+    *sink  = abuffersink_ctx;
+    
+    return 0;
+    
+    fail:
+        avfilter_graph_free(&filter_graph);
+        av_freep(&abuffer_ctxs);
+    
+    return error;
+}
+
+// A configured graph and its ends, as kept by the cache.
+typedef struct WarmGraph {
+    AVFilterGraph *graph;
+    AVFilterContext **srcs;
+    AVFilterContext *sink;
+} WarmGraph;
+
+static int build_graph(const void *key, void **object)
+{
+    WarmGraph *warm = av_mallocz(sizeof(*warm));
+    int error;
+
+    if (!warm)
+        return AVERROR(ENOMEM);
+    if ((error = init_filter_graph(key, &warm->graph, &warm->srcs, &warm->sink)) < 0) {
+        av_free(warm);
+        return error;
+    }
+    *object = warm;
+
+    return 0;
+}
+
+static void free_graph(void **object)
+{
+    WarmGraph *warm = *object;
+
+    if (warm) {
+        avfilter_graph_free(&warm->graph);
+        av_freep(&warm->srcs);
+    }
+    av_freep(object);
+}
+
+static const WarmKind graph_kind = {
+    .name  = "filter graph",
+    .build = build_graph,
+    .free  = free_graph,
+};
+
+/**
+ * Close an input opened by open_input_file() and its file, adding the
+ * read-ahead counters of the file to track when not NULL.
+ */
+static void close_input_file(AVFormatContext **input_format_context, TelemetryTrack *track)
+{
+    AVIOContext *pb;
+    MixerIOStats stats;
+
+    if (!*input_format_context)
+        return;
+
+    // avformat_close_input() leaves the files it did not open itself.
+    pb = (*input_format_context)->flags & AVFMT_FLAG_CUSTOM_IO ? (*input_format_context)->pb : NULL;
+    avformat_close_input(input_format_context);
+
+    mixer_io_get_stats(pb, &stats);
+    if (track) {
+        track->io_hits   += stats.hits;
+        track->io_misses += stats.misses;
+        track->io_wait   += stats.wait;
+    }
+    mixer_io_close(&pb);
+}
+
+/**
+ * Open an input file, read ahead as options tell, and the required decoder.
+ * Files found in the probe cache are not probed again.
+ */
+static int open_input_file(const char *filename, const MixerOptions *options,
+                           AVFormatContext **input_format_context,
+                           AVCodecContext **input_codec_context)
+{
+    AVCodec *input_codec;
+    AVStream *in_stream;
+    AVCodecParameters *in_codecpar;
+    enum AVCodecID audio_codec_id;
+    AVIOContext *pb;
+    ProbeEntry entry = { 0 };
+    int cached, error;
+    
+    // Open the input file to read from it.
+    if ((error = mixer_io_open_input(&pb, filename, options->read_ahead * 1024, options->read_ahead_depth)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open input file '%s' (error '%s')\n",
+               filename, get_error_text(error));
+        return error;
+    }
+    if (!(*input_format_context = avformat_alloc_context())) {
+        mixer_io_close(&pb);
+        return AVERROR(ENOMEM);
+    }
+    (*input_format_context)->pb = pb;
+    
+    // A file probed before is opened with the demuxer it was probed with.
+    cached = options->probe_cache[0] && probe_cache_read(options->probe_cache, filename, &entry);
+    if ((error = avformat_open_input(input_format_context, filename,
+                                     cached ? av_find_input_format(entry.format) : NULL, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open input file '%s' (error '%s')\n",
+               filename, get_error_text(error));
+        probe_entry_uninit(&entry);
+        mixer_io_close(&pb);
+        *input_format_context = NULL;
+        return error;
+    }
+    if (cached)
+        cached = probe_entry_apply(&entry, *input_format_context, options->probe_cache_validate) > 0;
+    probe_entry_uninit(&entry);
+    
+    // Get information on the input file (number of streams etc.).
+    if (!cached && (error = avformat_find_stream_info(*input_format_context, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open find stream info (error '%s')\n",
+               get_error_text(error));
+        close_input_file(input_format_context, NULL);
+        return error;
+    }
+    
+    // Make sure that there is only one stream in the input file.
+    if ((*input_format_context)->nb_streams != 1) {
+        av_log(NULL, AV_LOG_ERROR, "Expected one audio input stream, but found %d\n",
+               (*input_format_context)->nb_streams);
+        close_input_file(input_format_context, NULL);
+        return AVERROR_EXIT;
+    }
+
+    if (cached) {
+        av_log(NULL, AV_LOG_VERBOSE, "Input '%s' found in the probe cache\n", filename);
+    } else {
+        if (options->probe_cache[0])
+            probe_cache_write(options->probe_cache, filename, *input_format_context);
+        av_dump_format((*input_format_context), 0, filename, 0);
+    }
+
+    in_stream = (*input_format_context)->streams[0];
+    in_codecpar = in_stream->codecpar;
+    if (in_codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+        av_log(NULL, AV_LOG_ERROR, "File input has no stream audio -> %s\n", filename);
+        error = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    audio_codec_id = in_codecpar->codec_id;
+    
+    // Find a decoder for the audio stream.
+    if (!(input_codec = avcodec_find_decoder(audio_codec_id))) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find input codec\n");
+        error = AVERROR_EXIT;
+        goto fail;
+    }
+
+    // Creating codec context for the input file
+    *input_codec_context = avcodec_alloc_context3(input_codec);
+    if (!(*input_codec_context)) {
+        av_log(NULL, AV_LOG_ERROR, "Could not alloc memory for input codec context\n");
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    error = avcodec_parameters_to_context((*input_codec_context), (*input_format_context)->streams[0]->codecpar);
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Can't copy codecpar values to input codec context (error '%s')\n",
+               get_error_text(error));
+        goto fail;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "*** input bitrate -> %" PRIu64 "\n", (*input_codec_context)->bit_rate);
+    
+    // Let the decoder spread its work over several threads when it can.
+    if (input_codec->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS |
+                                     AV_CODEC_CAP_OTHER_THREADS)) {
+        (*input_codec_context)->thread_count = options->decoder_threads;
+        (*input_codec_context)->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+    
+    // Open the decoder for the audio stream to use it later.
+    if ((error = avcodec_open2((*input_codec_context), input_codec, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open input codec (error '%s')\n", get_error_text(error));
+        goto fail;
+    }
+    
+    return 0;
+    
+    fail:
+        avcodec_free_context(input_codec_context);
+        close_input_file(input_format_context, NULL);
+    
+    return error;
+}
+
+/**
+ * Parameters an encoder is opened with. Encoders opened with keys of the
+ * same bytes are interchangeable, so keys must be zeroed before being set.
+ */
+typedef struct EncoderKey {
+    enum AVCodecID codec_id;
+    enum AVSampleFormat sample_fmt;
+    int sample_rate;
+    int channels;
+    uint64_t channel_layout;
+    int64_t bit_rate;
+    int flags;
+} EncoderKey;
+
+static int open_encoder(const void *opaque, void **object)
+{
+    const EncoderKey *key = opaque;
+    AVCodecContext *avctx;
+    AVCodec *codec;
+    int error;
+
+    if (!(codec = avcodec_find_encoder(key->codec_id))) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find the encoder required.\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    if (!(avctx = avcodec_alloc_context3(codec))) {
+        av_log(NULL, AV_LOG_ERROR, "Can't alloc memory for output codec context\n");
+        return AVERROR(ENOMEM);
+    }
+
+    avctx->channels       = key->channels;
+    avctx->channel_layout = key->channel_layout;
+    avctx->sample_rate    = key->sample_rate;
+    avctx->sample_fmt     = key->sample_fmt;
+    avctx->bit_rate       = key->bit_rate;
+    avctx->flags         |= key->flags;
+
+    // Open the encoder for the audio stream to use it later.
+    if ((error = avcodec_open2(avctx, codec, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open output codec (error '%s')\n",
+               get_error_text(error));
+        avcodec_free_context(&avctx);
+        return error;
+    }
+    *object = avctx;
+
+    return 0;
+}
+
+static void free_encoder(void **object)
+{
+    avcodec_free_context((AVCodecContext **)object);
+}
+
+static const WarmKind encoder_kind = {
+    .name  = "encoder",
+    .build = open_encoder,
+    .free  = free_encoder,
+};
+
+typedef int64_t (*InputParam)(const AVCodecContext *avctx);
+
+static int64_t input_sample_fmt(const AVCodecContext *avctx)
+{
+    return avctx->sample_fmt;
+}
+
+static int64_t input_sample_rate(const AVCodecContext *avctx)
+{
+    return avctx->sample_rate;
+}
+
+static int64_t input_channel_layout(const AVCodecContext *avctx)
+{
+    return avctx->channel_layout ? avctx->channel_layout : av_get_default_channel_layout(avctx->channels);
+}
+
+/**
+ * The value of param shared by the most inputs, ties going to the first
+ * input; *count is set to the number of inputs sharing it.
+ */
+static int64_t most_common_param(AVCodecContext *const *inputs, int nb_inputs,
+                                 InputParam param, int *count)
+{
+    int64_t best = param(inputs[0]);
+    int best_count = 0;
+
+    for (int i = 0 ; i < nb_inputs ; i++) {
+        int64_t value = param(inputs[i]);
+        int n = 0;
+
+        for (int j = 0 ; j < nb_inputs ; j++)
+            n += param(inputs[j]) == value;
+        if (n > best_count) {
+            best       = value;
+            best_count = n;
+        }
+    }
+    if (count)
+        *count = best_count;
+
+    return best;
+}
+
+/**
+ * The codec of the output in oformat for samples in sample_fmt. PCM
+ * containers (WAV, AIFF, raw) default to 16 bit PCM; they take the PCM
+ * codec of sample_fmt instead when they can store it, so that it needs no
+ * conversion. Any other default codec is kept.
+ */
+static enum AVCodecID output_codec_id(const AVOutputFormat *oformat, enum AVSampleFormat sample_fmt)
+{
+    int big_endian = oformat->audio_codec == av_get_pcm_codec(AV_SAMPLE_FMT_S16, 1);
+    enum AVCodecID codec_id;
+
+    if (oformat->audio_codec != av_get_pcm_codec(AV_SAMPLE_FMT_S16, big_endian))
+        return oformat->audio_codec;
+
+    codec_id = av_get_pcm_codec(av_get_packed_sample_fmt(sample_fmt), big_endian);
+    if (codec_id == AV_CODEC_ID_NONE || !avcodec_find_encoder(codec_id) ||
+        avformat_query_codec(oformat, codec_id, FF_COMPLIANCE_NORMAL) != 1)
+        return oformat->audio_codec;
+
+    return codec_id;
+}
+
+/**
+ * The sample format of codec cheapest to convert sample_fmt to: itself,
+ * then its packed or planar twin (only an interleave), then the most
+ * precise format the codec takes, so that the conversion loses nothing.
+ */
+static enum AVSampleFormat closest_sample_fmt(const AVCodec *codec, enum AVSampleFormat sample_fmt)
+{
+    enum AVSampleFormat best = AV_SAMPLE_FMT_NONE;
+    int best_score = -1;
+
+    if (!codec->sample_fmts)
+        return sample_fmt;
+
+    for (const enum AVSampleFormat *p = codec->sample_fmts ; *p != AV_SAMPLE_FMT_NONE ; p++) {
+        int score = av_get_bytes_per_sample(*p);
+
+        if (av_get_packed_sample_fmt(*p) == av_get_packed_sample_fmt(sample_fmt))
+            score += *p == sample_fmt ? 32 : 16;
+        if (score > best_score) {
+            best       = *p;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+// The sample rate of codec nearest to sample_rate.
+static int closest_sample_rate(const AVCodec *codec, int sample_rate)
+{
+    int best = 0;
+
+    if (!codec->supported_samplerates)
+        return sample_rate;
+
+    for (const int *p = codec->supported_samplerates ; *p ; p++) {
+        if (!best || FFABS(*p - sample_rate) < FFABS(best - sample_rate))
+            best = *p;
+    }
+
+    return best;
+}
+
+// The channel layout of codec matching channel_layout, or else with as many channels.
+static uint64_t closest_channel_layout(const AVCodec *codec, uint64_t channel_layout)
+{
+    int channels = av_get_channel_layout_nb_channels(channel_layout);
+    uint64_t best = 0;
+
+    if (!codec->channel_layouts)
+        return channel_layout;
+
+    for (const uint64_t *p = codec->channel_layouts ; *p ; p++) {
+        if (*p == channel_layout)
+            return *p;
+        if (!best || (av_get_channel_layout_nb_channels(*p) == channels &&
+                      av_get_channel_layout_nb_channels(best) != channels))
+            best = *p;
+    }
+
+    return best;
+}
+
+/**
+ * Negotiate the format of the output from those of the inputs, so that as
+ * few of them as possible need a conversion: the sample rate and channel
+ * layout most inputs share, and their sample format when they all share
+ * one, else the float samples amix works in. The codec of the container
+ * then narrows these down to what it can encode. A channel_layout other
+ * than 0 is taken instead of the one of the inputs.
+ */
+static int negotiate_output_format(const AVOutputFormat *oformat, const AVCodec *codec,
+                                   AVCodecContext *const *inputs, int nb_inputs,
+                                   uint64_t channel_layout, EncoderKey *key)
+{
+    enum AVSampleFormat sample_fmt;
+    char layout_name[64];
+    int nb_same_fmt, nb_converted = 0;
+
+    sample_fmt = most_common_param(inputs, nb_inputs, input_sample_fmt, &nb_same_fmt);
+    if (nb_same_fmt < nb_inputs)
+        sample_fmt = AV_SAMPLE_FMT_FLT;
+
+    key->codec_id = codec ? codec->id : output_codec_id(oformat, sample_fmt);
+    if (!codec && !(codec = avcodec_find_encoder(key->codec_id))) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find the encoder required.\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+
+    key->sample_fmt     = closest_sample_fmt(codec, sample_fmt);
+    key->sample_rate    = closest_sample_rate(codec, most_common_param(inputs, nb_inputs,
+                                                                        input_sample_rate, NULL));
+    if (!channel_layout)
+        channel_layout = most_common_param(inputs, nb_inputs, input_channel_layout, NULL);
+    key->channel_layout = closest_channel_layout(codec, channel_layout);
+    key->channels       = av_get_channel_layout_nb_channels(key->channel_layout);
+
+    for (int i = 0 ; i < nb_inputs ; i++)
+        nb_converted += input_sample_fmt(inputs[i]) != key->sample_fmt ||
+                        input_sample_rate(inputs[i]) != key->sample_rate ||
+                        input_channel_layout(inputs[i]) != key->channel_layout;
+
+    av_get_channel_layout_string(layout_name, sizeof(layout_name), key->channels, key->channel_layout);
+    av_log(NULL, AV_LOG_INFO, "Output format: %s %s, %d Hz, %s; %d of %d inputs converted\n",
+           avcodec_get_name(key->codec_id), av_get_sample_fmt_name(key->sample_fmt),
+           key->sample_rate, layout_name, nb_converted, nb_inputs);
+
+    return 0;
+}
+
+/**
+ * Open the encoder of an output in the container format oformat, or take
+ * one opened ahead of time. Its format is negotiated from the inputs; codec
+ * overrides the default codec of the container when set, and channel_layout
+ * the layout of the inputs.
+ */
+static int open_output_encoder(const AVOutputFormat *oformat, const AVCodec *codec, int64_t bit_rate,
+                               AVCodecContext *const *inputs, int nb_inputs,
+                               uint64_t channel_layout, MixerCache *cache,
+                               AVCodecContext **output_codec_context)
+{
+    EncoderKey key;
+    void *encoder = NULL;
+    int error;
+
+    // Set the basic encoder parameters.
+    memset(&key, 0, sizeof(key));
+    if ((error = negotiate_output_format(oformat, codec, inputs, nb_inputs, channel_layout, &key)) < 0)
+        return error;
+    key.bit_rate = bit_rate;
+
+    av_log(NULL, AV_LOG_INFO, "output bitrate %" PRIu64 "\n", key.bit_rate);
+    
+    // Some container formats (like MP4) require global headers to be present
+    // Mark the encoder so that it behaves accordingly.
+
+    if (oformat->flags & AVFMT_GLOBALHEADER)
+        key.flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    
+    // Take an encoder opened ahead of time if there is one.
+    if ((!cache || mixer_cache_take(cache, &encoder_kind, &key, sizeof(key), &encoder) <= 0) &&
+        (error = open_encoder(&key, &encoder)) < 0)
+        return error;
+    *output_codec_context = encoder;
+
+    return 0;
+}
+
+/**
+ * Open an output file and the required encoder.
+ */
+static int open_output_file(const char *filename, const AVCodec *codec, int64_t bit_rate,
+                            AVCodecContext *const *inputs, int nb_inputs,
+                            uint64_t channel_layout, MixerCache *cache,
+                            AVFormatContext **output_format_context,
+                            AVCodecContext **output_codec_context)
+{
+    AVIOContext *output_io_context = NULL;
+    AVStream *stream               = NULL;
+    int error;
+    
+    // Open the output file to write to it.
+    if ((error = mixer_io_open(&output_io_context, filename)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open output file '%s' (error '%s')\n",
+               filename, get_error_text(error));
+        return error;
+    }
+    
+    // Create a new format context for the output container format.
+    if (!(*output_format_context = avformat_alloc_context())) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate output format context\n");
+        return AVERROR(ENOMEM);
+    }
+    
+    // Associate the output file (pointer) with the container format context.
+    (*output_format_context)->pb = output_io_context;
+    
+    // Guess the desired container format based on the file extension.
+    if (!((*output_format_context)->oformat = av_guess_format(NULL, filename, NULL))) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find output file format\n");
+        goto cleanup;
+    }
+
+    av_dump_format((*output_format_context), 0, filename, 1);
+
+    // The codec depends on the negotiated format, so the encoder comes first.
+    if ((error = open_output_encoder((*output_format_context)->oformat, codec, bit_rate, inputs, nb_inputs,
+                                     channel_layout, cache, output_codec_context)) < 0)
+        goto cleanup;
+    
+    // Create a new audio stream in the output file container.
+    if (!(stream = avformat_new_stream(*output_format_context, NULL))) {
+        av_log(NULL, AV_LOG_ERROR, "Could not create new stream\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    stream->codecpar->codec_tag = 0;
+    stream->id = (*output_format_context)->nb_streams - 1;
+    // A hint: the muxer may pick another time base, which the packets are rescaled to.
+    stream->time_base = (AVRational){ 1, (*output_codec_context)->sample_rate };
+
+    error = avcodec_parameters_from_context(stream->codecpar, (*output_codec_context));
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not copy codecpar from codec context (error '%s')\n",
+               get_error_text(error));
+        return error;
+    } 
+    
+    return 0;
+    
+    cleanup:
+        mixer_io_close(&(*output_format_context)->pb);
+        avformat_free_context(*output_format_context);
+        *output_format_context = NULL;
+
+    return error < 0 ? error : AVERROR_EXIT;
+}
+
+// Initialize one audio frame for reading from the input file
+static int init_input_frame(FramePool *pool, AVFrame **frame)
+{
+    if (!(*frame = frame_pool_get(pool))) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate input frame\n");
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+/**
+ * Decode the next batch of audio frames from the input file.
+ * Everything the decoder has ready is returned, up to max_frames frames;
+ * only when it has nothing left is the next packet read and sent to it.
+ * At the end of the file the decoder is flushed, and *finished is set once
+ * it has returned its last frame. nb_frames may be 0 on return, and is
+ * on error.
+ */
+static int decode_audio_frames(FramePool *pool, TelemetryTrack *track,
+                               AVFrame **frames, int max_frames, int *nb_frames,
+                               AVPacket *input_packet,
+                               AVFormatContext *input_format_context,
+                               AVCodecContext *input_codec_context,
+                               int *finished)
+{
+    TelemetrySpan span;
+    int error;
+
+    *nb_frames = 0;
+
+    while (1) {
+        // Get all the available frames from the decoder.
+        while (*nb_frames < max_frames) {
+            AVFrame *frame;
+
+            if ((error = init_input_frame(pool, &frame)) < 0)
+                goto fail;
+
+            telemetry_span_start(track, &span);
+            error = avcodec_receive_frame(input_codec_context, frame);
+            telemetry_span_end(track, STAGE_DECODE, &span);
+            if (error < 0) {
+                frame_pool_put(pool, &frame);
+                // The decoder has been flushed completely: we are finished.
+                if (error == AVERROR_EOF) {
+                    *finished = 1;
+                    return 0;
+                }
+                // The decoder needs another packet.
+                if (error == AVERROR(EAGAIN))
+                    break;
+                av_log(NULL, AV_LOG_ERROR, "Could not decode frame (error '%s')\n",
+                       get_error_text(error));
+                goto fail;
+            }
+
+            frames[(*nb_frames)++] = frame;
+        }
+
+        if (*nb_frames)
+            return 0;
+
+        // Read one packet from the input file; at the end of the file, send
+        // an empty packet to the decoder to flush it.
+        telemetry_span_start(track, &span);
+        error = av_read_frame(input_format_context, input_packet);
+        telemetry_span_end(track, STAGE_DEMUX, &span);
+
+        telemetry_span_start(track, &span);
+        if (error < 0) {
+            if (error != AVERROR_EOF) {
+                av_log(NULL, AV_LOG_ERROR, "Could not read frame (error '%s')\n",
+                       get_error_text(error));
+                return error;
+            }
+            error = avcodec_send_packet(input_codec_context, NULL);
+        } else {
+            error = avcodec_send_packet(input_codec_context, input_packet);
+            av_packet_unref(input_packet);
+        }
+        telemetry_span_end(track, STAGE_DECODE, &span);
+
+        if (error < 0 && error != AVERROR_EOF) {
+            av_log(NULL, AV_LOG_ERROR, "Error while sending packet to decode (error '%s')\n",
+                   get_error_text(error));
+            return error;
+        }
+    }
+    
+    fail:
+        // The frames decoded so far are dropped with the batch.
+        while (*nb_frames)
+            frame_pool_put(pool, &frames[--(*nb_frames)]);
+    
+    return error;
+}
+
+static void unmap_file(void *opaque, uint8_t *data)
+{
+    munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+// Free callback of the frames cut out of a mapping: drop their reference on it.
+static void release_mapped_range(void *opaque, uint8_t *data)
+{
+    AVBufferRef *map = opaque;
+    av_buffer_unref(&map);
+}
+
+/**
+ * Map a 16 or 32 bit integer or 32 bit float PCM WAV/RF64 file and create
+ * a codec context describing its samples, as open_input_file would.
+ * Fails for any other file, which then has to go through open_input_file.
+ */
+static int open_mapped_input(const char *filename, MappedInput **mapped,
+                             AVCodecContext **input_codec_context)
+{
+    const uint8_t *base, *p, *end;
+    const uint8_t *fmt = NULL, *data = NULL;
+    int64_t data_size = 0, ds64_data_size = -1, source_bit_rate = 0;
+    uint32_t fmt_size = 0;
+    uint64_t channel_mask = 0;
+    enum AVSampleFormat sample_fmt;
+    int format_tag, channels, sample_rate, block_align, bits;
+    struct stat st;
+    int fd;
+
+    // WAV samples are little-endian.
+    if (AV_HAVE_BIGENDIAN)
+        return AVERROR(ENOSYS);
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return AVERROR(errno);
+    if (fstat(fd, &st) < 0 || st.st_size < 44) {
+        close(fd);
+        return AVERROR(ENOSYS);
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return AVERROR(errno);
+    end = base + st.st_size;
+
+    if ((memcmp(base, "RIFF", 4) && memcmp(base, "RF64", 4)) || memcmp(base + 8, "WAVE", 4))
+        goto not_pcm;
+
+    // Walk the chunks up to the data chunk. RF64 files keep the real size
+    // of the data chunk in the ds64 chunk.
+    for (p = base + 12 ; end - p >= 8 ; ) {
+        uint32_t chunk_size = AV_RL32(p + 4);
+
+        if (!memcmp(p, "ds64", 4) && chunk_size >= 24 && end - p >= 8 + 24) {
+            ds64_data_size = AV_RL64(p + 16);
+        } else if (!memcmp(p, "fmt ", 4) && chunk_size >= 16 && end - p >= 8 + 16) {
+            fmt = p + 8;
+            fmt_size = chunk_size;
+        } else if (!memcmp(p, "abr ", 4) && chunk_size >= 8 && end - p >= 8 + 8) {
+            // Written by the PCM cache: the bit rate of the file the samples were decoded from.
+            source_bit_rate = AV_RL64(p + 8);
+        } else if (!memcmp(p, "data", 4)) {
+            data = p + 8;
+            if (chunk_size == UINT32_MAX && ds64_data_size >= 0)
+                data_size = ds64_data_size;
+            else if (chunk_size == UINT32_MAX || !chunk_size)
+                data_size = end - data; // written while streaming, size never patched
+            else
+                data_size = chunk_size;
+            data_size = FFMIN(data_size, end - data);
+            break;
+        }
+        if (end - p - 8 < (int64_t)chunk_size + (chunk_size & 1))
+            break;
+        p += 8 + chunk_size + (chunk_size & 1);
+    }
+    if (!fmt || !data)
+        goto not_pcm;
+
+    format_tag  = AV_RL16(fmt);
+    channels    = AV_RL16(fmt + 2);
+    sample_rate = AV_RL32(fmt + 4);
+    block_align = AV_RL16(fmt + 12);
+    bits        = AV_RL16(fmt + 14);
+    // WAVE_FORMAT_EXTENSIBLE: the real format tag starts the subformat GUID.
+    if (format_tag == 0xFFFE && fmt_size >= 40 && end - fmt >= 40) {
+        channel_mask = AV_RL32(fmt + 20);
+        format_tag   = AV_RL16(fmt + 24);
+    }
+
+    if (format_tag == 1 && bits == 16)
+        sample_fmt = AV_SAMPLE_FMT_S16;
+    else if (format_tag == 1 && bits == 32)
+        sample_fmt = AV_SAMPLE_FMT_S32;
+    else if (format_tag == 3 && bits == 32)
+        sample_fmt = AV_SAMPLE_FMT_FLT;
+    else
+        goto not_pcm;
+    if (channels <= 0 || sample_rate <= 0 || block_align != channels * bits / 8)
+        goto not_pcm;
+
+    if (!(*mapped = av_mallocz(sizeof(**mapped))) ||
+        !(*input_codec_context = avcodec_alloc_context3(NULL))) {
+        av_freep(mapped);
+        munmap((void *)base, st.st_size);
+        return AVERROR(ENOMEM);
+    }
+
+    (*mapped)->map = av_buffer_create((uint8_t *)base, FFMIN(st.st_size, INT_MAX), unmap_file,
+                                      (void *)(uintptr_t)st.st_size, AV_BUFFER_FLAG_READONLY);
+    if (!(*mapped)->map) {
+        av_freep(mapped);
+        avcodec_free_context(input_codec_context);
+        munmap((void *)base, st.st_size);
+        return AVERROR(ENOMEM);
+    }
+    (*mapped)->data        = data;
+    (*mapped)->block_align = block_align;
+    (*mapped)->nb_samples  = data_size / block_align;
+
+    // The samples are read once, front to back.
+    madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+
+    (*input_codec_context)->codec_type     = AVMEDIA_TYPE_AUDIO;
+    (*input_codec_context)->sample_fmt     = sample_fmt;
+    (*input_codec_context)->sample_rate    = sample_rate;
+    (*input_codec_context)->channels       = channels;
+    (*input_codec_context)->channel_layout = av_get_channel_layout_nb_channels(channel_mask) == channels ?
+                                             channel_mask : 0;
+    (*input_codec_context)->bit_rate       = source_bit_rate ? source_bit_rate :
+                                             (int64_t)sample_rate * block_align * 8;
+
+    av_log(NULL, AV_LOG_INFO, "Mapped '%s': %s, %d Hz, %d channels, %" PRId64 " samples\n",
+           filename, av_get_sample_fmt_name(sample_fmt), sample_rate, channels, (*mapped)->nb_samples);
+
+    return 0;
+
+    not_pcm:
+        munmap((void *)base, st.st_size);
+
+    return AVERROR(ENOSYS);
+}
+
+/**
+ * Cut the next frames out of a mapped input. Every frame points into the
+ * mapping through a read-only buffer, so nothing is copied; filters that
+ * need to write to a frame get their own copy.
+ */
+static int read_mapped_frames(FramePool *pool, TelemetryTrack *track, MappedInput *mapped,
+                              AVCodecContext *input_codec_context,
+                              AVFrame **frames, int max_frames, int *nb_frames, int *finished)
+{
+    TelemetrySpan span;
+    int error = 0;
+
+    *nb_frames = 0;
+
+    telemetry_span_start(track, &span);
+
+    while (*nb_frames < max_frames && mapped->pos < mapped->nb_samples) {
+        int nb_samples = FFMIN(MAPPED_FRAME_SIZE, mapped->nb_samples - mapped->pos);
+        int size = nb_samples * mapped->block_align;
+        uint8_t *data = (uint8_t *)mapped->data + mapped->pos * mapped->block_align;
+        AVBufferRef *map;
+        AVFrame *frame;
+
+        if ((error = init_input_frame(pool, &frame)) < 0)
+            break;
+        if (!(map = av_buffer_ref(mapped->map)) ||
+            !(frame->buf[0] = av_buffer_create(data, size, release_mapped_range, map,
+                                               AV_BUFFER_FLAG_READONLY))) {
+            av_buffer_unref(&map);
+            frame_pool_put(pool, &frame);
+            error = AVERROR(ENOMEM);
+            break;
+        }
+        atomic_fetch_add(&alloc_stats.buffers, 1);
+
+        frame->data[0]        = data;
+        frame->extended_data  = frame->data;
+        frame->linesize[0]    = size;
+        frame->nb_samples     = nb_samples;
+        frame->format         = input_codec_context->sample_fmt;
+        frame->sample_rate    = input_codec_context->sample_rate;
+        frame->channels       = input_codec_context->channels;
+        frame->channel_layout = input_codec_context->channel_layout;
+        frame->pts            = mapped->pos;
+
+        frames[(*nb_frames)++] = frame;
+        mapped->pos += nb_samples;
+    }
+
+    *finished = mapped->pos >= mapped->nb_samples;
+    telemetry_span_end(track, STAGE_DEMUX, &span);
+
+    return error;
+}
+
+// Drop the first nb_samples samples of a frame by moving its data pointers.
+static void skip_frame_samples(AVFrame *frame, int nb_samples)
+{
+    int planar = av_sample_fmt_is_planar(frame->format);
+    int size = av_get_bytes_per_sample(frame->format) * (planar ? 1 : frame->channels);
+
+    for (int p = 0 ; p < (planar ? frame->channels : 1) ; p++) {
+        frame->extended_data[p] += nb_samples * size;
+        if (p < AV_NUM_DATA_POINTERS)
+            frame->data[p] = frame->extended_data[p];
+    }
+    frame->nb_samples -= nb_samples;
+}
+
+/**
+ * Drop the decoded samples that come before sample start of their stream,
+ * as a seek lands on a packet before it. *pos is the position of the next
+ * decoded sample: AV_NOPTS_VALUE until the first frame after the seek gives
+ * it from its timestamp, the following frames being contiguous.
+ */
+static void trim_decoded_frames(FramePool *pool, AVStream *stream, int sample_rate, const char *name,
+                                int64_t start, int64_t *pos, AVFrame **frames, int *nb_frames)
+{
+    AVRational sample_time_base = { 1, sample_rate };
+    int nb_kept = 0;
+
+    for (int j = 0 ; j < *nb_frames ; j++) {
+        AVFrame *frame = frames[j];
+        int64_t skip;
+
+        if (*pos == AV_NOPTS_VALUE) {
+            int64_t ts = frame->best_effort_timestamp;
+
+            if (ts == AV_NOPTS_VALUE) {
+                if (start)
+                    av_log(NULL, AV_LOG_WARNING, "'%s' has no timestamps; its start is not sample exact\n", name);
+                *pos = start;
+            } else {
+                if (stream->start_time != AV_NOPTS_VALUE)
+                    ts -= stream->start_time;
+                *pos = av_rescale_q(ts, stream->time_base, sample_time_base);
+                if (*pos > start)
+                    av_log(NULL, AV_LOG_WARNING, "'%s' starts %" PRId64 " samples late after seeking\n",
+                           name, *pos - start);
+            }
+        }
+
+        skip = start - *pos;
+        *pos += frame->nb_samples;
+        if (skip >= frame->nb_samples) {
+            frame_pool_put(pool, &frames[j]);
+            continue;
+        }
+        if (skip > 0)
+            skip_frame_samples(frame, skip);
+        frames[nb_kept++] = frame;
+    }
+
+    *nb_frames = nb_kept;
+}
+
+// Length of the stream of a decoded input in samples per channel, or -1 when its container does not tell.
+static int64_t stream_length(AVFormatContext *input_format_context, int sample_rate)
+{
+    AVStream *stream = input_format_context->streams[0];
+
+    if (stream->duration != AV_NOPTS_VALUE)
+        return av_rescale_q(stream->duration, stream->time_base, (AVRational){ 1, sample_rate });
+    if (input_format_context->duration != AV_NOPTS_VALUE)
+        return av_rescale(input_format_context->duration, sample_rate, AV_TIME_BASE);
+
+    return -1;
+}
+
+// Allocate the packet the encoder writes into, and let it take its buffers from a pool when it supports it.
+static int init_output_packet(MixerContext *ctx)
+{
+    atomic_fetch_add(&alloc_stats.packets, 1);
+    if (!(ctx->output_packet = av_packet_alloc())) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate the output packet\n");
+        return AVERROR(ENOMEM);
+    }
+
+    if (ctx->output_codec_context->codec->capabilities & AV_CODEC_CAP_DR1) {
+        ctx->output_codec_context->opaque = &ctx->packet_buffer_pool;
+        ctx->output_codec_context->get_encode_buffer = get_pooled_encode_buffer;
+    }
+
+    return 0;
+}
+
+/**
+ * Samples per channel of the frames sent to the encoder: its frame size
+ * when it needs one (AAC, MP3), else block_size, so that PCM outputs are
+ * encoded and muxed in large blocks rather than in whatever the mix produced.
+ */
+static int output_frame_size(const AVCodecContext *output_codec_context, int block_size)
+{
+    if (output_codec_context->frame_size &&
+        !(output_codec_context->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+        return output_codec_context->frame_size;
+
+    return block_size;
+}
+
+// Length of input i in samples per channel, or -1 when its container does not tell.
+static int64_t input_length(MixerContext *ctx, int i)
+{
+    if (ctx->mapped_inputs[i])
+        return ctx->mapped_inputs[i]->nb_samples;
+
+    return stream_length(ctx->input_format_contexts[i], ctx->input_codec_contexts[i]->sample_rate);
+}
+
+// Length of the longest input in samples per channel of the output, or -1 when one of them does not tell.
+static int64_t inputs_length(MixerContext *ctx)
+{
+    int sample_rate = ctx->output_codec_context->sample_rate;
+    int64_t length = 0;
+
+    for (int i = 0 ; i < ctx->nb_inputs ; i++) {
+        int64_t input = input_length(ctx, i);
+
+        if (input < 0)
+            return -1;
+        length = FFMAX(length, av_rescale(input, sample_rate, ctx->input_codec_contexts[i]->sample_rate));
+    }
+
+    return length;
+}
+
+// Length of the mix within its window, in samples per channel of the output, or -1 when unknown.
+static int64_t mix_length(MixerContext *ctx)
+{
+    int sample_rate = ctx->output_codec_context->sample_rate;
+    int64_t origin = av_rescale(ctx->options.start, sample_rate, AV_TIME_BASE);
+    int64_t window = av_rescale(ctx->options.duration, sample_rate, AV_TIME_BASE);
+    int64_t length;
+
+    // A timeline is only known once its clips are opened.
+    if (!ctx->nb_inputs)
+        return -1;
+
+    if ((length = inputs_length(ctx)) >= 0)
+        length = FFMAX(length - origin, 0);
+    if (window && (length < 0 || window < length))
+        length = window;
+
+    return length;
+}
+
+/**
+ * Bytes an output will take once length samples per channel at sample_rate
+ * are encoded into it, for mixer_io_preallocate(): exact for PCM, from the
+ * bit rate for the others. 0 when it cannot be told.
+ */
+static int64_t expected_output_size(const AVCodecContext *output_codec_context, int64_t length, int sample_rate)
+{
+    int bits = av_get_bits_per_sample(output_codec_context->codec_id);
+
+    if (length <= 0)
+        return 0;
+    length = av_rescale(length, output_codec_context->sample_rate, sample_rate);
+
+    if (bits)
+        return length * output_codec_context->channels * bits / 8;
+    if (output_codec_context->bit_rate)
+        return av_rescale(length, output_codec_context->bit_rate, 8 * (int64_t)output_codec_context->sample_rate);
+
+    return 0;
+}
+
+/**
+ * Seek a decoded input to a point its decoder can start from, a little
+ * before sample start; trim_decoded_frames() drops what comes before it.
+ * An input that ends before start is sought close to its end, and trimmed
+ * to nothing.
+ */
+static int seek_decoded_input(AVFormatContext *input_format_context, AVCodecContext *input_codec_context,
+                              const char *name, int64_t start)
+{
+    AVStream *stream = input_format_context->streams[0];
+    int sample_rate = input_codec_context->sample_rate;
+    int64_t ts = start - SEEK_PREROLL * sample_rate;
+    int64_t length;
+    int error;
+
+    if (!start)
+        return 0;
+
+    if ((length = stream_length(input_format_context, sample_rate)) >= 0)
+        ts = FFMIN(ts, length - SEEK_PREROLL * sample_rate);
+
+    ts = av_rescale_q(FFMAX(ts, 0), (AVRational){ 1, sample_rate }, stream->time_base);
+    if (stream->start_time != AV_NOPTS_VALUE)
+        ts += stream->start_time;
+
+    if ((error = av_seek_frame(input_format_context, 0, ts, AVSEEK_FLAG_BACKWARD)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not seek '%s' to %.3f s (error '%s')\n",
+               name, (double)start / sample_rate, av_err2str(error));
+        return error;
+    }
+    avcodec_flush_buffers(input_codec_context);
+
+    return 0;
+}
+
+/**
+ * Move input i to the first sample of the segment. Mapped inputs start
+ * right there; decoded ones are sought a little earlier, and trimmed as
+ * they are decoded.
+ */
+static int seek_segment_input(MixerContext *ctx, int i)
+{
+    MixSegment *segment = ctx->segment;
+    AVCodecContext *input_codec_context = ctx->input_codec_contexts[i];
+
+    segment->input_start[i] = av_rescale(segment->origin + segment->next_pos, input_codec_context->sample_rate,
+                                         ctx->output_codec_context->sample_rate);
+    segment->input_pos[i]   = AV_NOPTS_VALUE;
+
+    if (ctx->mapped_inputs[i]) {
+        ctx->mapped_inputs[i]->pos = FFMIN(segment->input_start[i], ctx->mapped_inputs[i]->nb_samples);
+        return 0;
+    }
+
+    return seek_decoded_input(ctx->input_format_contexts[i], input_codec_context,
+                              ctx->input_filenames[i], segment->input_start[i]);
+}
+
+// Get the next batch of frames of input i, from its mapping or its decoder.
+static int next_input_frames(MixerContext *ctx, int i, AVFrame **frames, int *nb_frames, int *finished)
+{
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_INPUT + i];
+    int error;
+
+    if (ctx->mapped_inputs[i])
+        error = read_mapped_frames(&ctx->frame_pool, track, ctx->mapped_inputs[i],
+                                   ctx->input_codec_contexts[i], frames,
+                                   MAX_DECODED_FRAMES, nb_frames, finished);
+    else
+        error = decode_audio_frames(&ctx->frame_pool, track, frames, MAX_DECODED_FRAMES, nb_frames,
+                                    ctx->input_packets[i], ctx->input_format_contexts[i],
+                                    ctx->input_codec_contexts[i], finished);
+
+    if (ctx->segment && !ctx->mapped_inputs[i])
+        trim_decoded_frames(&ctx->frame_pool, ctx->input_format_contexts[i]->streams[0],
+                            ctx->input_codec_contexts[i]->sample_rate, ctx->input_filenames[i],
+                            ctx->segment->input_start[i], &ctx->segment->input_pos[i], frames, nb_frames);
+
+    for (int j = 0 ; j < *nb_frames ; j++) {
+        track->nb_frames++;
+        track->nb_samples += frames[j]->nb_samples;
+    }
+
+    return error;
+}
+
+// Whether a segment has mixed everything it has to, or has to stop because another one failed.
+static int segment_done(const MixerContext *ctx)
+{
+    return ctx->segment && (ctx->segment->done ||
+                            (ctx->segment->aborted && atomic_load(ctx->segment->aborted)));
+}
+
+// Whether ctx mixes one segment of a segmented mix, whose parent writes the output file.
+static int is_segment_child(const MixerContext *ctx)
+{
+    return ctx->segment && ctx->segment->spill;
+}
+
+// Decode input i whole into the PCM cache entry at path, as interleaved float at its own rate and layout.
+static int decode_to_pcm_cache(MixerContext *ctx, int i, const char *path)
+{
+    const MixerOptions *options = &ctx->options;
+    const char *filename = ctx->input_filenames[i];
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_INPUT + i];
+    AVFormatContext *input_format_context = NULL;
+    AVCodecContext *input_codec_context = NULL;
+    AVFrame *frames[MAX_DECODED_FRAMES];
+    AVPacket *packet = NULL;
+    SwrContext *resampler = NULL;
+    SampleBuffer converted = { 0 };
+    PcmCacheWriter writer;
+    int nb_frames, finished = 0;
+    int error;
+
+    if ((error = open_input_file(filename, options, &input_format_context, &input_codec_context)) < 0)
+        return error;
+    if (!input_codec_context->channel_layout)
+        input_codec_context->channel_layout = av_get_default_channel_layout(input_codec_context->channels);
+
+    atomic_fetch_add(&alloc_stats.packets, 1);
+    packet    = av_packet_alloc();
+    resampler = swr_alloc_set_opts(NULL, input_codec_context->channel_layout, AV_SAMPLE_FMT_FLT,
+                                   input_codec_context->sample_rate,
+                                   input_codec_context->channel_layout, input_codec_context->sample_fmt,
+                                   input_codec_context->sample_rate, 0, NULL);
+    converted = (SampleBuffer) {
+        .channels   = input_codec_context->channels,
+        .sample_fmt = AV_SAMPLE_FMT_FLT,
+    };
+    if (!packet || !resampler) {
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((error = swr_init(resampler)) < 0 ||
+        (error = pcm_cache_writer_open(&writer, options->pcm_cache, path, input_codec_context->sample_rate,
+                                       input_codec_context->channels, input_codec_context->channel_layout,
+                                       input_codec_context->bit_rate,
+                                       (int64_t)options->pcm_cache_size << 20)) < 0)
+        goto end;
+
+    while (!finished && error >= 0) {
+        if ((error = decode_audio_frames(&ctx->frame_pool, track, frames, MAX_DECODED_FRAMES, &nb_frames,
+                                         packet, input_format_context, input_codec_context, &finished)) < 0)
+            break;
+
+        for (int j = 0 ; j < nb_frames ; j++) {
+            AVFrame *frame = frames[j];
+
+            if (error >= 0 && (error = sample_buffer_reserve(&converted, frame->nb_samples)) >= 0 &&
+                (error = swr_convert(resampler, converted.samples, frame->nb_samples,
+                                     (const uint8_t **)frame->extended_data, frame->nb_samples)) >= 0)
+                error = pcm_cache_writer_write(&writer, (const float *)converted.samples[0], error);
+            frame_pool_put(&ctx->frame_pool, &frames[j]);
+        }
+    }
+    error = pcm_cache_writer_close(&writer, error);
+
+    end:
+        close_input_file(&input_format_context, track);
+        avcodec_free_context(&input_codec_context);
+        av_packet_free(&packet);
+        swr_free(&resampler);
+        sample_buffer_free(&converted);
+
+    return error;
+}
+
+/**
+ * Map input i from the PCM cache, decoding it into the cache first when it
+ * is not there yet. Fails for the inputs that cannot be cached, which then
+ * go through open_input_file().
+ */
+static int open_cached_input(MixerContext *ctx, int i)
+{
+    const char *filename = ctx->input_filenames[i];
+    char *path;
+    int hit, error;
+
+    if ((error = pcm_cache_path(ctx->options.pcm_cache, filename, &path)) <= 0)
+        return error < 0 ? error : AVERROR(ENOSYS);
+
+    hit = open_mapped_input(path, &ctx->mapped_inputs[i], &ctx->input_codec_contexts[i]) >= 0;
+    if (hit)
+        pcm_cache_touch(path);
+    else if ((error = decode_to_pcm_cache(ctx, i, path)) >= 0)
+        error = open_mapped_input(path, &ctx->mapped_inputs[i], &ctx->input_codec_contexts[i]);
+    av_free(path);
+
+    if (error < 0) {
+        av_log(NULL, AV_LOG_VERBOSE, "Could not cache the samples of '%s' (error '%s')\n",
+               filename, get_error_text(error));
+        return error;
+    }
+
+    // The inputs of a segmented mix are counted once, by its parent.
+    if (!is_segment_child(ctx)) {
+        if (hit) {
+            ctx->pcm_cache_hits++;
+            ctx->pcm_cache_bytes += ctx->mapped_inputs[i]->nb_samples * ctx->mapped_inputs[i]->block_align;
+        } else {
+            ctx->pcm_cache_misses++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Cut a mixed frame to the samples the segment mixes and give it the pts of
+ * its first sample. Returns 0 when nothing of it is left.
+ */
+static int clip_to_segment(MixSegment *segment, AVFrame *frame)
+{
+    int64_t start = segment->next_pos;
+    int64_t mix_end = segment->end == INT64_MAX ? INT64_MAX : segment->end + segment->postroll;
+
+    frame->nb_samples = FFMIN(frame->nb_samples, mix_end - start);
+    if (frame->nb_samples <= 0) {
+        segment->done = 1;
+        return 0;
+    }
+
+    frame->pts = start;
+    segment->next_pos += frame->nb_samples;
+    segment->nb_samples += FFMAX(FFMIN(segment->next_pos, segment->end) - FFMAX(start, segment->start), 0);
+    if (segment->next_pos >= mix_end)
+        segment->done = 1;
+
+    return 1;
+}
+
+/**
+ * Append a packet of the segment to its spill file, unless it belongs to
+ * the preroll or the postroll. Packet pts are the pts of the samples they
+ * encode minus the encoder delay, so the cut is moved by as much.
+ */
+static int spill_packet(MixSegment *segment, const AVPacket *packet)
+{
+    SpilledPacket header = {
+        .pts      = packet->pts,
+        .dts      = packet->dts,
+        .duration = packet->duration,
+        .size     = packet->size,
+        .flags    = packet->flags,
+    };
+
+    if ((segment->index > 0 && packet->pts < segment->start - segment->delay) ||
+        (segment->end != INT64_MAX && packet->pts >= segment->end - segment->delay))
+        return 0;
+
+    if (fwrite(&header, sizeof(header), 1, segment->spill) != 1 ||
+        fwrite(packet->data, 1, packet->size, segment->spill) != packet->size) {
+        av_log(NULL, AV_LOG_ERROR, "Could not spill a packet of segment %d\n", segment->index);
+        return AVERROR(EIO);
+    }
+
+    return 0;
+}
+
+// Encode one frame worth of audio to the output file.
+static int encode_audio_frame(MixerContext *ctx, AVFrame *frame, int *data_present)
+{
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_ENCODER];
+    AVCodecContext *output_codec_context = ctx->output_codec_context;
+    AVPacket *output_packet = ctx->output_packet;
+    TelemetrySpan span;
+    int error;
+    *data_present = 0;
+
+    if (frame) {
+        track->nb_frames++;
+        track->nb_samples += frame->nb_samples;
+    }
+
+    // send the frame for encoding
+    telemetry_span_start(track, &span);
+    error = avcodec_send_frame(output_codec_context, frame);
+    telemetry_span_end(track, STAGE_ENCODE, &span);
+    if (error == AVERROR_EOF) {
+        // The encoder has already been flushed.
+        return 0;
+    } else if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not send frame for encoding (error '%s')\n",
+               av_err2str(error));
+        return error;
+    }
+
+    // read all the available output packets (in general there may be any number of them)
+    while (1) {
+        telemetry_span_start(track, &span);
+        error = avcodec_receive_packet(output_codec_context, output_packet);
+        telemetry_span_end(track, STAGE_ENCODE, &span);
+        if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
+            return 0;
+        } else if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Unexpected error (error '%s')\n",
+                   av_err2str(error));
+            return error;
+        }
+
+        track->nb_packets++;
+        track->nb_bytes += output_packet->size;
+
+        // A segment spills its packets; its parent muxes them in order.
+        telemetry_span_start(track, &span);
+        if (is_segment_child(ctx)) {
+            error = spill_packet(ctx->segment, output_packet);
+        } else {
+            av_packet_rescale_ts(output_packet, (AVRational){ 1, output_codec_context->sample_rate },
+                                 ctx->output_format_context->streams[0]->time_base);
+            error = av_write_frame(ctx->output_format_context, output_packet);
+        }
+        telemetry_span_end(track, STAGE_MUX, &span);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not write frame (error '%s')\n",
+                   get_error_text(error));
+            av_packet_unref(output_packet);
+            return error;
+        }
+
+        av_packet_unref(output_packet);
+        *data_present = 1;
+    }
+}
+
+/**
+ * Bounded single-producer/single-consumer frame queue.
+ * The ring itself is lock-free: the producer only moves the tail and the
+ * consumer only moves the head. The two semaphores count the free slots and
+ * the queued frames so that a stage sleeps instead of spinning when its
+ * neighbour is slower. A NULL frame is a valid element and marks the end
+ * of the stream.
+ */
+typedef struct FrameQueue {
+    AVFrame **frames;
+    unsigned int size;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int aborted;
+    sem_t items;
+    sem_t slots;
+    // Track of the producer, which samples the depth of the queue.
+    TelemetryTrack *producer;
+} FrameQueue;
+
+// One decoder thread and the queue it fills, per input.
+typedef struct InputWorker {
+    struct Pipeline *pipeline;
+    int index;
+    int started;
+    pthread_t thread;
+    FrameQueue queue;
+} InputWorker;
+
+/**
+ * Pipelined mode: every input is demuxed and decoded on its own thread,
+ * the filter graph runs on the calling thread and the encoder/muxer runs on
+ * a third one. The stages are connected through bounded frame queues.
+ * Mapped inputs that the native engine reads directly get no thread.
+ */
+typedef struct Pipeline {
+    MixerContext *ctx;
+    InputWorker *inputs;
+    FrameQueue output_queue;
+    pthread_t encoder_thread;
+    int encoder_started;
+    atomic_int error;
+    // Set once the mix needs no more input, before the inputs reach their end.
+    atomic_int inputs_stopped;
+} Pipeline;
+
+static int frame_queue_init(FrameQueue *q, unsigned int size)
+{
+    q->frames = av_calloc(size, sizeof(*q->frames));
+    if (!q->frames)
+        return AVERROR(ENOMEM);
+
+    q->size = size;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->aborted, 0);
+    sem_init(&q->items, 0, 0);
+    sem_init(&q->slots, 0, size);
+
+    return 0;
+}
+
+static void frame_queue_uninit(FrameQueue *q)
+{
+    if (!q->frames)
+        return;
+
+    // Free whatever the consumer did not take.
+    for (unsigned int i = atomic_load(&q->head); i != atomic_load(&q->tail); i++)
+        av_frame_free(&q->frames[i % q->size]);
+
+    sem_destroy(&q->items);
+    sem_destroy(&q->slots);
+    av_freep(&q->frames);
+}
+
+// Wake both ends of the queue up and make every further operation fail.
+static void frame_queue_abort(FrameQueue *q)
+{
+    if (!q->frames)
+        return;
+
+    atomic_store(&q->aborted, 1);
+    sem_post(&q->items);
+    sem_post(&q->slots);
+}
+
+// Append a frame (or the NULL end marker), waiting while the queue is full.
+static int frame_queue_push(FrameQueue *q, AVFrame *frame)
+{
+    unsigned int tail;
+
+    while (sem_wait(&q->slots) < 0 && errno == EINTR)
+        ;
+    if (atomic_load(&q->aborted))
+        return AVERROR_EXIT;
+
+    tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    q->frames[tail % q->size] = frame;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    sem_post(&q->items);
+
+    if (q->producer)
+        telemetry_queue_depth(q->producer, tail + 1 - atomic_load(&q->head));
+
+    return 0;
+}
+
+// Take the oldest frame, waiting while the queue is empty.
+static int frame_queue_pop(FrameQueue *q, AVFrame **frame)
+{
+    unsigned int head;
+
+    while (sem_wait(&q->items) < 0 && errno == EINTR)
+        ;
+    if (atomic_load(&q->aborted))
+        return AVERROR_EXIT;
+
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    *frame = q->frames[head % q->size];
+    q->frames[head % q->size] = NULL;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    sem_post(&q->slots);
+
+    return 0;
+}
+
+// Take the oldest frame if there is one; *frame is left untouched otherwise.
+static int frame_queue_try_pop(FrameQueue *q, AVFrame **frame, int *got_frame)
+{
+    unsigned int head;
+
+    *got_frame = 0;
+    if (sem_trywait(&q->items) < 0)
+        return 0;
+    if (atomic_load(&q->aborted))
+        return AVERROR_EXIT;
+
+    head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    *frame = q->frames[head % q->size];
+    q->frames[head % q->size] = NULL;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    sem_post(&q->slots);
+    *got_frame = 1;
+
+    return 0;
+}
+
+// Record the first error of any stage and unblock all the others.
+static void pipeline_fail(Pipeline *pipeline, int error)
+{
+    int expected = 0;
+
+    if (!atomic_compare_exchange_strong(&pipeline->error, &expected, error))
+        return;
+
+    for (int i = 0 ; pipeline->inputs && i < pipeline->ctx->nb_inputs ; i++)
+        frame_queue_abort(&pipeline->inputs[i].queue);
+    frame_queue_abort(&pipeline->output_queue);
+}
+
+// Demux and decode one input, handing every decoded frame to the filter stage.
+static void *decoder_thread(void *arg)
+{
+    InputWorker *worker = arg;
+    MixerContext *ctx = worker->pipeline->ctx;
+    AVFrame *frames[MAX_DECODED_FRAMES];
+    int nb_frames = 0;
+    int finished = 0;
+    int error = 0;
+
+    while (!finished && !atomic_load(&worker->pipeline->error) &&
+           !atomic_load(&worker->pipeline->inputs_stopped)) {
+        if ((error = next_input_frames(ctx, worker->index, frames, &nb_frames, &finished)) < 0)
+            break;
+
+        for (int i = 0 ; i < nb_frames ; i++) {
+            if (error >= 0 && (error = frame_queue_push(&worker->queue, frames[i])) >= 0)
+                continue;
+            frame_pool_put(&ctx->frame_pool, &frames[i]);
+        }
+        if (error < 0)
+            break;
+
+        if (finished)
+            error = frame_queue_push(&worker->queue, NULL);
+    }
+
+    // Its queue was aborted because the mix is over, not because of an error.
+    if (error == AVERROR_EXIT && atomic_load(&worker->pipeline->inputs_stopped))
+        error = 0;
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Decoder thread of input %d failed (error '%s')\n",
+               worker->index, av_err2str(error));
+        pipeline_fail(worker->pipeline, error);
+    }
+
+    return NULL;
+}
+
+// Encode and mux the mixed frames until the filter stage sends the end marker, then flush the encoder.
+static void *encoder_thread(void *arg)
+{
+    Pipeline *pipeline = arg;
+    MixerContext *ctx = pipeline->ctx;
+    int data_present = 0;
+    int error = 0;
+
+    while (1) {
+        AVFrame *frame = NULL;
+        int end;
+
+        if ((error = frame_queue_pop(&pipeline->output_queue, &frame)) < 0)
+            break;
+
+        // The end marker drains the encoder.
+        end = !frame;
+        error = encode_audio_frame(ctx, frame, &data_present);
+        frame_pool_put(&ctx->frame_pool, &frame);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Encoder thread failed (error '%s')\n", av_err2str(error));
+            break;
+        }
+        if (end)
+            break;
+    }
+
+    if (error < 0)
+        pipeline_fail(pipeline, error);
+
+    return NULL;
+}
+
+/**
+ * Create the queues and spawn the decoder and encoder threads. On failure
+ * the threads already running are left to pipeline_fail and pipeline_stop.
+ */
+static int pipeline_start(Pipeline *pipeline, MixerContext *ctx, int depth, int direct_mapped)
+{
+    int error;
+
+    pipeline->ctx = ctx;
+    atomic_init(&pipeline->error, 0);
+    atomic_init(&pipeline->inputs_stopped, 0);
+
+    pipeline->inputs = av_calloc(ctx->nb_inputs, sizeof(*pipeline->inputs));
+    if (!pipeline->inputs)
+        return AVERROR(ENOMEM);
+
+    for (int i = 0 ; i < ctx->nb_inputs ; i++) {
+        pipeline->inputs[i].pipeline = pipeline;
+        pipeline->inputs[i].index = i;
+        if ((error = frame_queue_init(&pipeline->inputs[i].queue, depth)) < 0)
+            return error;
+        pipeline->inputs[i].queue.producer = &ctx->telemetry.tracks[TRACK_INPUT + i];
+    }
+    if ((error = frame_queue_init(&pipeline->output_queue, depth)) < 0)
+        return error;
+    pipeline->output_queue.producer = &ctx->telemetry.tracks[TRACK_MIX];
+
+    for (int i = 0 ; i < ctx->nb_inputs ; i++) {
+        if (direct_mapped && ctx->mapped_inputs[i])
+            continue;
+        if ((error = pthread_create(&pipeline->inputs[i].thread, NULL,
+                                    decoder_thread, &pipeline->inputs[i]))) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start decoder thread %d\n", i);
+            return AVERROR(error);
+        }
+        pipeline->inputs[i].started = 1;
+    }
+    if ((error = pthread_create(&pipeline->encoder_thread, NULL, encoder_thread, pipeline))) {
+        av_log(NULL, AV_LOG_ERROR, "Could not start encoder thread\n");
+        return AVERROR(error);
+    }
+    pipeline->encoder_started = 1;
+
+    return 0;
+}
+
+/**
+ * Stop the decoder threads of a mix that ended before its inputs did (the
+ * end of its window), while the encoder thread finishes what is queued.
+ */
+static void pipeline_stop_inputs(Pipeline *pipeline)
+{
+    atomic_store(&pipeline->inputs_stopped, 1);
+    for (int i = 0 ; i < pipeline->ctx->nb_inputs ; i++)
+        frame_queue_abort(&pipeline->inputs[i].queue);
+}
+
+// Wait for every stage to finish and release the queues.
+static int pipeline_stop(Pipeline *pipeline)
+{
+    for (int i = 0 ; pipeline->inputs && i < pipeline->ctx->nb_inputs ; i++) {
+        if (pipeline->inputs[i].started)
+            pthread_join(pipeline->inputs[i].thread, NULL);
+    }
+    if (pipeline->encoder_started)
+        pthread_join(pipeline->encoder_thread, NULL);
+
+    for (int i = 0 ; pipeline->inputs && i < pipeline->ctx->nb_inputs ; i++)
+        frame_queue_uninit(&pipeline->inputs[i].queue);
+    frame_queue_uninit(&pipeline->output_queue);
+    av_freep(&pipeline->inputs);
+
+    return atomic_load(&pipeline->error);
+}
+
+/**
+ * Get the next batch of decoded frames of input i. Without a pipeline the
+ * input is decoded inline, otherwise the batch is made of the frames its
+ * decoder thread has queued so far, waiting for at least one of them.
+ */
+static int read_input_frames(MixerContext *ctx, int i, AVFrame **frames,
+                             int *nb_frames, int *finished)
+{
+    Pipeline *pipeline = ctx->pipeline;
+    int got_frame = 1;
+    int error;
+
+    if (!pipeline)
+        return next_input_frames(ctx, i, frames, nb_frames, finished);
+
+    *nb_frames = 0;
+
+    if ((error = frame_queue_pop(&pipeline->inputs[i].queue, &frames[0])) < 0)
+        return error;
+
+    while (frames[*nb_frames]) {
+        (*nb_frames)++;
+        if (*nb_frames == MAX_DECODED_FRAMES)
+            return 0;
+        if ((error = frame_queue_try_pop(&pipeline->inputs[i].queue, &frames[*nb_frames],
+                                         &got_frame)) < 0 || !got_frame)
+            return error;
+    }
+
+    // The end marker was reached.
+    *finished = 1;
+
+    return 0;
+}
+
+/**
+ * An output added with mixer_add_output(). The mixed frames are handed to
+ * it by reference, so the mix is done once whatever the number of outputs;
+ * it converts them when its encoder takes another format, rate or layout,
+ * cuts them into frames of the encoder's size and encodes and muxes them
+ * on a thread of its own, so that the outputs encode in parallel.
+ */
+typedef struct MixerOutput {
+    MixerContext *ctx;
+    char *filename;
+    // Name of the encoder, or NULL for the default codec of the container.
+    char *codec_name;
+    int64_t bit_rate;
+
+    AVFormatContext *format_context;
+    AVCodecContext *codec_context;
+    const AVCodec *codec;
+    AVPacket *packet;
+    // Only set when the encoder does not take the mixed samples as they are.
+    SwrContext *resampler;
+    SampleBuffer converted;
+    AVAudioFifo *fifo;
+    AVBufferPool *pool;
+    int frame_size;
+    // Pts of the next frame sent to the encoder, in samples.
+    int64_t next_pts;
+
+    FrameQueue queue;
+    pthread_t thread;
+    int started;
+    int error;
+
+    int64_t nb_packets;
+    int64_t nb_bytes;
+} MixerOutput;
+
+static int encode_output_frame(MixerOutput *output, AVFrame *frame)
+{
+    AVCodecContext *codec_context = output->codec_context;
+    AVStream *stream = output->format_context->streams[0];
+    int error;
+
+    error = avcodec_send_frame(codec_context, frame);
+    if (error == AVERROR_EOF)
+        return 0;
+    if (error < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not send frame for encoding to '%s' (error '%s')\n",
+               output->filename, av_err2str(error));
+        return error;
+    }
+
+    while ((error = avcodec_receive_packet(codec_context, output->packet)) >= 0) {
+        output->nb_packets++;
+        output->nb_bytes += output->packet->size;
+
+        av_packet_rescale_ts(output->packet, (AVRational){ 1, codec_context->sample_rate }, stream->time_base);
+        error = av_write_frame(output->format_context, output->packet);
+        av_packet_unref(output->packet);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not write frame to '%s' (error '%s')\n",
+                   output->filename, av_err2str(error));
+            return error;
+        }
+    }
+
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : error;
+}
+
+// Encode the full frames buffered in the FIFO; at the end, what is left as the last frame.
+static int encode_output_fifo(MixerOutput *output, int end)
+{
+    AVCodecContext *codec_context = output->codec_context;
+    int error = 0;
+
+    while (error >= 0 && (av_audio_fifo_size(output->fifo) >= output->frame_size ||
+                          (end && av_audio_fifo_size(output->fifo) > 0))) {
+        AVFrame *frame = frame_pool_get(&output->ctx->frame_pool);
+
+        if (!frame)
+            return AVERROR(ENOMEM);
+        frame->format         = codec_context->sample_fmt;
+        frame->channel_layout = codec_context->channel_layout;
+        frame->channels       = codec_context->channels;
+        frame->sample_rate    = codec_context->sample_rate;
+        frame->nb_samples     = FFMIN(av_audio_fifo_size(output->fifo), output->frame_size);
+        if ((error = frame_get_pooled_buffer(frame, output->pool)) >= 0 &&
+            av_audio_fifo_read(output->fifo, (void **)frame->extended_data, frame->nb_samples) < frame->nb_samples)
+            error = AVERROR(EIO);
+        if (error >= 0) {
+            frame->pts = output->next_pts;
+            output->next_pts += frame->nb_samples;
+            error = encode_output_frame(output, frame);
+        }
+        frame_pool_put(&output->ctx->frame_pool, &frame);
+    }
+
+    return error;
+}
+
+// Encode one mixed frame to the output; NULL ends it, draining the resampler, the FIFO and the encoder.
+static int write_to_output(MixerOutput *output, AVFrame *frame)
+{
+    int error;
+
+    // A frame of the right size is encoded as it is.
+    if (frame && !output->resampler && frame->nb_samples == output->frame_size &&
+        !av_audio_fifo_size(output->fifo)) {
+        frame->pts = output->next_pts;
+        output->next_pts += frame->nb_samples;
+        return encode_output_frame(output, frame);
+    }
+
+    if (output->resampler) {
+        const uint8_t **samples = frame ? (const uint8_t **)frame->extended_data : NULL;
+        int nb_samples = frame ? frame->nb_samples : 0;
+        int nb_out = swr_get_out_samples(output->resampler, nb_samples);
+
+        if ((error = sample_buffer_reserve(&output->converted, nb_out)) < 0 ||
+            (error = nb_out = swr_convert(output->resampler, output->converted.samples, nb_out,
+                                          samples, nb_samples)) < 0)
+            return error;
+        if (nb_out > 0 && av_audio_fifo_write(output->fifo, (void **)output->converted.samples, nb_out) < nb_out)
+            return AVERROR(ENOMEM);
+    } else if (frame && av_audio_fifo_write(output->fifo, (void **)frame->extended_data,
+                                            frame->nb_samples) < frame->nb_samples) {
+        return AVERROR(ENOMEM);
+    }
+
+    if ((error = encode_output_fifo(output, !frame)) < 0 || frame)
+        return error;
+
+    return encode_output_frame(output, NULL);
+}
+
+// Encode the frames of the mix until the end marker, then write the trailer.
+static void *output_thread(void *arg)
+{
+    MixerOutput *output = arg;
+    int error;
+
+    while (1) {
+        AVFrame *frame = NULL;
+        int end;
+
+        if ((error = frame_queue_pop(&output->queue, &frame)) < 0)
+            break;
+
+        end = !frame;
+        error = write_to_output(output, frame);
+        frame_pool_put(&output->ctx->frame_pool, &frame);
+        if (error < 0 || end)
+            break;
+    }
+
+    if (error >= 0 && (error = av_write_trailer(output->format_context)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not write the trailer of '%s' (error '%s')\n",
+               output->filename, av_err2str(error));
+    if (error >= 0)
+        error = mixer_io_close(&output->format_context->pb);
+
+    // The mix waits on the queue of this output, so stop it too.
+    if (error < 0) {
+        output->error = error;
+        frame_queue_abort(&output->queue);
+    }
+
+    return NULL;
+}
+
+/**
+ * Open the outputs added with mixer_add_output() in the format negotiated
+ * from the one the mix is encoded in, write their headers and start their
+ * threads. The outputs already running are stopped by close_outputs().
+ */
+static int start_outputs(MixerContext *ctx)
+{
+    AVCodecContext *mix = ctx->output_codec_context;
+    int error;
+
+    for (int i = 0 ; i < ctx->nb_outputs ; i++) {
+        MixerOutput *output = &ctx->outputs[i];
+        AVCodecContext *codec_context;
+        const AVCodec *codec = NULL;
+
+        output->ctx        = ctx;
+        output->next_pts   = 0;
+        output->error      = 0;
+        output->nb_packets = 0;
+        output->nb_bytes   = 0;
+
+        if (output->codec_name && !(codec = avcodec_find_encoder_by_name(output->codec_name))) {
+            av_log(NULL, AV_LOG_ERROR, "Unknown encoder '%s' for '%s'\n", output->codec_name, output->filename);
+            return AVERROR_ENCODER_NOT_FOUND;
+        }
+
+        remove(output->filename);
+        av_log(NULL, AV_LOG_INFO, "Output file : %s\n", output->filename);
+
+        if ((error = open_output_file(output->filename, codec, output->bit_rate, &mix, 1, 0, ctx->cache,
+                                      &output->format_context, &output->codec_context)) < 0)
+            return error;
+        codec_context = output->codec_context;
+        output->codec = codec_context->codec;
+        mixer_io_preallocate(output->format_context->pb,
+                             expected_output_size(codec_context, mix_length(ctx), mix->sample_rate));
+
+        if (codec_context->sample_fmt     != mix->sample_fmt  ||
+            codec_context->sample_rate    != mix->sample_rate ||
+            codec_context->channel_layout != mix->channel_layout) {
+            output->resampler = swr_alloc_set_opts(NULL, codec_context->channel_layout, codec_context->sample_fmt,
+                                                   codec_context->sample_rate,
+                                                   mix->channel_layout, mix->sample_fmt, mix->sample_rate, 0, NULL);
+            if (!output->resampler)
+                return AVERROR(ENOMEM);
+            if ((error = swr_init(output->resampler)) < 0)
+                return error;
+        }
+
+        output->frame_size = output_frame_size(codec_context, ctx->options.block_size);
+        output->converted  = (SampleBuffer) {
+            .channels   = codec_context->channels,
+            .sample_fmt = codec_context->sample_fmt,
+        };
+        atomic_fetch_add(&alloc_stats.packets, 1);
+        output->packet = av_packet_alloc();
+        output->fifo   = av_audio_fifo_alloc(codec_context->sample_fmt, codec_context->channels,
+                                             output->frame_size);
+        output->pool   = av_buffer_pool_init(av_samples_get_buffer_size(NULL, codec_context->channels,
+                                                                        output->frame_size,
+                                                                        codec_context->sample_fmt, 0),
+                                             counted_buffer_alloc);
+        if (!output->packet || !output->fifo || !output->pool)
+            return AVERROR(ENOMEM);
+
+        output->format_context->streams[0]->time_base = (AVRational){ 1, codec_context->sample_rate };
+        if ((error = avformat_write_header(output->format_context, NULL)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not write the header of '%s' (error '%s')\n",
+                   output->filename, av_err2str(error));
+            return error;
+        }
+
+        if ((error = frame_queue_init(&output->queue, ctx->options.pipeline_depth)) < 0)
+            return error;
+        if ((error = pthread_create(&output->thread, NULL, output_thread, output))) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start the thread of '%s'\n", output->filename);
+            return AVERROR(error);
+        }
+        output->started = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Wait for the outputs to end, stopping them first when the mix failed,
+ * and close them. Returns error, or the error of an output that failed:
+ * the mix itself only saw the queue of that output go away.
+ */
+static int close_outputs(MixerContext *ctx, int error)
+{
+    for (int i = 0 ; i < ctx->nb_outputs ; i++) {
+        MixerOutput *output = &ctx->outputs[i];
+
+        if (output->started) {
+            if (error < 0)
+                frame_queue_abort(&output->queue);
+            pthread_join(output->thread, NULL);
+            output->started = 0;
+            if (output->error < 0 && (error >= 0 || error == AVERROR_EXIT))
+                error = output->error;
+        }
+        frame_queue_uninit(&output->queue);
+
+        if (output->format_context) {
+            mixer_io_close(&output->format_context->pb);
+            avformat_free_context(output->format_context);
+            output->format_context = NULL;
+        }
+        avcodec_free_context(&output->codec_context);
+        av_packet_free(&output->packet);
+        swr_free(&output->resampler);
+        sample_buffer_free(&output->converted);
+        av_audio_fifo_free(output->fifo);
+        output->fifo = NULL;
+        av_buffer_pool_uninit(&output->pool);
+    }
+
+    return error;
+}
+
+/**
+ * Hand one mixed frame over to the encoder. Without a pipeline it is encoded
+ * inline, otherwise its data is moved to a new frame for the encoder thread.
+ * Every extra output gets a new reference to it first.
+ */
+static int write_output_frame(MixerContext *ctx, AVFrame *filt_frame, int *data_present)
+{
+    AVFrame *frame;
+    int error;
+
+    if (ctx->segment && !clip_to_segment(ctx->segment, filt_frame))
+        return 0;
+
+    for (int i = 0 ; i < ctx->nb_outputs ; i++) {
+        if (!(frame = frame_pool_get(&ctx->frame_pool)))
+            return AVERROR(ENOMEM);
+        if ((error = av_frame_ref(frame, filt_frame)) < 0 ||
+            (error = frame_queue_push(&ctx->outputs[i].queue, frame)) < 0) {
+            frame_pool_put(&ctx->frame_pool, &frame);
+            return error;
+        }
+    }
+
+    if (!ctx->pipeline)
+        return encode_audio_frame(ctx, filt_frame, data_present);
+
+    if (!(frame = frame_pool_get(&ctx->frame_pool)))
+        return AVERROR(ENOMEM);
+    av_frame_move_ref(frame, filt_frame);
+
+    if ((error = frame_queue_push(&ctx->pipeline->output_queue, frame)) < 0)
+        frame_pool_put(&ctx->frame_pool, &frame);
+
+    return error;
+}
+
+/**
+ * End the outputs once the last frame has been written: the encoder thread
+ * gets the end marker, or without a pipeline the encoder is drained here,
+ * so that the packets it holds back (lossy encoders delay a few frames)
+ * make it to the output.
+ */
+static int finish_output(MixerContext *ctx)
+{
+    int data_present;
+    int error;
+
+    for (int i = 0 ; i < ctx->nb_outputs ; i++) {
+        if ((error = frame_queue_push(&ctx->outputs[i].queue, NULL)) < 0)
+            return error;
+    }
+
+    if (ctx->pipeline)
+        return frame_queue_push(&ctx->pipeline->output_queue, NULL);
+
+    return encode_audio_frame(ctx, NULL, &data_present);
+}
+
+// Print how fast the mix ran, to compare the engines on the same inputs.
+static void report_throughput(MixerContext *ctx, const char *engine, int64_t nb_samples, int64_t start_time)
+{
+    double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    AVCodecContext *output_codec_context = ctx->output_codec_context;
+
+    // Only count what the segment or the window kept.
+    if (ctx->segment)
+        nb_samples = ctx->segment->nb_samples;
+
+    ctx->stats.nb_samples = nb_samples;
+    ctx->stats.duration   = (double)nb_samples / output_codec_context->sample_rate;
+    ctx->engine_name      = engine;
+
+    // The parent of a segmented mix reports for all of its segments.
+    av_log(NULL, is_segment_child(ctx) ? AV_LOG_VERBOSE : AV_LOG_INFO, "Mixed %" PRId64 " samples in %.3f s with the %s engine "
+           "(%.0f samples/s, %.1fx realtime)\n",
+           nb_samples, elapsed, engine,
+           elapsed > 0 ? nb_samples / elapsed : 0.0,
+           elapsed > 0 ? nb_samples / elapsed / output_codec_context->sample_rate : 0.0);
+}
+
+// Samples of input i pushed into the graph, at the output sample rate.
+static int64_t pushed_samples(MixerContext *ctx, int i, int64_t nb_samples)
+{
+    return av_rescale(nb_samples, ctx->output_codec_context->sample_rate,
+                      ctx->input_codec_contexts[i]->sample_rate);
+}
+
+/**
+ * Read the next batch of frames of input i and push all of them into its
+ * buffer source, or its end once its decoder is drained.
+ */
+static int feed_input(MixerContext *ctx, int i, int *finished, int64_t *total_samples, int log_frames)
+{
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_MIX];
+    TelemetrySpan span;
+    AVFrame *frames[MAX_DECODED_FRAMES];
+    int nb_frames = 0;
+    int nb_samples = 0;
+    int error;
+
+    error = read_input_frames(ctx, i, frames, &nb_frames, finished);
+
+    // The buffer source takes its own reference, so the frames go straight back to the pool.
+    telemetry_span_start(track, &span);
+    for (int j = 0 ; j < nb_frames ; j++) {
+        nb_samples += frames[j]->nb_samples;
+        if (error >= 0) {
+            error = av_buffersrc_add_frame_flags(ctx->srcs[i], frames[j], AV_BUFFERSRC_FLAG_KEEP_REF);
+            track->nb_graph_calls++;
+            if (error < 0)
+                av_log(NULL, AV_LOG_ERROR, "Error while feeding the audio filtergraph\n");
+        }
+        frame_pool_put(&ctx->frame_pool, &frames[j]);
+    }
+    telemetry_span_end(track, STAGE_PUSH, &span);
+    if (error < 0)
+        return error;
+
+    if (nb_frames) {
+        *total_samples += nb_samples;
+        if (log_frames)
+            av_log(NULL, AV_LOG_DEBUG, "add %d samples in %d frames on input %d (%d Hz, time=%f, ttime=%f)\n",
+                   nb_samples, nb_frames, i, ctx->input_codec_contexts[i]->sample_rate,
+                   (double)nb_samples / ctx->input_codec_contexts[i]->sample_rate,
+                   (double)*total_samples / ctx->input_codec_contexts[i]->sample_rate);
+    }
+
+    // If we are at the end of the file and there are no more samples
+    // in the decoder which are delayed, we are actually finished.
+    // This must not be treated as an error.
+    if (*finished) {
+        av_log(NULL, AV_LOG_VERBOSE, "Input n°%d finished. Write NULL frame \n", i);
+        track->nb_graph_calls++;
+        if ((error = av_buffersrc_add_frame_flags(ctx->srcs[i], NULL, 0)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error writing EOF null frame for input %d\n", i);
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Run the graph until it needs more input, writing every frame it outputs.
+ * Returns AVERROR(EAGAIN) when it needs more input, AVERROR_EOF once every
+ * input has gone through.
+ */
+static int drain_graph(MixerContext *ctx, AVFrame *filt_frame, int64_t *total_out_samples, int log_frames)
+{
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_MIX];
+    TelemetrySpan span;
+    int data_present;
+    int error;
+
+    while (!segment_done(ctx)) {
+        // Runs the filters only as far as the sink needs, then the frames it holds are taken without running them again.
+        telemetry_span_start(track, &span);
+        error = avfilter_graph_request_oldest(ctx->graph);
+        track->nb_graph_calls++;
+        telemetry_span_end(track, STAGE_PULL, &span);
+        if (error < 0)
+            return error;
+
+        while (1) {
+            telemetry_span_start(track, &span);
+            error = av_buffersink_get_frame_flags(ctx->sink, filt_frame, AV_BUFFERSINK_FLAG_NO_REQUEST);
+            track->nb_graph_calls++;
+            telemetry_span_end(track, STAGE_PULL, &span);
+            if (error == AVERROR(EAGAIN))
+                break;
+            if (error < 0) {
+                if (error != AVERROR_EOF)
+                    av_log(NULL, AV_LOG_ERROR, "Error while getting filt_frame from sink\n");
+                return error;
+            }
+
+            *total_out_samples += filt_frame->nb_samples;
+            if (log_frames)
+                av_log(NULL, AV_LOG_DEBUG, "remove %d samples from sink (%d Hz, time=%f, ttime=%f)\n",
+                       filt_frame->nb_samples, ctx->output_codec_context->sample_rate,
+                       (double)filt_frame->nb_samples / ctx->output_codec_context->sample_rate,
+                       (double)*total_out_samples / ctx->output_codec_context->sample_rate);
+
+            error = write_output_frame(ctx, filt_frame, &data_present);
+            av_frame_unref(filt_frame);
+            if (error < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Tracing error at encode_audio_frame() - (error '%s')\n",
+                       get_error_text(error));
+                return error;
+            }
+            alloc_stats_report(ctx->options.debug_alloc, 0);
+            if (segment_done(ctx))
+                return 0;
+        }
+    }
+
+    return 0;
+}
+
+// Keep the largest amount of audio queued so far, and its size in bytes.
+static void update_peak_queued(MixerContext *ctx, int64_t nb_samples, int64_t size)
+{
+    ctx->stats.peak_queued_samples = FFMAX(ctx->stats.peak_queued_samples, nb_samples);
+    ctx->stats.peak_queued_bytes   = FFMAX(ctx->stats.peak_queued_bytes, size);
+}
+
+/**
+ * Mix through amix. Every input is kept options.input_lead samples ahead of
+ * what came out of the graph, read in batches; the graph is then run until
+ * it needs more. When it stalls with every input ahead, as amix may
+ * when the frames of the inputs do not line up, the input furthest behind
+ * is read once more. The inputs are so read as the mix needs them rather
+ * than on every failed request, with a few graph calls per batch of frames.
+ * With a memory budget, no input is read ahead while the graph holds more
+ * than it; only the reads the graph waits for go on.
+ */
+static int process_all(MixerContext *ctx){
+    int error = 0;
+    int nb_inputs = ctx->nb_inputs;
+    int64_t lead = ctx->options.input_lead;
+    int64_t budget = (int64_t)ctx->options.memory_budget << 20;
+    // amix queues its inputs as float, in the layout of the output.
+    int sample_size = ctx->output_codec_context->channels * sizeof(float);
+    AVFrame *filt_frame = NULL;
+    // The per-frame logs cost more than the mix on long files; only format them when shown.
+    int log_frames = av_log_get_level() >= AV_LOG_DEBUG;
+    int64_t total_out_samples = 0;
+    int starved = 0;
+
+    // Per-input state. Every input keeps its own "finished" flag, as the
+    // decoder of one input may still be flushing while another one is at EOF.
+    int *input_finished = av_calloc(nb_inputs, sizeof(*input_finished));
+    int64_t *total_samples = av_calloc(nb_inputs, sizeof(*total_samples));
+    if (!input_finished || !total_samples) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate the input states\n");
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    int64_t start_time = av_gettime_relative();
+
+    // One frame receives everything pulled from the sink.
+    filt_frame = frame_pool_get(&ctx->frame_pool);
+    if (!filt_frame) {
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (!segment_done(ctx)) {
+        int next = -1;
+        int64_t next_pos = 0;
+        int64_t queued = 0;
+
+        // The input furthest behind is read first.
+        for (int i = 0 ; i < nb_inputs ; i++) {
+            int64_t pos = pushed_samples(ctx, i, total_samples[i]);
+
+            queued += FFMAX(pos - total_out_samples, 0);
+            if (!input_finished[i] && (next < 0 || pos < next_pos)) {
+                next     = i;
+                next_pos = pos;
+            }
+        }
+        update_peak_queued(ctx, queued, queued * sample_size);
+
+        if (next >= 0 &&
+            (starved || (next_pos < total_out_samples + lead && (!budget || queued * sample_size < budget)))) {
+            if ((error = feed_input(ctx, next, &input_finished[next], &total_samples[next], log_frames)) < 0)
+                goto end;
+            starved = 0;
+            continue;
+        }
+
+        error = drain_graph(ctx, filt_frame, &total_out_samples, log_frames);
+        if (error == AVERROR_EOF)
+            break;
+        if (error == AVERROR(EAGAIN)) {
+            // Every input has ended, yet amix waits for more: nothing will come.
+            if (next < 0)
+                break;
+            if (log_frames)
+                av_log(NULL, AV_LOG_DEBUG, "Need to read input %d\n", next);
+            starved = 1;
+            continue;
+        }
+        if (error < 0)
+            goto end;
+    }
+
+    if (ctx->pipeline && segment_done(ctx))
+        pipeline_stop_inputs(ctx->pipeline);
+    if ((error = finish_output(ctx)) < 0)
+        goto end;
+
+    report_throughput(ctx, "amix", total_out_samples, start_time);
+    alloc_stats_report(ctx->options.debug_alloc, 1);
+    if (budget && ctx->stats.peak_queued_bytes > budget)
+        av_log(NULL, AV_LOG_WARNING, "The graph held up to %.1f MiB, over the memory budget of %d MiB, "
+               "while amix waited for an input\n",
+               ctx->stats.peak_queued_bytes / 1048576.0, ctx->options.memory_budget);
+    error = 0;
+
+    end:
+        frame_pool_put(&ctx->frame_pool, &filt_frame);
+        av_freep(&input_finished);
+        av_freep(&total_samples);
+        if (error == AVERROR_EOF)
+            error = 0;
+        if (error < 0)
+            av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(error));
+
+    return error;
+}
+
+/**
+ * Log how many conversions libavfilter inserted to connect the inputs to
+ * amix and amix to the output, and dump the graph when it is shown. This is
+ * done here rather than when the graph is built, as the cache builds them
+ * on a thread of its own.
+ */
+static void report_graph(AVFilterGraph *graph)
+{
+    int nb_conversions = 0;
+
+    for (unsigned i = 0 ; i < graph->nb_filters ; i++)
+        nb_conversions += !strcmp(graph->filters[i]->filter->name, "aresample");
+    av_log(NULL, AV_LOG_INFO, "Graph: %d conversion filter%s\n", nb_conversions,
+           nb_conversions == 1 ? "" : "s");
+
+    if (av_log_get_level() >= AV_LOG_VERBOSE) {
+        char *dump = avfilter_graph_dump(graph, NULL);
+        av_log(NULL, AV_LOG_VERBOSE, "Graph :\n%s\n", dump);
+        av_free(dump);
+    }
+}
+
+/**
+ * The native engine mixes the samples as they come out of the decoders,
+ * so every input must share one sample format and the rate of the output;
+ * the output may differ from them in its sample format, and from each of
+ * them in its channels, which are routed while mixing.
+ */
+static int native_engine_usable(MixerContext *ctx)
+{
+    AVCodecContext *first = ctx->input_codec_contexts[0];
+    AVCodecContext *output_codec_context = ctx->output_codec_context;
+
+    if (!mix_engine_supports(first->sample_fmt) ||
+        !mix_engine_supports(output_codec_context->sample_fmt))
+        return 0;
+
+    for (int i = 1 ; i < ctx->nb_inputs ; i++) {
+        if (ctx->input_codec_contexts[i]->sample_fmt  != first->sample_fmt ||
+            ctx->input_codec_contexts[i]->sample_rate != first->sample_rate)
+            return 0;
+    }
+
+    return first->sample_rate == output_codec_context->sample_rate;
+}
+
+/**
+ * Set *route to the gain of every channel of input i in every channel of
+ * the output, weight included: the matrix set for the input, or else the
+ * downmix or upmix libswresample would apply. Left NULL when the input has
+ * the layout of the output and no matrix.
+ */
+static int build_route(MixerContext *ctx, int i, float weight, float **route)
+{
+    const RoutingMatrix *matrix = &ctx->input_matrices[i];
+    AVCodecContext *input_codec_context = ctx->input_codec_contexts[i];
+    AVCodecContext *output_codec_context = ctx->output_codec_context;
+    uint64_t in_layout = input_channel_layout(input_codec_context);
+    int in_channels  = input_codec_context->channels;
+    int out_channels = output_codec_context->channels;
+    double *coeffs = matrix->coeffs;
+    int error = 0;
+
+    *route = NULL;
+    if (!coeffs && in_layout == output_codec_context->channel_layout)
+        return 0;
+
+    if (coeffs && (matrix->nb_rows != out_channels || matrix->nb_cols != in_channels)) {
+        av_log(NULL, AV_LOG_ERROR, "The matrix of input %d has %d rows of %d gains; it needs %d rows of %d\n",
+               i, matrix->nb_rows, matrix->nb_cols, out_channels, in_channels);
+        return AVERROR(EINVAL);
+    }
+    if (!coeffs) {
+        if (!(coeffs = av_malloc_array(out_channels * in_channels, sizeof(*coeffs))))
+            return AVERROR(ENOMEM);
+        // Not normalized, like the conversion libavfilter puts in front of amix, which sums in float.
+        if ((error = swr_build_matrix(in_layout, output_codec_context->channel_layout,
+                                      M_SQRT1_2, M_SQRT1_2, 0, INT_MAX, 1, coeffs, in_channels,
+                                      AV_MATRIX_ENCODING_NONE, NULL)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not route the channels of input %d to the output\n", i);
+            goto end;
+        }
+    }
+
+    if (!(*route = av_malloc_array(out_channels * in_channels, sizeof(**route)))) {
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (int k = 0 ; k < out_channels * in_channels ; k++)
+        (*route)[k] = coeffs[k] * weight;
+
+    end:
+        if (coeffs != matrix->coeffs)
+            av_free(coeffs);
+
+    return error;
+}
+
+// State of one input of the native engine.
+typedef struct NativeInput {
+    // Decoded samples waiting to be mixed, and the block they are read into; NULL for mapped inputs.
+    AVAudioFifo *fifo;
+    uint8_t **block;
+    // Gains of its channels in those of the output, weight included; NULL when it has the layout of the output.
+    float *route;
+    float weight;
+    int finished;
+} NativeInput;
+
+// Read input i until it holds a full block or has ended.
+static int top_up_native_input(MixerContext *ctx, int i, NativeInput *input, int block_size,
+                               TelemetryTrack *track)
+{
+    TelemetrySpan span;
+    int error;
+
+    while (!input->finished && av_audio_fifo_size(input->fifo) < block_size) {
+        AVFrame *frames[MAX_DECODED_FRAMES];
+        int nb_frames = 0;
+
+        error = read_input_frames(ctx, i, frames, &nb_frames, &input->finished);
+
+        telemetry_span_start(track, &span);
+        for (int j = 0 ; j < nb_frames ; j++) {
+            if (error >= 0 &&
+                av_audio_fifo_write(input->fifo, (void **)frames[j]->extended_data,
+                                    frames[j]->nb_samples) < frames[j]->nb_samples) {
+                av_log(NULL, AV_LOG_ERROR, "Could not buffer the samples of input %d\n", i);
+                error = AVERROR(ENOMEM);
+            }
+            frame_pool_put(&ctx->frame_pool, &frames[j]);
+        }
+        telemetry_span_end(track, STAGE_PUSH, &span);
+        if (error < 0)
+            return error;
+
+        if (input->finished)
+            av_log(NULL, AV_LOG_VERBOSE, "Input n°%d finished\n", i);
+    }
+
+    return 0;
+}
+
+// Samples input i has left to mix.
+static int64_t native_input_buffered(MixerContext *ctx, int i, const NativeInput *input)
+{
+    MappedInput *mapped = ctx->mapped_inputs[i];
+
+    return mapped ? mapped->nb_samples - mapped->pos : av_audio_fifo_size(input->fifo);
+}
+
+// Add the next nb_samples samples of input i, or what is left of them, to the block of engine.
+static void add_native_input(MixerContext *ctx, int i, NativeInput *input, MixEngine *engine, int nb_samples)
+{
+    MappedInput *mapped = ctx->mapped_inputs[i];
+    const uint8_t *data;
+    const uint8_t * const *src;
+    int n;
+
+    if (mapped) {
+        data = mapped->data + mapped->pos * mapped->block_align;
+        src  = &data;
+        n    = FFMIN(nb_samples, mapped->nb_samples - mapped->pos);
+        mapped->pos += n;
+    } else {
+        n   = av_audio_fifo_read(input->fifo, (void **)input->block, nb_samples);
+        src = (const uint8_t * const *)input->block;
+    }
+
+    if (n > 0 && input->route)
+        mix_engine_add_routed(engine, src, ctx->input_codec_contexts[i]->channels, n, 0, input->route);
+    else if (n > 0)
+        mix_engine_add(engine, src, n, 0, input->weight);
+}
+
+/**
+ * A group of inputs of a submix tree (options.submix_size). Its thread
+ * reads its inputs and mixes them into a float bus, one block at a time
+ * as the mixing loop asks for it, and the loop sums the buses. Every group
+ * mixes the same samples of the output in a round, so the buses line up
+ * to the sample.
+ */
+typedef struct Submix {
+    MixerContext *ctx;
+    NativeInput *inputs;
+    // The group is the inputs [first, first + nb_inputs).
+    int first;
+    int nb_inputs;
+    int block_size;
+    MixEngine engine;
+    uint8_t **bus;
+    // Stage times of the thread, added to those of the mix at the end.
+    TelemetryTrack track;
+
+    pthread_t thread;
+    sem_t start;
+    sem_t done;
+    int started;
+    int quit;
+
+    // Samples to mix in the next round; 0 only reads the inputs.
+    int nb_samples;
+    // Inputs of the group that have ended after the round, the most
+    // samples one of them has left (up to a block), and the error it met.
+    int nb_finished;
+    int max_buffered;
+    int error;
+} Submix;
+
+// Mix the block the loop asked for into the bus, then read the inputs up to the next one.
+static int run_submix(Submix *submix)
+{
+    MixerContext *ctx = submix->ctx;
+    TelemetrySpan span;
+    int error;
+
+    if (submix->nb_samples) {
+        telemetry_span_start(&submix->track, &span);
+        if ((error = mix_engine_begin(&submix->engine, submix->nb_samples)) < 0)
+            return error;
+        for (int i = submix->first ; i < submix->first + submix->nb_inputs ; i++)
+            add_native_input(ctx, i, &submix->inputs[i], &submix->engine, submix->nb_samples);
+        mix_engine_end(&submix->engine, submix->bus);
+        telemetry_span_end(&submix->track, STAGE_MIX, &span);
+    }
+
+    submix->nb_finished  = 0;
+    submix->max_buffered = 0;
+    for (int i = submix->first ; i < submix->first + submix->nb_inputs ; i++) {
+        NativeInput *input = &submix->inputs[i];
+
+        if ((error = top_up_native_input(ctx, i, input, submix->block_size, &submix->track)) < 0)
+            return error;
+        submix->nb_finished += input->finished;
+        submix->max_buffered = FFMAX(submix->max_buffered,
+                                     FFMIN(native_input_buffered(ctx, i, input), submix->block_size));
+    }
+
+    return 0;
+}
+
+static void *submix_thread(void *arg)
+{
+    Submix *submix = arg;
+
+    while (1) {
+        while (sem_wait(&submix->start) < 0 && errno == EINTR)
+            ;
+        if (submix->quit)
+            break;
+        submix->error = run_submix(submix);
+        sem_post(&submix->done);
+    }
+
+    return NULL;
+}
+
+// Have every group mix nb_samples samples, and wait for all of them.
+static int run_submix_round(Submix *submixes, int nb_submixes, int nb_samples)
+{
+    int error = 0;
+
+    for (int i = 0 ; i < nb_submixes ; i++) {
+        submixes[i].nb_samples = nb_samples;
+        sem_post(&submixes[i].start);
+    }
+    for (int i = 0 ; i < nb_submixes ; i++) {
+        while (sem_wait(&submixes[i].done) < 0 && errno == EINTR)
+            ;
+        if (submixes[i].error < 0 && error >= 0)
+            error = submixes[i].error;
+    }
+
+    return error;
+}
+
+static void stop_submixes(MixerContext *ctx, Submix **submixes, int nb_submixes)
+{
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_MIX];
+
+    for (int i = 0 ; *submixes && i < nb_submixes ; i++) {
+        Submix *submix = &(*submixes)[i];
+
+        if (submix->started) {
+            submix->quit = 1;
+            sem_post(&submix->start);
+            pthread_join(submix->thread, NULL);
+            sem_destroy(&submix->start);
+            sem_destroy(&submix->done);
+        }
+        for (int j = 0 ; j < NB_STAGES ; j++) {
+            track->stages[j].count += submix->track.stages[j].count;
+            track->stages[j].wall  += submix->track.stages[j].wall;
+            track->stages[j].cpu   += submix->track.stages[j].cpu;
+        }
+        mix_engine_uninit(&submix->engine);
+        if (submix->bus)
+            av_freep(&submix->bus[0]);
+        av_freep(&submix->bus);
+    }
+    av_freep(submixes);
+}
+
+/**
+ * Split the inputs into groups of about options.submix_size, at most one
+ * per core, and start their threads. Leaves *nb_submixes at 0 when the
+ * inputs are too few for two groups.
+ */
+static int start_submixes(MixerContext *ctx, NativeInput *inputs, int block_size,
+                          Submix **submixes, int *nb_submixes)
+{
+    int size = ctx->options.submix_size;
+    int channels = ctx->output_codec_context->channels;
+    int nb, error;
+
+    *submixes    = NULL;
+    *nb_submixes = 0;
+
+    // Segments already mix on a core each.
+    if (!size || is_segment_child(ctx) || ctx->nb_inputs <= size)
+        return 0;
+    // S32 inputs are summed in double, which float buses would round off.
+    if (ctx->engine.use_double) {
+        av_log(NULL, AV_LOG_VERBOSE, "S32 inputs are mixed without submixes\n");
+        return 0;
+    }
+    if ((nb = FFMIN((ctx->nb_inputs + size - 1) / size, av_cpu_count())) < 2)
+        return 0;
+
+    if (!(*submixes = av_calloc(nb, sizeof(**submixes))))
+        return AVERROR(ENOMEM);
+    *nb_submixes = nb;
+
+    for (int i = 0 ; i < nb ; i++) {
+        Submix *submix = &(*submixes)[i];
+
+        submix->ctx           = ctx;
+        submix->inputs        = inputs;
+        submix->first         = ctx->nb_inputs * i / nb;
+        submix->nb_inputs     = ctx->nb_inputs * (i + 1) / nb - submix->first;
+        submix->block_size    = block_size;
+        submix->track.enabled = ctx->telemetry.tracks[TRACK_MIX].enabled;
+
+        // Partial sums may go beyond full scale; the buses keep them as they are.
+        if ((error = mix_engine_init(&submix->engine, ctx->engine.in_fmt, AV_SAMPLE_FMT_FLTP, channels,
+                                     MIX_OVERFLOW_SATURATE)) < 0 ||
+            (error = av_samples_alloc_array_and_samples(&submix->bus, NULL, channels, block_size,
+                                                        AV_SAMPLE_FMT_FLTP, 0)) < 0)
+            return error;
+
+        sem_init(&submix->start, 0, 0);
+        sem_init(&submix->done, 0, 0);
+        if ((error = pthread_create(&submix->thread, NULL, submix_thread, submix))) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start submix %d\n", i);
+            sem_destroy(&submix->start);
+            sem_destroy(&submix->done);
+            return AVERROR(error);
+        }
+        submix->started = 1;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "Mixing %d inputs in %d submixes\n", ctx->nb_inputs, nb);
+
+    return 0;
+}
+
+/**
+ * Mix all inputs with the native engine instead of the filter graph.
+ * Decoded frames are buffered per input in an audio FIFO; every running input
+ * is topped up to a full block, which is then mixed in one pass. Inputs that
+ * have ended count as silence, so the output lasts as long as the longest
+ * input, like amix with its default duration=longest.
+ * Every input is scaled by its weight over the sum of all weights. amix does
+ * the same while all its inputs are running, but ramps the remaining inputs
+ * up over dropout_transition once one of them ends.
+ * Mapped inputs are mixed straight from their mapping: their samples are
+ * all available from the start, so they are handled like inputs that have
+ * ended with everything still buffered.
+ * Inputs with another layout than the output are routed while they are
+ * added, so a 5.1 stem or a mono voice costs no conversion pass.
+ * Mixes of many inputs are split into submixes, read and mixed on threads
+ * of their own; this loop then only sums their buses.
+ */
+static int process_all_native(MixerContext *ctx)
+{
+    MixEngine *engine = &ctx->engine;
+    MixEngine bus_engine = { 0 };
+    AVCodecContext *output_codec_context = ctx->output_codec_context;
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_MIX];
+    TelemetrySpan span;
+    float *input_weights = ctx->input_weights;
+    int nb_inputs = ctx->nb_inputs;
+    int error = 0;
+    int data_present = 0;
+    float weight_sum = 0;
+    AVFrame *out_frame = NULL;
+    AVBufferPool *out_pool = NULL;
+    int64_t total_out_samples = 0;
+    int64_t start_time = av_gettime_relative();
+    Submix *submixes = NULL;
+    int nb_submixes = 0;
+    // Blocks are mixed in the frame size of the encoder, so they go to it as they are.
+    int block_size = ctx->frame_size;
+    
+    NativeInput *inputs = av_calloc(nb_inputs, sizeof(*inputs));
+    if (!inputs) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate the input states\n");
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+    
+    for (int i = 0 ; i < nb_inputs ; i++)
+        weight_sum += fabsf(input_weights[i]);
+    if (weight_sum == 0)
+        weight_sum = 1;
+    
+    for (int i = 0 ; i < nb_inputs ; i++) {
+        AVCodecContext *input_codec_context = ctx->input_codec_contexts[i];
+        NativeInput *input = &inputs[i];
+        
+        input->weight = input_weights[i] / weight_sum;
+        if ((error = build_route(ctx, i, input->weight, &input->route)) < 0)
+            goto end;
+        if (input->route)
+            av_log(NULL, AV_LOG_VERBOSE, "Input %d: %d channels routed to %d\n", i,
+                   input_codec_context->channels, output_codec_context->channels);
+        if (ctx->mapped_inputs[i]) {
+            input->finished = 1;
+            continue;
+        }
+        
+        input->fifo = av_audio_fifo_alloc(input_codec_context->sample_fmt,
+                                          input_codec_context->channels, block_size);
+        if (!input->fifo ||
+            av_samples_alloc_array_and_samples(&input->block, NULL, input_codec_context->channels,
+                                               block_size, input_codec_context->sample_fmt, 0) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not allocate the buffers of input %d\n", i);
+            error = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    
+    // Output blocks never exceed block_size samples, so one pool
+    // size fits them all.
+    out_pool = av_buffer_pool_init(av_samples_get_buffer_size(NULL, output_codec_context->channels,
+                                                              block_size, engine->out_fmt, 0),
+                                   counted_buffer_alloc);
+    if (!out_pool) {
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+    
+    if ((error = start_submixes(ctx, inputs, block_size, &submixes, &nb_submixes)) < 0)
+        goto end;
+    if (nb_submixes) {
+        // The buses are float planar, already weighted: they are summed as they are.
+        if ((error = mix_engine_init(&bus_engine, AV_SAMPLE_FMT_FLTP, engine->out_fmt,
+                                     output_codec_context->channels, ctx->options.overflow)) < 0 ||
+            (error = run_submix_round(submixes, nb_submixes, 0)) < 0)
+            goto end;
+    }
+    
+    while (!segment_done(ctx)) {
+        int nb_samples = block_size;
+        int nb_finished = 0;
+        int max_buffered = 0;
+        
+        if (nb_submixes) {
+            // The groups have read their inputs up to this block in the last round.
+            for (int i = 0 ; i < nb_submixes ; i++) {
+                nb_finished += submixes[i].nb_finished;
+                max_buffered = FFMAX(max_buffered, submixes[i].max_buffered);
+            }
+        } else {
+            // Top every running input up to a full block.
+            for (int i = 0 ; i < nb_inputs ; i++) {
+                if ((error = top_up_native_input(ctx, i, &inputs[i], block_size, track)) < 0)
+                    goto end;
+                nb_finished += inputs[i].finished;
+                max_buffered = FFMAX(max_buffered, FFMIN(native_input_buffered(ctx, i, &inputs[i]), block_size));
+            }
+        }
+        
+        // Mapped inputs are read in place; only the FIFOs hold samples.
+        int64_t queued = 0, queued_size = 0;
+        for (int i = 0 ; i < nb_inputs ; i++) {
+            AVCodecContext *input_codec_context = ctx->input_codec_contexts[i];
+            int n = inputs[i].fifo ? av_audio_fifo_size(inputs[i].fifo) : 0;
+
+            queued      += n;
+            queued_size += (int64_t)n * input_codec_context->channels *
+                           av_get_bytes_per_sample(input_codec_context->sample_fmt);
+        }
+        update_peak_queued(ctx, queued, queued_size);
+
+        // Once every input has ended, flush what is left of the longest one.
+        if (nb_finished == nb_inputs && !(nb_samples = max_buffered))
+            break;
+        
+        if (nb_submixes) {
+            if ((error = run_submix_round(submixes, nb_submixes, nb_samples)) < 0)
+                goto end;
+            telemetry_span_start(track, &span);
+            if ((error = mix_engine_begin(&bus_engine, nb_samples)) < 0)
+                goto end;
+            for (int i = 0 ; i < nb_submixes ; i++)
+                mix_engine_add(&bus_engine, (const uint8_t * const *)submixes[i].bus, nb_samples, 0, 1.0f);
+        } else {
+            telemetry_span_start(track, &span);
+            if ((error = mix_engine_begin(engine, nb_samples)) < 0)
+                goto end;
+            for (int i = 0 ; i < nb_inputs ; i++)
+                add_native_input(ctx, i, &inputs[i], engine, nb_samples);
+        }
+        
+        if (!(out_frame = frame_pool_get(&ctx->frame_pool))) {
+            error = AVERROR(ENOMEM);
+            goto end;
+        }
+        out_frame->format         = engine->out_fmt;
+        out_frame->channel_layout = output_codec_context->channel_layout;
+        out_frame->channels       = output_codec_context->channels;
+        out_frame->sample_rate    = output_codec_context->sample_rate;
+        out_frame->nb_samples     = nb_samples;
+        if ((error = frame_get_pooled_buffer(out_frame, out_pool)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not allocate the output samples\n");
+            goto end;
+        }
+        
+        mix_engine_end(nb_submixes ? &bus_engine : engine, out_frame->extended_data);
+        telemetry_span_end(track, STAGE_MIX, &span);
+        out_frame->pts = total_out_samples;
+        total_out_samples += nb_samples;
+        
+        error = write_output_frame(ctx, out_frame, &data_present);
+        frame_pool_put(&ctx->frame_pool, &out_frame);
+        alloc_stats_report(ctx->options.debug_alloc, 0);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Tracing error at encode_audio_frame() - (error '%s')\n",
+                   get_error_text(error));
+            goto end;
+        }
+    }
+    
+    if (ctx->pipeline && segment_done(ctx))
+        pipeline_stop_inputs(ctx->pipeline);
+    if ((error = finish_output(ctx)) < 0)
+        goto end;
+    
+    report_throughput(ctx, engine->isa, total_out_samples, start_time);
+    alloc_stats_report(ctx->options.debug_alloc, 1);
+    
+    end:
+        // The groups use the inputs, so they stop first.
+        stop_submixes(ctx, &submixes, nb_submixes);
+        mix_engine_uninit(&bus_engine);
+        frame_pool_put(&ctx->frame_pool, &out_frame);
+        av_buffer_pool_uninit(&out_pool);
+        for (int i = 0 ; inputs && i < nb_inputs ; i++) {
+            av_audio_fifo_free(inputs[i].fifo);
+            if (inputs[i].block)
+                av_freep(&inputs[i].block[0]);
+            av_freep(&inputs[i].block);
+            av_freep(&inputs[i].route);
+        }
+        av_freep(&inputs);
+        
+        if (error < 0)
+            av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(error));
+    
+    return error;
+}
+
+// Write the header of the output file container
+static int write_output_file_header(AVFormatContext *output_format_context)
+{
+    int error;
+    if ((error = avformat_write_header(output_format_context, NULL)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not write output file header (error '%s')\n",
+               get_error_text(error));
+        return error;
+    }
+
+    return 0;
+}
+
+// Write the trailer of the output file container and close the file, which reports the last write errors.
+static int write_output_file_trailer(AVFormatContext *output_format_context)
+{
+    int error;
+    if ((error = av_write_trailer(output_format_context)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not write output file trailer (error '%s')\n",
+               get_error_text(error));
+        return error;
+    }
+
+    return mixer_io_close(&output_format_context->pb);
+}
+
+// Close everything mixer_run() opened. The inputs and the pools are kept.
+static void close_mix_files(MixerContext *ctx)
+{
+    for (int i = 0 ; i < ctx->nb_inputs ; i++) {
+        if (ctx->input_format_contexts)
+            close_input_file(&ctx->input_format_contexts[i], TRACK_INPUT + i < ctx->telemetry.nb_tracks ?
+                                                             &ctx->telemetry.tracks[TRACK_INPUT + i] : NULL);
+        if (ctx->input_codec_contexts)
+            avcodec_free_context(&ctx->input_codec_contexts[i]);
+        if (ctx->input_packets)
+            av_packet_free(&ctx->input_packets[i]);
+        if (ctx->mapped_inputs && ctx->mapped_inputs[i]) {
+            av_buffer_unref(&ctx->mapped_inputs[i]->map);
+            av_freep(&ctx->mapped_inputs[i]);
+        }
+    }
+    av_freep(&ctx->input_format_contexts);
+    av_freep(&ctx->input_codec_contexts);
+    av_freep(&ctx->input_packets);
+    av_freep(&ctx->mapped_inputs);
+
+    if (ctx->output_format_context) {
+        mixer_io_close(&ctx->output_format_context->pb);
+        avformat_free_context(ctx->output_format_context);
+        ctx->output_format_context = NULL;
+    }
+    avcodec_free_context(&ctx->output_codec_context);
+    av_packet_free(&ctx->output_packet);
+
+    avfilter_graph_free(&ctx->graph);
+    av_freep(&ctx->srcs);
+    ctx->sink = NULL;
+    mix_engine_uninit(&ctx->engine);
+}
+
+// Drop the inputs and the output of the last mix.
+static void clear_mix(MixerContext *ctx)
+{
+    for (int i = 0 ; i < ctx->nb_inputs ; i++) {
+        av_freep(&ctx->input_filenames[i]);
+        av_freep(&ctx->input_matrices[i].coeffs);
+    }
+    av_freep(&ctx->input_filenames);
+    av_freep(&ctx->input_weights);
+    av_freep(&ctx->input_matrices);
+    av_freep(&ctx->output);
+    ctx->nb_inputs = 0;
+
+    for (int i = 0 ; i < ctx->nb_clips ; i++)
+        av_freep(&ctx->clips[i].filename);
+    av_freep(&ctx->clips);
+    ctx->nb_clips = 0;
+
+    for (int i = 0 ; i < ctx->nb_outputs ; i++) {
+        av_freep(&ctx->outputs[i].filename);
+        av_freep(&ctx->outputs[i].codec_name);
+    }
+    av_freep(&ctx->outputs);
+    ctx->nb_outputs = 0;
+}
+
+void mixer_options_default(MixerOptions *options)
+{
+    *options = (MixerOptions) {
+        .nb_threads       = 1,
+        .pipeline_depth   = DEFAULT_PIPELINE_DEPTH,
+        .block_size       = DEFAULT_BLOCK_SIZE,
+        .input_lead       = DEFAULT_INPUT_LEAD,
+        .submix_size      = DEFAULT_SUBMIX_SIZE,
+        .overflow         = MIX_OVERFLOW_SATURATE,
+        .use_mmap         = 1,
+        .read_ahead       = DEFAULT_READ_AHEAD,
+        .read_ahead_depth = DEFAULT_READ_AHEAD_DEPTH,
+        .pcm_cache_size   = DEFAULT_PCM_CACHE_SIZE,
+    };
+}
+
+// Peak resident set size of the process, in bytes.
+static int64_t peak_rss(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        return 0;
+
+    // Linux counts it in KiB.
+    return usage.ru_maxrss * INT64_C(1024);
+}
+
+// Value of a switch without argument: set unless it is "false" or "0".
+static int switch_value(const char *value)
+{
+    return !value || (strcmp(value, "false") && strcmp(value, "0"));
+}
+
+int mixer_options_set(MixerOptions *options, const char *name, const char *value)
+{
+    int valid = 1;
+
+    if (!strcmp(name, "no-mmap")) {
+        options->use_mmap = !switch_value(value);
+        return 0;
+    }
+    if (!strcmp(name, "probe-cache-validate")) {
+        options->probe_cache_validate = switch_value(value);
+        return 0;
+    }
+    if (!strcmp(name, "debug-alloc")) {
+        options->debug_alloc = switch_value(value);
+        return 0;
+    }
+    if (!strcmp(name, "telemetry")) {
+        options->telemetry = switch_value(value);
+        return 0;
+    }
+    if (!strcmp(name, "trace")) {
+        options->trace = switch_value(value);
+        return 0;
+    }
+
+    if (!value) {
+        av_log(NULL, AV_LOG_ERROR, "Option '%s' needs a value\n", name);
+        return AVERROR(EINVAL);
+    }
+
+    if (!strcmp(name, "start") || !strcmp(name, "duration")) {
+        int64_t *time = !strcmp(name, "start") ? &options->start : &options->duration;
+        valid = av_parse_time(time, value, 1) >= 0 && *time >= 0;
+    } else if (!strcmp(name, "segments")) {
+        options->segments = atoi(value);
+        valid = options->segments >= 0;
+    } else if (!strcmp(name, "threads")) {
+        options->nb_threads = atoi(value);
+        valid = options->nb_threads >= 1;
+    } else if (!strcmp(name, "pipeline-depth")) {
+        options->pipeline_depth = atoi(value);
+        valid = options->pipeline_depth >= 1;
+    } else if (!strcmp(name, "block-size")) {
+        options->block_size = atoi(value);
+        valid = options->block_size >= MIN_BLOCK_SIZE && options->block_size <= MAX_BLOCK_SIZE;
+    } else if (!strcmp(name, "submix-size")) {
+        options->submix_size = atoi(value);
+        valid = options->submix_size >= 0;
+    } else if (!strcmp(name, "layout")) {
+        options->channel_layout = strcmp(value, "auto") ? av_get_channel_layout(value) : 0;
+        valid = !strcmp(value, "auto") || options->channel_layout;
+    } else if (!strcmp(name, "input-lead")) {
+        options->input_lead = atoi(value);
+        valid = options->input_lead >= 0;
+    } else if (!strcmp(name, "engine")) {
+        options->use_native_engine = !strcmp(value, "native");
+        valid = options->use_native_engine || !strcmp(value, "amix");
+    } else if (!strcmp(name, "overflow")) {
+        options->overflow = strcmp(value, "clip") ? MIX_OVERFLOW_SATURATE : MIX_OVERFLOW_CLIP;
+        valid = options->overflow == MIX_OVERFLOW_CLIP || !strcmp(value, "saturate");
+    } else if (!strcmp(name, "probe-cache")) {
+        valid = av_strlcpy(options->probe_cache, value, sizeof(options->probe_cache)) < sizeof(options->probe_cache);
+    } else if (!strcmp(name, "pcm-cache")) {
+        valid = av_strlcpy(options->pcm_cache, value, sizeof(options->pcm_cache)) < sizeof(options->pcm_cache);
+    } else if (!strcmp(name, "memory-budget")) {
+        options->memory_budget = atoi(value);
+        valid = options->memory_budget >= 0;
+    } else if (!strcmp(name, "pcm-cache-size")) {
+        options->pcm_cache_size = atoi(value);
+        valid = options->pcm_cache_size >= 1;
+    } else if (!strcmp(name, "read-ahead")) {
+        options->read_ahead = atoi(value);
+        valid = options->read_ahead >= 0 && options->read_ahead <= MAX_READ_AHEAD;
+    } else if (!strcmp(name, "read-ahead-depth")) {
+        options->read_ahead_depth = atoi(value);
+        valid = options->read_ahead_depth >= 1;
+    } else if (!strcmp(name, "decoder-threads")) {
+        options->decoder_threads = atoi(value);
+        valid = options->decoder_threads >= 0;
+    } else {
+        av_log(NULL, AV_LOG_ERROR, "Unknown option '%s'\n", name);
+        return AVERROR_OPTION_NOT_FOUND;
+    }
+
+    if (!valid) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid value '%s' for option '%s'\n", value, name);
+        return AVERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+int mixer_open(MixerContext **ctx, const char *output, const MixerOptions *options)
+{
+    int error;
+
+    if (!(*ctx = av_mallocz(sizeof(**ctx))))
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&(*ctx)->frame_pool.lock, NULL);
+
+    if ((error = mixer_reopen(*ctx, output, options)) < 0)
+        mixer_close(ctx);
+
+    return error;
+}
+
+int mixer_reopen(MixerContext *ctx, const char *output, const MixerOptions *options)
+{
+    clear_mix(ctx);
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+
+    ctx->options = *options;
+    if (!(ctx->output = av_strdup(output)))
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+int mixer_add_input(MixerContext *ctx, const char *filename, float weight)
+{
+    RoutingMatrix *matrices;
+    float *weights;
+    char *input;
+
+    weights = av_realloc_array(ctx->input_weights, ctx->nb_inputs + 1, sizeof(*weights));
+    if (!weights)
+        return AVERROR(ENOMEM);
+    ctx->input_weights = weights;
+
+    matrices = av_realloc_array(ctx->input_matrices, ctx->nb_inputs + 1, sizeof(*matrices));
+    if (!matrices)
+        return AVERROR(ENOMEM);
+    ctx->input_matrices = matrices;
+    memset(&matrices[ctx->nb_inputs], 0, sizeof(*matrices));
+
+    if (!(input = av_strdup(filename)))
+        return AVERROR(ENOMEM);
+    if (av_dynarray_add_nofree(&ctx->input_filenames, &ctx->nb_inputs, input) < 0) {
+        av_free(input);
+        return AVERROR(ENOMEM);
+    }
+    ctx->input_weights[ctx->nb_inputs - 1] = weight;
+
+    return 0;
+}
+
+int mixer_set_input_matrix(MixerContext *ctx, int i, const double *matrix, int nb_out, int nb_in)
+{
+    RoutingMatrix *m;
+
+    if (i < 0 || i >= ctx->nb_inputs || nb_out <= 0 || nb_in <= 0) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid routing matrix for input %d\n", i);
+        return AVERROR(EINVAL);
+    }
+
+    m = &ctx->input_matrices[i];
+    av_freep(&m->coeffs);
+    if (!(m->coeffs = av_malloc_array(nb_out * nb_in, sizeof(*m->coeffs))))
+        return AVERROR(ENOMEM);
+    memcpy(m->coeffs, matrix, nb_out * nb_in * sizeof(*m->coeffs));
+    m->nb_rows = nb_out;
+    m->nb_cols = nb_in;
+
+    return 0;
+}
+
+int mixer_add_clip(MixerContext *ctx, const char *filename, int64_t offset, float gain,
+                   int64_t in, int64_t out)
+{
+    TimelineClip *clips;
+
+    if (offset < 0 || in < 0 || (out && out <= in)) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid placement of clip '%s'\n", filename);
+        return AVERROR(EINVAL);
+    }
+
+    clips = av_realloc_array(ctx->clips, ctx->nb_clips + 1, sizeof(*clips));
+    if (!clips)
+        return AVERROR(ENOMEM);
+    ctx->clips = clips;
+
+    clips[ctx->nb_clips] = (TimelineClip) {
+        .filename = av_strdup(filename),
+        .offset   = offset,
+        .in       = in,
+        .out      = out,
+        .gain     = gain,
+    };
+    if (!clips[ctx->nb_clips].filename)
+        return AVERROR(ENOMEM);
+    ctx->nb_clips++;
+
+    return 0;
+}
+
+int mixer_add_output(MixerContext *ctx, const char *filename, const char *codec, int64_t bit_rate)
+{
+    MixerOutput *outputs;
+    MixerOutput *output;
+
+    if (bit_rate < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid bit rate for '%s'\n", filename);
+        return AVERROR(EINVAL);
+    }
+
+    outputs = av_realloc_array(ctx->outputs, ctx->nb_outputs + 1, sizeof(*outputs));
+    if (!outputs)
+        return AVERROR(ENOMEM);
+    ctx->outputs = outputs;
+
+    output = &outputs[ctx->nb_outputs];
+    *output = (MixerOutput) {
+        .filename   = av_strdup(filename),
+        .codec_name = codec ? av_strdup(codec) : NULL,
+        .bit_rate   = bit_rate,
+    };
+    if (!output->filename || (codec && !output->codec_name)) {
+        av_freep(&output->filename);
+        av_freep(&output->codec_name);
+        return AVERROR(ENOMEM);
+    }
+    ctx->nb_outputs++;
+
+    return 0;
+}
+
+void mixer_set_cache(MixerContext *ctx, MixerCache *cache)
+{
+    ctx->cache = cache;
+}
+
+void mixer_get_stats(const MixerContext *ctx, MixerStats *stats)
+{
+    *stats = ctx->stats;
+}
+
+void mixer_close(MixerContext **ctx)
+{
+    if (!*ctx)
+        return;
+
+    close_mix_files(*ctx);
+    clear_mix(*ctx);
+    telemetry_uninit(&(*ctx)->telemetry);
+    frame_pool_uninit(&(*ctx)->frame_pool);
+    pthread_mutex_destroy(&(*ctx)->frame_pool.lock);
+    av_buffer_pool_uninit(&(*ctx)->packet_buffer_pool.pool);
+    av_freep(ctx);
+}
+
+static void free_segments(MixSegment *segments, int nb_segments)
+{
+    for (int i = 0 ; i < nb_segments ; i++) {
+        mixer_close(&segments[i].ctx);
+        if (segments[i].spill)
+            fclose(segments[i].spill);
+        av_freep(&segments[i].input_start);
+        av_freep(&segments[i].input_pos);
+    }
+    av_free(segments);
+}
+
+/**
+ * Split the window of the mix (options.start and options.duration) into up
+ * to options.segments segments of at least MIN_SEGMENT_SECONDS, on frame
+ * boundaries of the encoder. A window too short to split, or over inputs
+ * of unknown length, is one segment. Sets *nb_segments to 0 when the whole
+ * mix is better done in one go.
+ */
+static int plan_segments(MixerContext *ctx, MixSegment **segments, int *nb_segments)
+{
+    const MixerOptions *options = &ctx->options;
+    AVCodecContext *output_codec_context = ctx->output_codec_context;
+    int sample_rate = output_codec_context->sample_rate;
+    int frame_size = output_codec_context->frame_size;
+    int64_t origin = av_rescale(options->start, sample_rate, AV_TIME_BASE);
+    int64_t window = av_rescale(options->duration, sample_rate, AV_TIME_BASE);
+    int windowed = options->start || options->duration;
+    int64_t length, warmup = 0;
+    int nb = 1;
+
+    *segments    = NULL;
+    *nb_segments = 0;
+
+    if (!windowed && options->segments < 2)
+        return 0;
+
+    if ((length = inputs_length(ctx)) < 0 && options->segments > 1)
+        av_log(NULL, AV_LOG_WARNING, "The length of an input is unknown; mixing in one segment\n");
+
+    if (length >= 0) {
+        if (origin >= length) {
+            av_log(NULL, AV_LOG_ERROR, "The mix starts at %.3f s, after the end of its inputs (%.3f s)\n",
+                   (double)origin / sample_rate, (double)length / sample_rate);
+            return AVERROR(EINVAL);
+        }
+        length -= origin;
+    }
+    if (window && (length < 0 || window < length))
+        length = window;
+
+    if (options->segments > 1 && length >= 0)
+        nb = FFMIN(options->segments, length / ((int64_t)MIN_SEGMENT_SECONDS * sample_rate));
+    if (nb < 2) {
+        if (!windowed)
+            return 0;
+        nb = 1;
+    }
+
+    // Lossy encoders get a few frames of real signal on both sides of a
+    // segment, so that its first and last kept packets match a single encode.
+    if (frame_size)
+        warmup = FFALIGN(output_codec_context->initial_padding + 2 * frame_size, frame_size);
+
+    if (!(*segments = av_calloc(nb, sizeof(**segments))))
+        return AVERROR(ENOMEM);
+    *nb_segments = nb;
+
+    for (int i = 0 ; i < nb ; i++) {
+        MixSegment *segment = &(*segments)[i];
+        int64_t start = length * i / nb;
+
+        // Segment boundaries fall on encoder frames, so that packets do not straddle them.
+        if (frame_size)
+            start -= start % frame_size;
+
+        segment->index    = i;
+        segment->origin   = origin;
+        segment->start    = start;
+        segment->preroll  = FFMIN(warmup, start);
+        segment->postroll = i < nb - 1 ? warmup : 0;
+        segment->next_pos = start - segment->preroll;
+        if (i)
+            (*segments)[i - 1].end = start;
+        segment->end = window ? length : INT64_MAX;
+
+        segment->input_start = av_calloc(ctx->nb_inputs, sizeof(*segment->input_start));
+        segment->input_pos   = av_calloc(ctx->nb_inputs, sizeof(*segment->input_pos));
+        if (!segment->input_start || !segment->input_pos)
+            return AVERROR(ENOMEM);
+    }
+
+    if (length < 0)
+        av_log(NULL, AV_LOG_INFO, "Mixing from %.3f s to the end\n", (double)origin / sample_rate);
+    else if (windowed)
+        av_log(NULL, AV_LOG_INFO, "Mixing %.3f s from %.3f s\n",
+               (double)length / sample_rate, (double)origin / sample_rate);
+    if (nb > 1)
+        av_log(NULL, AV_LOG_INFO, "Mixing %.1f s in %d segments\n", (double)length / sample_rate, nb);
+
+    return 0;
+}
+
+static void *segment_thread(void *arg)
+{
+    MixSegment *segment = arg;
+
+    if ((segment->error = mixer_run(segment->ctx)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Segment %d failed (error '%s')\n",
+               segment->index, av_err2str(segment->error));
+        atomic_store(segment->aborted, 1);
+    }
+
+    return NULL;
+}
+
+// Mux the packets a segment spilled into the output, rescaled from the time base of its encoder.
+static int mux_segment(MixerContext *ctx, MixSegment *segment)
+{
+    AVStream *stream = ctx->output_format_context->streams[0];
+    AVRational time_base = { 1, ctx->output_codec_context->sample_rate };
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_ENCODER];
+    AVPacket *packet = ctx->output_packet;
+    SpilledPacket header;
+    TelemetrySpan span;
+    int error;
+
+    rewind(segment->spill);
+    while (fread(&header, sizeof(header), 1, segment->spill) == 1) {
+        if ((error = av_new_packet(packet, header.size)) < 0)
+            return error;
+        if (fread(packet->data, 1, header.size, segment->spill) != header.size) {
+            av_packet_unref(packet);
+            av_log(NULL, AV_LOG_ERROR, "Could not read back segment %d\n", segment->index);
+            return AVERROR(EIO);
+        }
+        packet->pts      = header.pts;
+        packet->dts      = header.dts;
+        packet->duration = header.duration;
+        packet->flags    = header.flags;
+        av_packet_rescale_ts(packet, time_base, stream->time_base);
+
+        telemetry_span_start(track, &span);
+        error = av_write_frame(ctx->output_format_context, packet);
+        telemetry_span_end(track, STAGE_MUX, &span);
+        av_packet_unref(packet);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not write frame (error '%s')\n", av_err2str(error));
+            return error;
+        }
+    }
+
+    return ferror(segment->spill) ? AVERROR(EIO) : 0;
+}
+
+/**
+ * Mix every segment on a thread of its own with a context of its own, and
+ * mux each one into the output as soon as it and all the ones before it
+ * are done.
+ */
+static int run_segments(MixerContext *ctx, MixSegment *segments, int nb_segments)
+{
+    MixerOptions options = ctx->options;
+    atomic_int aborted;
+    int error;
+
+    atomic_init(&aborted, 0);
+
+    // Every segment already has a core of its own.
+    options.segments   = 0;
+    options.nb_threads = 1;
+    options.trace      = 0;
+    // The segments run at once, so they share the budget of the job.
+    if (options.memory_budget)
+        options.memory_budget = FFMAX(options.memory_budget / nb_segments, 1);
+
+    for (int i = 0 ; i < nb_segments ; i++) {
+        MixSegment *segment = &segments[i];
+
+        segment->aborted = &aborted;
+        if (!(segment->spill = tmpfile())) {
+            error = AVERROR(errno);
+            av_log(NULL, AV_LOG_ERROR, "Could not create the spill file of segment %d\n", i);
+            goto end;
+        }
+        if ((error = mixer_open(&segment->ctx, ctx->output, &options)) < 0)
+            goto end;
+        for (int j = 0 ; j < ctx->nb_inputs ; j++) {
+            const RoutingMatrix *matrix = &ctx->input_matrices[j];
+
+            if ((error = mixer_add_input(segment->ctx, ctx->input_filenames[j], ctx->input_weights[j])) < 0 ||
+                (matrix->coeffs &&
+                 (error = mixer_set_input_matrix(segment->ctx, j, matrix->coeffs,
+                                                 matrix->nb_rows, matrix->nb_cols)) < 0))
+                goto end;
+        }
+        segment->ctx->segment = segment;
+        mixer_set_cache(segment->ctx, ctx->cache);
+    }
+
+    if ((error = write_output_file_header(ctx->output_format_context)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while writing header outputfile\n");
+        goto end;
+    }
+
+    for (int i = 0 ; i < nb_segments ; i++) {
+        if ((error = pthread_create(&segments[i].thread, NULL, segment_thread, &segments[i]))) {
+            av_log(NULL, AV_LOG_ERROR, "Could not start segment %d\n", i);
+            error = AVERROR(error);
+            atomic_store(&aborted, 1);
+            goto end;
+        }
+        segments[i].started = 1;
+    }
+
+    end:
+        for (int i = 0 ; i < nb_segments ; i++) {
+            MixSegment *segment = &segments[i];
+
+            if (!segment->started)
+                continue;
+            pthread_join(segment->thread, NULL);
+            segment->started = 0;
+            if (error >= 0 && (error = segment->error) >= 0 &&
+                (error = mux_segment(ctx, segment)) >= 0) {
+                ctx->stats.nb_samples += segment->nb_samples;
+                ctx->stats.peak_queued_samples += segment->ctx->stats.peak_queued_samples;
+                ctx->stats.peak_queued_bytes   += segment->ctx->stats.peak_queued_bytes;
+                ctx->engine_name = segment->ctx->engine_name;
+                telemetry_merge(&ctx->telemetry, &segment->ctx->telemetry);
+            }
+            if (error < 0)
+                atomic_store(&aborted, 1);
+        }
+        ctx->stats.duration = (double)ctx->stats.nb_samples / ctx->output_codec_context->sample_rate;
+
+        if (error >= 0 && (error = write_output_file_trailer(ctx->output_format_context)) < 0)
+            av_log(NULL, AV_LOG_ERROR, "Error while writing trailer outputfile\n");
+
+    return error;
+}
+
+static void close_clip(TimelineClip *clip, TelemetryTrack *track)
+{
+    close_input_file(&clip->format_context, track);
+    avcodec_free_context(&clip->codec_context);
+    av_packet_free(&clip->packet);
+    swr_free(&clip->resampler);
+    if (clip->fifo)
+        av_audio_fifo_free(clip->fifo);
+    clip->fifo = NULL;
+}
+
+// Open a clip to play it from output sample from on, seeking into it when it is already running.
+static int open_clip(MixerContext *ctx, TimelineClip *clip, int64_t from)
+{
+    AVCodecContext *output_codec_context = ctx->output_codec_context;
+    AVCodecContext *codec_context;
+    int error;
+
+    if ((error = open_input_file(clip->filename, &ctx->options, &clip->format_context, &clip->codec_context)) < 0)
+        return error;
+    codec_context = clip->codec_context;
+    if (!codec_context->channel_layout)
+        codec_context->channel_layout = av_get_default_channel_layout(codec_context->channels);
+
+    clip->resampler = swr_alloc_set_opts(NULL, output_codec_context->channel_layout, AV_SAMPLE_FMT_FLTP,
+                                         output_codec_context->sample_rate,
+                                         codec_context->channel_layout, codec_context->sample_fmt,
+                                         codec_context->sample_rate, 0, NULL);
+    clip->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, output_codec_context->channels, ctx->frame_size);
+    atomic_fetch_add(&alloc_stats.packets, 1);
+    clip->packet = av_packet_alloc();
+    if (!clip->resampler || !clip->fifo || !clip->packet)
+        return AVERROR(ENOMEM);
+    if ((error = swr_init(clip->resampler)) < 0)
+        return error;
+
+    clip->first    = av_rescale(clip->in, codec_context->sample_rate, AV_TIME_BASE) +
+                     av_rescale(from - clip->start, codec_context->sample_rate, output_codec_context->sample_rate);
+    clip->pos      = AV_NOPTS_VALUE;
+    clip->finished = 0;
+
+    return seek_decoded_input(clip->format_context, codec_context, clip->filename, clip->first);
+}
+
+// Convert nb_samples decoded samples of a clip into its FIFO; NULL drains the resampler.
+static int resample_clip(TimelineClip *clip, SampleBuffer *buffer, const uint8_t **samples, int nb_samples)
+{
+    int nb_out = swr_get_out_samples(clip->resampler, nb_samples);
+    int error;
+
+    if ((error = sample_buffer_reserve(buffer, nb_out)) < 0)
+        return error;
+    if ((nb_out = swr_convert(clip->resampler, buffer->samples, nb_out, samples, nb_samples)) < 0)
+        return nb_out;
+    if (nb_out > 0 && av_audio_fifo_write(clip->fifo, (void **)buffer->samples, nb_out) < nb_out)
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+// Decode a clip until its FIFO holds nb_samples samples or the clip is over.
+static int fill_clip(MixerContext *ctx, TimelineClip *clip, SampleBuffer *buffer, int nb_samples)
+{
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_INPUT];
+    AVFrame *frames[MAX_DECODED_FRAMES];
+    int nb_frames = 0;
+    int error;
+
+    while (!clip->finished && av_audio_fifo_size(clip->fifo) < nb_samples) {
+        if ((error = decode_audio_frames(&ctx->frame_pool, track, frames, MAX_DECODED_FRAMES, &nb_frames,
+                                         clip->packet, clip->format_context, clip->codec_context,
+                                         &clip->finished)) < 0)
+            return error;
+        trim_decoded_frames(&ctx->frame_pool, clip->format_context->streams[0], clip->codec_context->sample_rate,
+                            clip->filename, clip->first, &clip->pos, frames, &nb_frames);
+
+        for (int i = 0 ; i < nb_frames ; i++) {
+            track->nb_frames++;
+            track->nb_samples += frames[i]->nb_samples;
+            if (error >= 0)
+                error = resample_clip(clip, buffer, (const uint8_t **)frames[i]->extended_data,
+                                      frames[i]->nb_samples);
+            frame_pool_put(&ctx->frame_pool, &frames[i]);
+        }
+        if (error >= 0 && clip->finished)
+            error = resample_clip(clip, buffer, NULL, 0);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not convert the samples of '%s'\n", clip->filename);
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+static int compare_clips(const void *a, const void *b)
+{
+    const TimelineClip *clip_a = *(const TimelineClip * const *)a;
+    const TimelineClip *clip_b = *(const TimelineClip * const *)b;
+
+    // Clips starting together keep the order they were added in.
+    if (clip_a->start != clip_b->start)
+        return clip_a->start < clip_b->start ? -1 : 1;
+    return clip_a < clip_b ? -1 : clip_a > clip_b;
+}
+
+/**
+ * Timeline engine: mix the clips block by block with the native engine.
+ * A clip is opened when the block it starts in comes up (sought into when
+ * the window starts in the middle of it), decoded as far as the blocks it
+ * overlaps need, and closed as soon as it is over; the blocks where no clip
+ * plays are silence that is never decoded. The clips are converted to the
+ * output rate and layout, and added with their gain, without normalizing
+ * the sum like amix does.
+ */
+static int process_timeline(MixerContext *ctx)
+{
+    MixEngine *engine = &ctx->engine;
+    AVCodecContext *output_codec_context = ctx->output_codec_context;
+    TelemetryTrack *track = &ctx->telemetry.tracks[TRACK_MIX];
+    int sample_rate = output_codec_context->sample_rate;
+    int64_t origin = av_rescale(ctx->options.start, sample_rate, AV_TIME_BASE);
+    int64_t stop = ctx->options.duration ?
+                   origin + av_rescale(ctx->options.duration, sample_rate, AV_TIME_BASE) : INT64_MAX;
+    int64_t pos = origin;
+    int64_t start_time = av_gettime_relative();
+    // The output of the resamplers of the clips, then the part of their FIFOs added to a block.
+    SampleBuffer buffer = { .channels = output_codec_context->channels, .sample_fmt = AV_SAMPLE_FMT_FLTP };
+    TelemetrySpan span;
+    AVFrame *out_frame = NULL;
+    AVBufferPool *out_pool = NULL;
+    int data_present = 0;
+    int nb_active = 0, next = 0;
+    int error = 0;
+
+    TimelineClip **clips = av_calloc(ctx->nb_clips, sizeof(*clips));
+    TimelineClip **active = av_calloc(ctx->nb_clips, sizeof(*active));
+    if (!clips || !active || (error = sample_buffer_reserve(&buffer, ctx->frame_size)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate the timeline\n");
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    for (int i = 0 ; i < ctx->nb_clips ; i++) {
+        TimelineClip *clip = &ctx->clips[i];
+
+        clip->start = av_rescale(clip->offset, sample_rate, AV_TIME_BASE);
+        clip->end   = clip->out ? clip->start + av_rescale(clip->out - clip->in, sample_rate, AV_TIME_BASE)
+                                : INT64_MAX;
+        clips[i] = clip;
+    }
+    qsort(clips, ctx->nb_clips, sizeof(*clips), compare_clips);
+
+    out_pool = av_buffer_pool_init(av_samples_get_buffer_size(NULL, output_codec_context->channels,
+                                                              ctx->frame_size, engine->out_fmt, 0),
+                                   counted_buffer_alloc);
+    if (!out_pool) {
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    while (pos < stop) {
+        int nb_samples = FFMIN(ctx->frame_size, stop - pos);
+
+        // Open the clips starting in this block, skipping the ones over before the window.
+        while (next < ctx->nb_clips && clips[next]->start < pos + nb_samples) {
+            TimelineClip *clip = clips[next++];
+
+            if (clip->end <= pos)
+                continue;
+            active[nb_active++] = clip;
+            ctx->max_open_clips = FFMAX(ctx->max_open_clips, nb_active);
+            if ((error = open_clip(ctx, clip, FFMAX(clip->start, pos))) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Could not open clip '%s'\n", clip->filename);
+                goto end;
+            }
+        }
+        // A timeline without out points ends with its last clip.
+        if (!nb_active && next == ctx->nb_clips)
+            break;
+
+        for (int i = 0 ; i < nb_active ; i++) {
+            TimelineClip *clip = active[i];
+            int64_t from = FFMAX(clip->start, pos);
+
+            if ((error = fill_clip(ctx, clip, &buffer, FFMIN(pos + nb_samples, clip->end) - from)) < 0)
+                goto end;
+        }
+
+        telemetry_span_start(track, &span);
+        if ((error = mix_engine_begin(engine, nb_samples)) < 0)
+            goto end;
+        for (int i = 0 ; i < nb_active ; i++) {
+            TimelineClip *clip = active[i];
+            int64_t from = FFMAX(clip->start, pos);
+            int n = av_audio_fifo_read(clip->fifo, (void **)buffer.samples,
+                                       FFMIN(pos + nb_samples, clip->end) - from);
+
+            if (n > 0)
+                mix_engine_add(engine, (const uint8_t * const *)buffer.samples, n, from - pos, clip->gain);
+            if (clip->finished && !av_audio_fifo_size(clip->fifo))
+                clip->end = FFMIN(clip->end, from + FFMAX(n, 0));
+        }
+
+        if (!(out_frame = frame_pool_get(&ctx->frame_pool))) {
+            error = AVERROR(ENOMEM);
+            goto end;
+        }
+        out_frame->format         = engine->out_fmt;
+        out_frame->channel_layout = output_codec_context->channel_layout;
+        out_frame->channels       = output_codec_context->channels;
+        out_frame->sample_rate    = sample_rate;
+        out_frame->nb_samples     = nb_samples;
+        if ((error = frame_get_pooled_buffer(out_frame, out_pool)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not allocate the output samples\n");
+            goto end;
+        }
+        mix_engine_end(engine, out_frame->extended_data);
+        telemetry_span_end(track, STAGE_MIX, &span);
+        out_frame->pts = pos - origin;
+        pos += nb_samples;
+
+        // Close the clips that are over, so that only the ones still playing hold files and decoders.
+        for (int i = 0 ; i < nb_active ; ) {
+            if (active[i]->end <= pos) {
+                close_clip(active[i], &ctx->telemetry.tracks[TRACK_INPUT]);
+                active[i] = active[--nb_active];
+            } else {
+                i++;
+            }
+        }
+
+        error = write_output_frame(ctx, out_frame, &data_present);
+        frame_pool_put(&ctx->frame_pool, &out_frame);
+        alloc_stats_report(ctx->options.debug_alloc, 0);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Tracing error at encode_audio_frame() - (error '%s')\n",
+                   get_error_text(error));
+            goto end;
+        }
+    }
+
+    if ((error = finish_output(ctx)) < 0)
+        goto end;
+
+    report_throughput(ctx, "timeline", pos - origin, start_time);
+    alloc_stats_report(ctx->options.debug_alloc, 1);
+
+    end:
+        for (int i = 0 ; i < nb_active ; i++)
+            close_clip(active[i], &ctx->telemetry.tracks[TRACK_INPUT]);
+        frame_pool_put(&ctx->frame_pool, &out_frame);
+        av_buffer_pool_uninit(&out_pool);
+        sample_buffer_free(&buffer);
+        av_freep(&clips);
+        av_freep(&active);
+
+        if (error < 0)
+            av_log(NULL, AV_LOG_ERROR, "Error occurred: %s\n", av_err2str(error));
+
+    return error;
+}
+
+/**
+ * Mix the clips of ctx. The output takes the sample rate and bit rate of
+ * the first clip added, as a mix of inputs takes those of its first input.
+ */
+static int run_timeline(MixerContext *ctx)
+{
+    const MixerOptions *options = &ctx->options;
+    AVFormatContext *first_format_context = NULL;
+    AVCodecContext *first_codec_context = NULL;
+    TelemetrySpan open_span;
+    int error;
+
+    if (ctx->nb_inputs) {
+        av_log(NULL, AV_LOG_ERROR, "A mix takes either inputs or clips, not both\n");
+        return AVERROR(EINVAL);
+    }
+    if (options->segments > 1 || options->nb_threads > 1)
+        av_log(NULL, AV_LOG_WARNING, "A timeline is mixed in one segment on one thread\n");
+
+    if ((error = telemetry_init(&ctx->telemetry, 1, options->telemetry, options->trace)) < 0)
+        return error;
+    snprintf(ctx->telemetry.tracks[TRACK_INPUT].name, sizeof(ctx->telemetry.tracks[TRACK_INPUT].name), "clips");
+    telemetry_span_start(&ctx->telemetry.tracks[TRACK_MIX], &open_span);
+
+    remove(ctx->output);
+    av_log(NULL, AV_LOG_INFO, "Output file : %s\n", ctx->output);
+
+    if ((error = open_input_file(ctx->clips[0].filename, options, &first_format_context, &first_codec_context)) >= 0)
+        error = open_output_file(ctx->output, NULL, first_codec_context->bit_rate, &first_codec_context, 1,
+                                 options->channel_layout, ctx->cache,
+                                 &ctx->output_format_context, &ctx->output_codec_context);
+    close_input_file(&first_format_context, NULL);
+    avcodec_free_context(&first_codec_context);
+    if (error < 0)
+        goto end;
+
+    if ((error = init_output_packet(ctx)) < 0)
+        goto end;
+    ctx->frame_size = output_frame_size(ctx->output_codec_context, options->block_size);
+    if ((error = mix_engine_init(&ctx->engine, AV_SAMPLE_FMT_FLTP, ctx->output_codec_context->sample_fmt,
+                                 ctx->output_codec_context->channels, options->overflow)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not initialize the native engine\n");
+        goto end;
+    }
+
+    if ((error = write_output_file_header(ctx->output_format_context)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while writing header outputfile\n");
+        goto end;
+    }
+    if ((error = start_outputs(ctx)) < 0)
+        goto end;
+    telemetry_span_end(&ctx->telemetry.tracks[TRACK_MIX], STAGE_OPEN, &open_span);
+
+    if ((error = process_timeline(ctx)) >= 0 &&
+        (error = write_output_file_trailer(ctx->output_format_context)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Error while writing trailer outputfile\n");
+
+    end:
+        error = close_outputs(ctx, error);
+        close_mix_files(ctx);
+        telemetry_finish(&ctx->telemetry);
+        ctx->stats.peak_rss = peak_rss();
+
+    return error;
+}
+
+int mixer_run(MixerContext *ctx)
+{
+    const MixerOptions *options = &ctx->options;
+    Pipeline pipeline = { 0 };
+    MixSegment *window = NULL;
+    TelemetrySpan open_span;
+    int nb_inputs = ctx->nb_inputs;
+    int use_native_engine = options->use_native_engine;
+    int error;
+
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->engine_name = NULL;
+    ctx->max_open_clips = 0;
+    ctx->pcm_cache_hits = ctx->pcm_cache_misses = 0;
+    ctx->pcm_cache_bytes = 0;
+
+    if (ctx->nb_clips)
+        return run_timeline(ctx);
+
+    if (!nb_inputs) {
+        av_log(NULL, AV_LOG_ERROR, "Nothing to mix into '%s'\n", ctx->output);
+        return AVERROR(EINVAL);
+    }
+    // Segments spill the packets of one encoder; the other outputs would need theirs.
+    if (ctx->nb_outputs && options->segments > 1) {
+        av_log(NULL, AV_LOG_WARNING, "A mix with several outputs is mixed in one segment\n");
+        ctx->options.segments = 0;
+    }
+
+    if ((error = telemetry_init(&ctx->telemetry, nb_inputs, options->telemetry, options->trace)) < 0)
+        return error;
+    telemetry_span_start(&ctx->telemetry.tracks[TRACK_MIX], &open_span);
+
+    ctx->input_format_contexts = av_calloc(nb_inputs, sizeof(*ctx->input_format_contexts));
+    ctx->input_codec_contexts = av_calloc(nb_inputs, sizeof(*ctx->input_codec_contexts));
+    ctx->input_packets = av_calloc(nb_inputs, sizeof(*ctx->input_packets));
+    ctx->mapped_inputs = av_calloc(nb_inputs, sizeof(*ctx->mapped_inputs));
+    if (!ctx->input_format_contexts || !ctx->input_codec_contexts ||
+        !ctx->input_packets || !ctx->mapped_inputs) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate the input contexts\n");
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+    
+    // Every frame in flight is either queued between two stages or held by
+    // one of them, so this is enough for the pool to never run dry.
+    if ((error = frame_pool_reserve(&ctx->frame_pool, (nb_inputs + ctx->nb_outputs + 2) *
+                                                      (options->pipeline_depth + 2))) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate the frame pool\n");
+        goto end;
+    }
+    
+    for (int i = 0 ; i < nb_inputs ; i++) {
+        const char *filename = ctx->input_filenames[i];
+        
+        // PCM WAV inputs are mapped, and so are the others found in the PCM
+        // cache; everything else goes through libavformat.
+        if ((!options->use_mmap ||
+             open_mapped_input(filename, &ctx->mapped_inputs[i], &ctx->input_codec_contexts[i]) < 0) &&
+            (!options->pcm_cache[0] || open_cached_input(ctx, i) < 0) &&
+            (error = open_input_file(filename, options, &ctx->input_format_contexts[i],
+                                     &ctx->input_codec_contexts[i])) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error while opening file %d\n", i + 1);
+            goto end;
+        }
+        atomic_fetch_add(&alloc_stats.packets, 1);
+        if (!(ctx->input_packets[i] = av_packet_alloc())) {
+            av_log(NULL, AV_LOG_ERROR, "Could not allocate the packet of input %d\n", i + 1);
+            error = AVERROR(ENOMEM);
+            goto end;
+        }
+    }
+    
+    if (ctx->segment) {
+        // The parent writes the output file; a segment only needs an encoder.
+        const AVOutputFormat *oformat = av_guess_format(NULL, ctx->output, NULL);
+        
+        if (!oformat) {
+            error = AVERROR_MUXER_NOT_FOUND;
+            goto end;
+        }
+        if ((error = open_output_encoder(oformat, NULL, ctx->input_codec_contexts[0]->bit_rate,
+                                         ctx->input_codec_contexts, nb_inputs, options->channel_layout,
+                                         ctx->cache, &ctx->output_codec_context)) < 0)
+            goto end;
+    } else {
+        remove(ctx->output);
+        
+        av_log(NULL, AV_LOG_INFO, "Output file : %s\n", ctx->output);
+        
+        if ((error = open_output_file(ctx->output, NULL, ctx->input_codec_contexts[0]->bit_rate,
+                                      ctx->input_codec_contexts, nb_inputs, options->channel_layout,
+                                      ctx->cache, &ctx->output_format_context, &ctx->output_codec_context)) < 0)
+            goto end;
+    }
+    
+    if ((error = init_output_packet(ctx)) < 0)
+        goto end;
+    ctx->frame_size = output_frame_size(ctx->output_codec_context, options->block_size);
+    
+    // Checked before splitting the mix, so that its segments take the same inputs as a whole mix.
+    if (use_native_engine && !native_engine_usable(ctx)) {
+        av_log(NULL, AV_LOG_WARNING, "The native engine needs inputs with the same sample format, "
+               "and the sample rate of the output; falling back to amix\n");
+        use_native_engine = 0;
+    }
+
+    for (int i = 0 ; i < nb_inputs && !use_native_engine ; i++) {
+        if (ctx->input_matrices[i].coeffs) {
+            av_log(NULL, AV_LOG_ERROR, "Input %d has a routing matrix, which only the native engine applies\n", i);
+            error = AVERROR(EINVAL);
+            goto end;
+        }
+    }
+    
+    if (!ctx->segment) {
+        MixSegment *segments = NULL;
+        int nb_segments = 0;
+        
+        mixer_io_preallocate(ctx->output_format_context->pb,
+                             expected_output_size(ctx->output_codec_context, mix_length(ctx),
+                                                  ctx->output_codec_context->sample_rate));
+        error = plan_segments(ctx, &segments, &nb_segments);
+        if (error >= 0 && nb_segments > 1) {
+            telemetry_span_end(&ctx->telemetry.tracks[TRACK_MIX], STAGE_OPEN, &open_span);
+            error = run_segments(ctx, segments, nb_segments);
+        }
+        if (error < 0 || nb_segments > 1) {
+            free_segments(segments, nb_segments);
+            goto end;
+        }
+        // A window that is not split is mixed right here.
+        ctx->segment = window = segments;
+    }
+    
+    if (ctx->segment) {
+        ctx->segment->delay = ctx->output_codec_context->initial_padding;
+        for (int i = 0 ; i < nb_inputs ; i++) {
+            if ((error = seek_segment_input(ctx, i)) < 0)
+                goto end;
+        }
+    }
+    
+    if (use_native_engine) {
+        error = mix_engine_init(&ctx->engine, ctx->input_codec_contexts[0]->sample_fmt,
+                                ctx->output_codec_context->sample_fmt, ctx->output_codec_context->channels,
+                                options->overflow);
+        if (error < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Could not initialize the native engine\n");
+            goto end;
+        }
+        av_log(NULL, AV_LOG_INFO, "Native engine: %s kernels, %s -> %s\n", ctx->engine.isa,
+               av_get_sample_fmt_name(ctx->engine.in_fmt), av_get_sample_fmt_name(ctx->engine.out_fmt));
+    } else {
+        GraphKey *key = av_mallocz(graph_key_size(nb_inputs));
+        void *graph = NULL;
+        
+        if (!key) {
+            error = AVERROR(ENOMEM);
+            goto end;
+        }
+        key->nb_inputs          = nb_inputs;
+        key->out_sample_fmt     = ctx->output_codec_context->sample_fmt;
+        key->out_sample_rate    = ctx->output_codec_context->sample_rate;
+        key->out_channel_layout = ctx->output_codec_context->channel_layout;
+        for (int i = 0 ; i < nb_inputs ; i++) {
+            AVCodecContext *input_codec_context = ctx->input_codec_contexts[i];
+            
+            if (!input_codec_context->channel_layout)
+                input_codec_context->channel_layout = av_get_default_channel_layout(input_codec_context->channels);
+            key->inputs[i].sample_rate    = input_codec_context->sample_rate;
+            key->inputs[i].sample_fmt     = input_codec_context->sample_fmt;
+            key->inputs[i].channel_layout = input_codec_context->channel_layout;
+            key->inputs[i].weight         = ctx->input_weights[i];
+        }
+        
+        // Set up the filtergraph, or take one configured ahead of time.
+        if (!ctx->cache || mixer_cache_take(ctx->cache, &graph_kind, key, graph_key_size(nb_inputs), &graph) <= 0)
+            error = build_graph(key, &graph);
+        av_free(key);
+        if (error < 0)
+            goto end;
+        ctx->graph = ((WarmGraph *)graph)->graph;
+        ctx->srcs  = ((WarmGraph *)graph)->srcs;
+        ctx->sink  = ((WarmGraph *)graph)->sink;
+        av_free(graph);
+        report_graph(ctx->graph);
+        // Let the sink cut the mix into frames of the encoder's size.
+        av_buffersink_set_frame_size(ctx->sink, ctx->frame_size);
+    }
+    
+    if (!is_segment_child(ctx) && (error = write_output_file_header(ctx->output_format_context)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error while writing header outputfile\n");
+        goto end;
+    }
+    if ((error = start_outputs(ctx)) < 0)
+        goto end;
+    telemetry_span_end(&ctx->telemetry.tracks[TRACK_MIX], STAGE_OPEN, &open_span);
+
+    if (options->nb_threads > 1) {
+        ctx->pipeline = &pipeline;
+        if ((error = pipeline_start(&pipeline, ctx, options->pipeline_depth, use_native_engine)) < 0)
+            av_log(NULL, AV_LOG_ERROR, "Error while starting the pipeline\n");
+    }
+
+    if (error >= 0)
+        error = use_native_engine ? process_all_native(ctx) : process_all(ctx);
+
+    if (ctx->pipeline) {
+        int pipeline_error;
+        
+        // Unblock the stages still running before waiting for them.
+        if (error < 0)
+            pipeline_fail(&pipeline, error);
+        // The first stage that failed knows best what went wrong.
+        if ((pipeline_error = pipeline_stop(&pipeline)) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error in the pipeline\n");
+            error = pipeline_error;
+        }
+        ctx->pipeline = NULL;
+    }
+    
+    if (error >= 0 && !is_segment_child(ctx) && (error = write_output_file_trailer(ctx->output_format_context)) < 0)
+        av_log(NULL, AV_LOG_ERROR, "Error while writing trailer outputfile\n");
+
+    end:
+        error = close_outputs(ctx, error);
+        close_mix_files(ctx);
+        telemetry_finish(&ctx->telemetry);
+        ctx->stats.peak_rss = peak_rss();
+        if (window) {
+            ctx->segment = NULL;
+            free_segments(window, 1);
+        }
+
+    return error;
+}
+
+// Append the stage times as a JSON object, in seconds.
+static void print_stages_json(AVBPrint *bp, const StageTimes *stages)
+{
+    for (int i = 0 ; i < NB_STAGES ; i++)
+        av_bprintf(bp, "%s\"%s\": {\"calls\": %" PRId64 ", \"wall\": %.6f, \"cpu\": %.6f}",
+                   i ? ", " : "{", telemetry_stage_name(i), stages[i].count,
+                   stages[i].wall / 1e9, stages[i].cpu / 1e9);
+    av_bprintf(bp, "}");
+}
+
+static void print_queue_json(AVBPrint *bp, const TelemetryTrack *track)
+{
+    av_bprintf(bp, "{\"max\": %d, \"mean\": %.2f}", track->max_queue_depth,
+               track->nb_queue_samples ? (double)track->queue_depth_sum / track->nb_queue_samples : 0.0);
+}
+
+// Reads served from the blocks read ahead, reads that waited, and the seconds waited.
+static void print_read_ahead_json(AVBPrint *bp, const TelemetryTrack *track)
+{
+    av_bprintf(bp, "{\"hits\": %" PRId64 ", \"misses\": %" PRId64 ", \"wait\": %.6f}",
+               track->io_hits, track->io_misses, track->io_wait / 1e9);
+}
+
+int mixer_get_stats_json(const MixerContext *ctx, char **json)
+{
+    const Telemetry *t = &ctx->telemetry;
+    StageTimes totals[NB_STAGES];
+    double elapsed = t->elapsed / 1e9;
+    AVBPrint bp;
+
+    *json = NULL;
+    if (!t->nb_tracks)
+        return AVERROR(EINVAL);
+
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
+    av_bprintf(&bp, "{\"output\": ");
+    telemetry_json_string(&bp, ctx->output);
+    av_bprintf(&bp, ", \"engine\": ");
+    telemetry_json_string(&bp, ctx->engine_name ? ctx->engine_name : "none");
+    av_bprintf(&bp, ", \"threads\": %d, \"samples\": %" PRId64 ", \"duration\": %.6f, "
+               "\"elapsed\": %.6f, \"realtime\": %.2f",
+               ctx->options.nb_threads, ctx->stats.nb_samples, ctx->stats.duration,
+               elapsed, elapsed > 0 ? ctx->stats.duration / elapsed : 0.0);
+    av_bprintf(&bp, ", \"memory\": {\"peak_queued_samples\": %" PRId64 ", \"peak_queued_bytes\": %" PRId64 ", "
+               "\"peak_rss\": %" PRId64 "}",
+               ctx->stats.peak_queued_samples, ctx->stats.peak_queued_bytes, ctx->stats.peak_rss);
+    if (t->tracks[TRACK_MIX].nb_graph_calls)
+        av_bprintf(&bp, ", \"graph_calls\": %" PRId64 ", \"graph_calls_per_second\": %.1f",
+                   t->tracks[TRACK_MIX].nb_graph_calls,
+                   ctx->stats.duration > 0 ? t->tracks[TRACK_MIX].nb_graph_calls / ctx->stats.duration : 0.0);
+
+    if (ctx->options.telemetry || ctx->options.trace) {
+        telemetry_stage_totals(t, totals);
+        av_bprintf(&bp, ", \"stages\": ");
+        print_stages_json(&bp, totals);
+    }
+
+    av_bprintf(&bp, ", \"inputs\": [");
+    for (int i = 0 ; i < ctx->nb_inputs ; i++) {
+        const TelemetryTrack *track = &t->tracks[TRACK_INPUT + i];
+
+        av_bprintf(&bp, "%s{\"file\": ", i ? ", " : "");
+        telemetry_json_string(&bp, ctx->input_filenames[i]);
+        av_bprintf(&bp, ", \"weight\": %g, \"frames\": %" PRId64 ", \"samples\": %" PRId64,
+                   ctx->input_weights[i], track->nb_frames, track->nb_samples);
+        if (track->io_hits || track->io_misses) {
+            av_bprintf(&bp, ", \"read_ahead\": ");
+            print_read_ahead_json(&bp, track);
+        }
+        if (ctx->options.nb_threads > 1) {
+            av_bprintf(&bp, ", \"queue\": ");
+            print_queue_json(&bp, track);
+        }
+        av_bprintf(&bp, "}");
+    }
+
+    av_bprintf(&bp, "]");
+    if (ctx->nb_clips) {
+        av_bprintf(&bp, ", \"clips\": {\"count\": %d, \"max_open\": %d, \"frames\": %" PRId64 ", "
+                   "\"samples\": %" PRId64, ctx->nb_clips, ctx->max_open_clips,
+                   t->tracks[TRACK_INPUT].nb_frames, t->tracks[TRACK_INPUT].nb_samples);
+        if (t->tracks[TRACK_INPUT].io_hits || t->tracks[TRACK_INPUT].io_misses) {
+            av_bprintf(&bp, ", \"read_ahead\": ");
+            print_read_ahead_json(&bp, &t->tracks[TRACK_INPUT]);
+        }
+        av_bprintf(&bp, "}");
+    }
+
+    av_bprintf(&bp, ", \"encoder\": {\"frames\": %" PRId64 ", \"samples\": %" PRId64 ", "
+               "\"packets\": %" PRId64 ", \"bytes\": %" PRId64,
+               t->tracks[TRACK_ENCODER].nb_frames, t->tracks[TRACK_ENCODER].nb_samples,
+               t->tracks[TRACK_ENCODER].nb_packets, t->tracks[TRACK_ENCODER].nb_bytes);
+    if (ctx->options.nb_threads > 1) {
+        av_bprintf(&bp, ", \"queue\": ");
+        print_queue_json(&bp, &t->tracks[TRACK_MIX]);
+    }
+    av_bprintf(&bp, "}");
+
+    if (ctx->options.pcm_cache[0])
+        av_bprintf(&bp, ", \"pcm_cache\": {\"hits\": %d, \"misses\": %d, \"bytes_saved\": %" PRId64 "}",
+                   ctx->pcm_cache_hits, ctx->pcm_cache_misses, ctx->pcm_cache_bytes);
+
+    if (ctx->nb_outputs) {
+        av_bprintf(&bp, ", \"outputs\": [");
+        for (int i = 0 ; i < ctx->nb_outputs ; i++) {
+            const MixerOutput *output = &ctx->outputs[i];
+
+            av_bprintf(&bp, "%s{\"file\": ", i ? ", " : "");
+            telemetry_json_string(&bp, output->filename);
+            av_bprintf(&bp, ", \"encoder\": ");
+            telemetry_json_string(&bp, output->codec ? output->codec->name : "none");
+            av_bprintf(&bp, ", \"packets\": %" PRId64 ", \"bytes\": %" PRId64 "}",
+                       output->nb_packets, output->nb_bytes);
+        }
+        av_bprintf(&bp, "]");
+    }
+    av_bprintf(&bp, "}");
+
+    return av_bprint_finalize(&bp, json);
+}
+
+int mixer_write_trace(const MixerContext *ctx, const char *filename)
+{
+    if (!ctx->options.trace || !ctx->telemetry.nb_tracks) {
+        av_log(NULL, AV_LOG_ERROR, "No trace was recorded\n");
+        return AVERROR(EINVAL);
+    }
+
+    return telemetry_write_trace(&ctx->telemetry, filename);
+}
+
@@ -0,0 +1,193 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include <stdint.h>
+
+#include "mix_engine.h"
+
+/**
+ * Audio mixer library.
+ * A MixerContext mixes any number of input files into one output file. Each
+ * context owns all of its state, so several of them can run at the same
+ * time on different threads of one process; one context must only be used
+ * by one thread at a time. Nothing here exits the process: errors are
+ * logged through av_log() and returned as AVERROR codes.
+ */
+
+typedef struct MixerContext MixerContext;
+
+/**
+ * Spare filter graphs and encoders shared by several contexts. Building
+ * them (avfilter_graph_config(), avcodec_open2()) costs more than mixing
+ * a short jingle, so a thread of the cache builds them ahead of time for
+ * the formats it has seen, and contexts using the cache take them ready.
+ */
+typedef struct MixerCache MixerCache;
+
+typedef struct MixerOptions {
+    // 1 decodes, mixes and encodes on the calling thread; more runs one
+    // decoder thread per input and the encoder on a thread of its own.
+    int nb_threads;
+    // Number of frames buffered between two pipeline stages.
+    int pipeline_depth;
+    // Samples per channel of the frames sent to encoders that take any
+    // size (PCM); the others always get frames of their own frame size.
+    int block_size;
+    // Samples, at the output rate, every input of amix is read ahead of the
+    // mix; the graph is run once they all are.
+    int input_lead;
+    // MiB of audio the graph of one job may hold before its inputs stop
+    // being read ahead; 0: no limit.
+    int memory_budget;
+    // Inputs per submix of the native engine: mixes of more inputs are
+    // split into groups mixed on threads of their own, then summed;
+    // 0, or S32 inputs: all inputs are mixed on one thread.
+    int submix_size;
+    // Channel layout of the output; 0 takes the one most inputs have.
+    uint64_t channel_layout;
+    // Mix with the native engine instead of amix when the formats allow it.
+    int use_native_engine;
+    enum MixOverflow overflow;
+    // thread_count of the decoders that support threading; 0 lets libavcodec pick.
+    int decoder_threads;
+    // Map PCM WAV inputs instead of reading them through libavformat.
+    int use_mmap;
+    // Size in KiB and number of the blocks a thread reads ahead of the
+    // demuxer of every input file; a size of 0 reads as libavformat does.
+    int read_ahead;
+    int read_ahead_depth;
+    // Directory keeping what probing learned of every input file, so that
+    // the next mixes of the same files skip avformat_find_stream_info();
+    // empty: probe every time. With probe_cache_validate, a cached entry is
+    // only used when the header of the file agrees with it.
+    char probe_cache[1024];
+    int probe_cache_validate;
+    // Directory keeping the decoded samples of compressed inputs, mapped by
+    // the next mixes of the same files instead of decoding them again;
+    // empty: decode every time. It is kept under pcm_cache_size MiB.
+    char pcm_cache[1024];
+    int pcm_cache_size;
+    // Report the allocations of the mixing loop every second.
+    int debug_alloc;
+    // Time every stage of the mix (demux, decode, push, pull, mix, encode,
+    // mux) on the clock and on the CPU, for mixer_get_stats_json().
+    int telemetry;
+    // Also record every stage call on a timeline, for mixer_write_trace().
+    int trace;
+    // Split long mixes into up to this many segments mixed in parallel and
+    // joined sample exactly in the output; 0 or 1 mixes in one go.
+    int segments;
+    // Only mix this window of the inputs, in AV_TIME_BASE units. The inputs
+    // are sought to start rather than decoded from their beginning, and
+    // reading stops at the end of the window. A duration of 0 runs to the
+    // end of the inputs.
+    int64_t start;
+    int64_t duration;
+} MixerOptions;
+
+typedef struct MixerStats {
+    // Samples per channel written by the last run, and their duration in seconds.
+    int64_t nb_samples;
+    double duration;
+    // Most samples per channel queued between the inputs and the mix at
+    // once, summed over the inputs, and their size in bytes.
+    int64_t peak_queued_samples;
+    int64_t peak_queued_bytes;
+    // Peak resident set size of the whole process so far, in bytes.
+    int64_t peak_rss;
+} MixerStats;
+
+typedef struct MixerCacheStats {
+    // Graphs and encoders taken ready from the cache, and built on demand.
+    int64_t hits;
+    int64_t misses;
+    int nb_keys;
+    int nb_spares;
+} MixerCacheStats;
+
+void mixer_options_default(MixerOptions *options);
+
+/**
+ * Set one option by the long name of its command line switch: "threads",
+ * "pipeline-depth", "block-size", "input-lead", "memory-budget", "layout",
+ * "engine", "submix-size", "overflow", "decoder-threads", "no-mmap", "read-ahead", "read-ahead-depth",
+ * "probe-cache", "probe-cache-validate", "pcm-cache", "pcm-cache-size",
+ * "debug-alloc", "telemetry", "trace", "segments", "start" or "duration".
+ * The switches without argument take a NULL value, or "true"/"false"; start
+ * and duration take [HH:]MM:SS[.m...] or seconds; layout takes a layout
+ * name ("mono", "stereo", "5.1", "7.1"...) or "auto".
+ */
+int mixer_options_set(MixerOptions *options, const char *name, const char *value);
+
+// Create a context mixing into output. The options are copied.
+int mixer_open(MixerContext **ctx, const char *output, const MixerOptions *options);
+
+/**
+ * Start a new mix with a context that is not running: its inputs are
+ * dropped, but its frame and packet buffer pools are kept for the next run.
+ */
+int mixer_reopen(MixerContext *ctx, const char *output, const MixerOptions *options);
+
+int mixer_add_input(MixerContext *ctx, const char *filename, float weight);
+
+/**
+ * Route the channels of input i to those of the output through matrix:
+ * nb_out rows, one per output channel, of nb_in gains, one per input
+ * channel, applied on top of the weight of the input. Inputs without one
+ * whose layout differs from the output get the usual downmix or upmix.
+ * Only the native engine applies matrices; the dimensions are checked
+ * against the channels of the input and the output when the mix runs.
+ */
+int mixer_set_input_matrix(MixerContext *ctx, int i, const double *matrix, int nb_out, int nb_in);
+
+/**
+ * Place a clip on the timeline of the mix instead of adding a whole input:
+ * the part of filename from in to out (0: to its end) plays offset after
+ * the start of the output, scaled by gain. Times are in AV_TIME_BASE units.
+ * A clip is only opened and decoded while it overlaps the block being
+ * mixed, so a timeline costs what its clips overlap, not what it spans. A
+ * context mixes either inputs or clips.
+ */
+int mixer_add_clip(MixerContext *ctx, const char *filename, int64_t offset, float gain,
+                   int64_t in, int64_t out);
+
+/**
+ * Also write the mix to filename, encoded with the encoder named codec
+ * (NULL: the default codec of its container) at bit_rate (0: the default of
+ * the encoder). The mix is done once and every added output encodes it on
+ * a thread of its own, converted to a format its encoder takes, so a run
+ * lasts about as long as its slowest encoder. options.segments does not
+ * apply to mixes with added outputs.
+ */
+int mixer_add_output(MixerContext *ctx, const char *filename, const char *codec, int64_t bit_rate);
+
+// Mix all the inputs into the output. Every file is closed again on return.
+int mixer_run(MixerContext *ctx);
+
+void mixer_get_stats(const MixerContext *ctx, MixerStats *stats);
+
+/**
+ * Summary of the last run as one line of JSON: realtime factor, frame,
+ * sample and packet counts, the depths of the pipeline queues and, with
+ * options.telemetry, the time spent in every stage. *json must be freed
+ * with av_free().
+ */
+int mixer_get_stats_json(const MixerContext *ctx, char **json);
+
+// Write the timeline of the last run (options.trace) as a Chrome trace, for chrome://tracing or Perfetto.
+int mixer_write_trace(const MixerContext *ctx, const char *filename);
+
+void mixer_close(MixerContext **ctx);
+
+// Create a cache keeping nb_spares graphs and encoders ready for each format.
+int mixer_cache_alloc(MixerCache **cache, int nb_spares);
+
+// Only free a cache once no context uses it anymore.
+void mixer_cache_free(MixerCache **cache);
+
+void mixer_cache_get_stats(MixerCache *cache, MixerCacheStats *stats);
+
+// Take graphs and encoders from cache, or NULL to build them for every run.
+void mixer_set_cache(MixerContext *ctx, MixerCache *cache);
+
+#endif // MIXER_H
@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "libavutil/avutil.h"
+#include "libavutil/mem.h"
+#include "libavutil/time.h"
+
+#include "mixer_cache.h"
+
+// The most keys the cache keeps spares for; the least recently used one goes first.
+#define MAX_WARM_KEYS 64
+
+typedef struct WarmEntry {
+    const WarmKind *kind;
+    void *key;
+    size_t key_size;
+    void **spares;
+    int nb_spares;
+    // Set while the thread of the cache builds a spare for this key.
+    int building;
+    // Set when the last build failed, so that it is not retried until the key is asked for again.
+    int failed;
+    int64_t last_used;
+} WarmEntry;
+
+struct MixerCache {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t builder;
+    int stop;
+
+    // Number of spares kept for every key.
+    int nb_spares;
+    WarmEntry *entries;
+    int nb_entries;
+
+    int64_t hits;
+    int64_t misses;
+};
+
+static WarmEntry *find_entry(MixerCache *cache, const WarmKind *kind,
+                             const void *key, size_t key_size)
+{
+    for (int i = 0 ; i < cache->nb_entries ; i++) {
+        WarmEntry *entry = &cache->entries[i];
+        if (entry->kind == kind && entry->key_size == key_size && !memcmp(entry->key, key, key_size))
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void free_entry(WarmEntry *entry)
+{
+    while (entry->nb_spares)
+        entry->kind->free(&entry->spares[--entry->nb_spares]);
+    av_freep(&entry->spares);
+    av_freep(&entry->key);
+}
+
+// Make room for one more key, dropping the least recently used one when full.
+static int reserve_entry(MixerCache *cache)
+{
+    int oldest = -1;
+
+    if (cache->nb_entries < MAX_WARM_KEYS)
+        return 0;
+
+    for (int i = 0 ; i < cache->nb_entries ; i++) {
+        if (!cache->entries[i].building &&
+            (oldest < 0 || cache->entries[i].last_used < cache->entries[oldest].last_used))
+            oldest = i;
+    }
+    if (oldest < 0)
+        return AVERROR(EAGAIN);
+
+    free_entry(&cache->entries[oldest]);
+    cache->entries[oldest] = cache->entries[--cache->nb_entries];
+
+    return 0;
+}
+
+int mixer_cache_take(MixerCache *cache, const WarmKind *kind,
+                     const void *key, size_t key_size, void **object)
+{
+    WarmEntry *entry;
+    int got_object = 0;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (!(entry = find_entry(cache, kind, key, key_size)) && reserve_entry(cache) >= 0) {
+        void *key_copy = av_memdup(key, key_size);
+        void **spares = av_calloc(cache->nb_spares, sizeof(*spares));
+
+        if (key_copy && spares) {
+            entry = &cache->entries[cache->nb_entries++];
+            *entry = (WarmEntry) {
+                .kind     = kind,
+                .key      = key_copy,
+                .key_size = key_size,
+                .spares   = spares,
+            };
+        } else {
+            av_free(key_copy);
+            av_free(spares);
+        }
+    }
+
+    if (entry) {
+        entry->last_used = av_gettime_relative();
+        entry->failed = 0;
+        if (entry->nb_spares) {
+            *object = entry->spares[--entry->nb_spares];
+            got_object = 1;
+        }
+        pthread_cond_signal(&cache->cond);
+    }
+    if (got_object)
+        cache->hits++;
+    else
+        cache->misses++;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return got_object;
+}
+
+// Keep every key topped up with spares, building them one at a time.
+static void *builder_thread(void *arg)
+{
+    MixerCache *cache = arg;
+
+    pthread_mutex_lock(&cache->lock);
+
+    while (!cache->stop) {
+        WarmEntry *entry = NULL;
+        const WarmKind *kind;
+        void *key, *object = NULL;
+        size_t key_size;
+        int error;
+
+        for (int i = 0 ; i < cache->nb_entries && !entry ; i++) {
+            if (cache->entries[i].nb_spares < cache->nb_spares && !cache->entries[i].failed)
+                entry = &cache->entries[i];
+        }
+        if (!entry) {
+            pthread_cond_wait(&cache->cond, &cache->lock);
+            continue;
+        }
+
+        // The entry may move while the lock is released, but it is not
+        // evicted while it is building, so its key stays valid.
+        entry->building = 1;
+        kind     = entry->kind;
+        key      = entry->key;
+        key_size = entry->key_size;
+        pthread_mutex_unlock(&cache->lock);
+
+        error = kind->build(key, &object);
+
+        pthread_mutex_lock(&cache->lock);
+        entry = find_entry(cache, kind, key, key_size);
+        entry->building = 0;
+        if (error < 0) {
+            av_log(NULL, AV_LOG_WARNING, "Could not build a spare %s (error '%s')\n",
+                   kind->name, av_err2str(error));
+            entry->failed = 1;
+        } else if (entry->nb_spares < cache->nb_spares) {
+            entry->spares[entry->nb_spares++] = object;
+            object = NULL;
+        }
+        if (object)
+            kind->free(&object);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return NULL;
+}
+
+int mixer_cache_alloc(MixerCache **cache, int nb_spares)
+{
+    int error;
+
+    if (nb_spares < 1)
+        return AVERROR(EINVAL);
+    if (!(*cache = av_mallocz(sizeof(**cache))) ||
+        !((*cache)->entries = av_calloc(MAX_WARM_KEYS, sizeof(*(*cache)->entries)))) {
+        av_freep(cache);
+        return AVERROR(ENOMEM);
+    }
+
+    (*cache)->nb_spares = nb_spares;
+    pthread_mutex_init(&(*cache)->lock, NULL);
+    pthread_cond_init(&(*cache)->cond, NULL);
+
+    if ((error = pthread_create(&(*cache)->builder, NULL, builder_thread, *cache))) {
+        pthread_mutex_destroy(&(*cache)->lock);
+        pthread_cond_destroy(&(*cache)->cond);
+        av_freep(&(*cache)->entries);
+        av_freep(cache);
+        return AVERROR(error);
+    }
+
+    return 0;
+}
+
+void mixer_cache_get_stats(MixerCache *cache, MixerCacheStats *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    stats->hits      = cache->hits;
+    stats->misses    = cache->misses;
+    stats->nb_keys   = cache->nb_entries;
+    stats->nb_spares = 0;
+    for (int i = 0 ; i < cache->nb_entries ; i++)
+        stats->nb_spares += cache->entries[i].nb_spares;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void mixer_cache_free(MixerCache **cache)
+{
+    if (!*cache)
+        return;
+
+    pthread_mutex_lock(&(*cache)->lock);
+    (*cache)->stop = 1;
+    pthread_cond_signal(&(*cache)->cond);
+    pthread_mutex_unlock(&(*cache)->lock);
+    pthread_join((*cache)->builder, NULL);
+
+    for (int i = 0 ; i < (*cache)->nb_entries ; i++)
+        free_entry(&(*cache)->entries[i]);
+    av_freep(&(*cache)->entries);
+    pthread_mutex_destroy(&(*cache)->lock);
+    pthread_cond_destroy(&(*cache)->cond);
+    av_freep(cache);
+}
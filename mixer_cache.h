@@ -0,0 +1,33 @@
+#ifndef MIXER_CACHE_H
+#define MIXER_CACHE_H
+
+#include <stddef.h>
+
+#include "mixer.h"
+
+/**
+ * Internal side of MixerCache.
+ * The cache keeps spare objects that are expensive to create, such as
+ * configured filter graphs and opened encoders, ready for the next mix.
+ * Objects are found by kind and by a key made of plain bytes: two objects
+ * built from keys with the same bytes must be interchangeable. Every
+ * object is used once; a thread of the cache builds new spares for the
+ * keys that were asked for, so they are ready before the next request.
+ */
+
+typedef struct WarmKind {
+    const char *name;
+    // Create an object for key; called on the thread of the cache.
+    int (*build)(const void *key, void **object);
+    void (*free)(void **object);
+} WarmKind;
+
+/**
+ * Take a spare object built for key. Returns 1 and sets *object when there
+ * is one, 0 when there is none and the caller has to build it itself.
+ * Either way the key is remembered, so that spares are built for it.
+ */
+int mixer_cache_take(MixerCache *cache, const WarmKind *kind,
+                     const void *key, size_t key_size, void **object);
+
+#endif // MIXER_CACHE_H
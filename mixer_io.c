@@ -0,0 +1,742 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "libavutil/avstring.h"
+#include "libavutil/avutil.h"
+#include "libavutil/mem.h"
+#include "libavutil/time.h"
+
+#include "mixer_io.h"
+
+// The size of every block the writer thread stores at once
+#define BLOCK_SIZE (1 << 20)
+// The number of blocks; the muxer waits for a free one once they are all queued
+#define NB_BLOCKS 8
+// The size of the buffer of the AVIOContext itself, copied into the blocks
+#define AVIO_BUFFER_SIZE (64 * 1024)
+// The size of the buffer of the AVIOContext of an input, filled from the blocks read ahead
+#define INPUT_BUFFER_SIZE (32 * 1024)
+
+typedef struct WriterBlock {
+    uint8_t *data;
+    int64_t offset;
+    int size;
+} WriterBlock;
+
+typedef struct Writer {
+    int fd;
+    WriterBlock blocks[NB_BLOCKS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int started;
+    // Blocks waiting for the writer thread, oldest first, as a ring of indices.
+    int queue[NB_BLOCKS];
+    int queue_head;
+    int nb_queued;
+    // Blocks the muxer can fill.
+    int free_blocks[NB_BLOCKS];
+    int nb_free;
+    int stop;
+    // The first error of the writer thread.
+    int error;
+
+    // Only used by the thread of the muxer: the block being filled, and
+    // the block at offset 0 once it is full, or -1.
+    int current;
+    int header;
+    // Offset of the next write, and the size of the file so far.
+    int64_t pos;
+    int64_t size;
+
+#if HAVE_LIBURING
+    struct io_uring ring;
+    int use_uring;
+#endif
+} Writer;
+
+static int pwrite_block(int fd, const WriterBlock *block, int done)
+{
+    while (done < block->size) {
+        ssize_t n = pwrite(fd, block->data + done, block->size - done, block->offset + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n < 0 ? AVERROR(errno) : AVERROR(EIO);
+        done += n;
+    }
+
+    return 0;
+}
+
+#if HAVE_LIBURING
+/**
+ * Store n blocks with one submission. The writes are linked so that they
+ * land in order, as a later block may overwrite part of an earlier one.
+ * A short write cuts the chain; what it left is finished with pwrite().
+ */
+static int uring_write_blocks(Writer *w, const int *indices, int n)
+{
+    int written[NB_BLOCKS] = { 0 };
+    int nb_submitted, error;
+
+    for (int i = 0 ; i < n ; i++) {
+        WriterBlock *block = &w->blocks[indices[i]];
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&w->ring);
+
+        io_uring_prep_write(sqe, w->fd, block->data, block->size, block->offset);
+        io_uring_sqe_set_data(sqe, (void *)(intptr_t)i);
+        if (i < n - 1)
+            sqe->flags |= IOSQE_IO_LINK;
+    }
+    if ((nb_submitted = io_uring_submit(&w->ring)) < 0)
+        return nb_submitted;
+
+    for (int i = 0 ; i < nb_submitted ; i++) {
+        struct io_uring_cqe *cqe;
+
+        if ((error = io_uring_wait_cqe(&w->ring, &cqe)) < 0)
+            return error;
+        if (cqe->res > 0)
+            written[(intptr_t)io_uring_cqe_get_data(cqe)] = cqe->res;
+        io_uring_cqe_seen(&w->ring, cqe);
+    }
+
+    for (int i = 0 ; i < n ; i++) {
+        if ((error = pwrite_block(w->fd, &w->blocks[indices[i]], written[i])) < 0)
+            return error;
+    }
+
+    return 0;
+}
+#endif
+
+// Store n blocks, in order.
+static int write_blocks(Writer *w, const int *indices, int n)
+{
+    int error;
+
+#if HAVE_LIBURING
+    if (w->use_uring)
+        return uring_write_blocks(w, indices, n);
+#endif
+
+    for (int i = 0 ; i < n ; i++) {
+        if ((error = pwrite_block(w->fd, &w->blocks[indices[i]], 0)) < 0)
+            return error;
+    }
+
+    return 0;
+}
+
+// Store the queued blocks, all of them at once, until the file is closed.
+static void *writer_thread(void *arg)
+{
+    Writer *w = arg;
+    int batch[NB_BLOCKS];
+
+    pthread_mutex_lock(&w->lock);
+
+    while (1) {
+        int n = w->nb_queued;
+        int failed = w->error;
+        int error = 0;
+
+        if (!n) {
+            if (w->stop)
+                break;
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+
+        for (int i = 0 ; i < n ; i++)
+            batch[i] = w->queue[(w->queue_head + i) % NB_BLOCKS];
+        pthread_mutex_unlock(&w->lock);
+
+        // After an error the blocks are only given back.
+        if (!failed)
+            error = write_blocks(w, batch, n);
+
+        pthread_mutex_lock(&w->lock);
+        w->queue_head = (w->queue_head + n) % NB_BLOCKS;
+        w->nb_queued -= n;
+        for (int i = 0 ; i < n ; i++)
+            w->free_blocks[w->nb_free++] = batch[i];
+        if (error < 0 && !w->error)
+            w->error = error;
+        pthread_cond_broadcast(&w->cond);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+// Queue a block for the writer thread; called with the lock held.
+static void queue_block(Writer *w, int index)
+{
+    if (!w->blocks[index].size) {
+        w->free_blocks[w->nb_free++] = index;
+        return;
+    }
+
+    w->queue[(w->queue_head + w->nb_queued) % NB_BLOCKS] = index;
+    w->nb_queued++;
+    pthread_cond_broadcast(&w->cond);
+}
+
+// Hand the block being filled over and start a new one at the current offset.
+static int next_block(Writer *w)
+{
+    int error;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->current >= 0) {
+        // The start of the file stays in memory for the header patches.
+        if (!w->blocks[w->current].offset && w->blocks[w->current].size && w->header < 0)
+            w->header = w->current;
+        else
+            queue_block(w, w->current);
+        w->current = -1;
+    }
+
+    while (!w->nb_free && !w->error)
+        pthread_cond_wait(&w->cond, &w->lock);
+    if (!(error = w->error)) {
+        w->current = w->free_blocks[--w->nb_free];
+        w->blocks[w->current].offset = w->pos;
+        w->blocks[w->current].size   = 0;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return error;
+}
+
+// The block in memory that already holds offset pos, where a write patches it in place.
+static WriterBlock *held_block(Writer *w, int64_t pos)
+{
+    const int held[] = { w->header, w->current };
+
+    for (int i = 0 ; i < FF_ARRAY_ELEMS(held) ; i++) {
+        WriterBlock *block = held[i] >= 0 ? &w->blocks[held[i]] : NULL;
+
+        if (block && pos >= block->offset && pos < block->offset + block->size)
+            return block;
+    }
+
+    return NULL;
+}
+
+static int writer_write_packet(void *opaque, uint8_t *buf, int size)
+{
+    Writer *w = opaque;
+    int done = 0;
+    int error;
+
+    while (done < size) {
+        WriterBlock *block = held_block(w, w->pos);
+        int n;
+
+        if (block) {
+            n = FFMIN(size - done, block->offset + block->size - w->pos);
+            memcpy(block->data + (w->pos - block->offset), buf + done, n);
+        } else {
+            block = w->current >= 0 ? &w->blocks[w->current] : NULL;
+            if ((!block || w->pos != block->offset + block->size || block->size == BLOCK_SIZE) &&
+                (error = next_block(w)) < 0)
+                return error;
+            block = &w->blocks[w->current];
+            n = FFMIN(size - done, BLOCK_SIZE - block->size);
+            memcpy(block->data + block->size, buf + done, n);
+            block->size += n;
+        }
+
+        w->pos += n;
+        w->size = FFMAX(w->size, w->pos);
+        done   += n;
+    }
+
+    return size;
+}
+
+// Seeks only move the offset of the next write.
+static int64_t writer_seek(void *opaque, int64_t offset, int whence)
+{
+    Writer *w = opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return w->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += w->pos;
+        break;
+    case SEEK_END:
+        offset += w->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    return w->pos = offset;
+}
+
+static void writer_free(Writer **w)
+{
+    if (!*w)
+        return;
+
+    if ((*w)->fd >= 0)
+        close((*w)->fd);
+#if HAVE_LIBURING
+    if ((*w)->use_uring)
+        io_uring_queue_exit(&(*w)->ring);
+#endif
+    for (int i = 0 ; i < NB_BLOCKS ; i++)
+        av_freep(&(*w)->blocks[i].data);
+    pthread_mutex_destroy(&(*w)->lock);
+    pthread_cond_destroy(&(*w)->cond);
+    av_freep(w);
+}
+
+int mixer_io_open(AVIOContext **pb, const char *filename)
+{
+    const char *protocol = avio_find_protocol_name(filename);
+    uint8_t *buffer = NULL;
+    Writer *w;
+    int error;
+
+    *pb = NULL;
+    if (!protocol || strcmp(protocol, "file"))
+        return avio_open(pb, filename, AVIO_FLAG_WRITE);
+    av_strstart(filename, "file:", &filename);
+
+    if (!(w = av_mallocz(sizeof(*w))))
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->fd      = -1;
+    w->current = -1;
+    w->header  = -1;
+
+    for (int i = 0 ; i < NB_BLOCKS ; i++) {
+        if (!(w->blocks[i].data = av_malloc(BLOCK_SIZE))) {
+            error = AVERROR(ENOMEM);
+            goto fail;
+        }
+        w->free_blocks[w->nb_free++] = i;
+    }
+
+    if ((w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        error = AVERROR(errno);
+        goto fail;
+    }
+#if HAVE_LIBURING
+    // Kernels without io_uring, or with it disabled, get pwrite().
+    w->use_uring = io_uring_queue_init(NB_BLOCKS, &w->ring, 0) >= 0;
+#endif
+
+    if (!(buffer = av_malloc(AVIO_BUFFER_SIZE)) ||
+        !(*pb = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, w, NULL, writer_write_packet, writer_seek))) {
+        av_free(buffer);
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    (*pb)->seekable = AVIO_SEEKABLE_NORMAL;
+
+    if ((error = pthread_create(&w->thread, NULL, writer_thread, w))) {
+        error = AVERROR(error);
+        goto fail;
+    }
+
+    return 0;
+
+    fail:
+        if (*pb) {
+            av_freep(&(*pb)->buffer);
+            avio_context_free(pb);
+        }
+        writer_free(&w);
+
+    return error;
+}
+
+void mixer_io_preallocate(AVIOContext *pb, int64_t size)
+{
+    Writer *w;
+
+    if (!pb || size <= 0 || pb->write_packet != writer_write_packet)
+        return;
+    w = pb->opaque;
+
+    // Only a hint: the file systems without fallocate() allocate as the file grows.
+    if (fallocate(w->fd, 0, 0, size) < 0)
+        av_log(NULL, AV_LOG_VERBOSE, "Could not preallocate %" PRId64 " bytes (%s)\n",
+               size, strerror(errno));
+}
+
+typedef struct ReadBlock {
+    uint8_t *data;
+    int64_t offset;
+    int size;
+    // Set once the thread has read it.
+    int ready;
+} ReadBlock;
+
+typedef struct Reader {
+    int fd;
+    int64_t file_size;
+    ReadBlock *blocks;
+    int nb_blocks;
+    int block_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    // Blocks of consecutive ranges of the file, from head on: the ready
+    // ones, then the one being read.
+    int head;
+    int nb_queued;
+    // Offset of the next block the thread reads.
+    int64_t next_offset;
+    // Bumped when a seek drops the blocks, so that a read in flight is dropped too.
+    int generation;
+    int stop;
+    int error;
+
+    // Offset of the next read, only used by the thread of the demuxer.
+    int64_t pos;
+    MixerIOStats stats;
+} Reader;
+
+static int pread_block(int fd, ReadBlock *block, int size)
+{
+    int done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(fd, block->data + done, size - done, block->offset + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return AVERROR(errno);
+        if (!n)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+// Keep nb_blocks blocks read ahead of the demuxer.
+static void *reader_thread(void *arg)
+{
+    Reader *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+
+    while (!r->stop) {
+        ReadBlock *block;
+        int64_t offset;
+        int generation, size;
+
+        if (r->nb_queued == r->nb_blocks || r->next_offset >= r->file_size || r->error) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+
+        block = &r->blocks[(r->head + r->nb_queued++) % r->nb_blocks];
+        block->offset = offset = r->next_offset;
+        block->ready  = 0;
+        generation    = r->generation;
+        r->next_offset += r->block_size;
+        pthread_mutex_unlock(&r->lock);
+
+        // Let the kernel start on the range after the blocks held.
+        posix_fadvise(r->fd, offset + (int64_t)r->nb_blocks * r->block_size, r->block_size, POSIX_FADV_WILLNEED);
+        size = pread_block(r->fd, block, r->block_size);
+
+        pthread_mutex_lock(&r->lock);
+        if (generation != r->generation)
+            continue;
+        if (size < 0)
+            r->error = size;
+        block->size  = FFMAX(size, 0);
+        block->ready = 1;
+        pthread_cond_broadcast(&r->cond);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+static int reader_read_packet(void *opaque, uint8_t *buf, int size)
+{
+    Reader *r = opaque;
+    int64_t wait_start = 0;
+    int n;
+
+    pthread_mutex_lock(&r->lock);
+
+    while (1) {
+        ReadBlock *block = &r->blocks[r->head];
+
+        if (r->pos >= r->file_size) {
+            n = AVERROR_EOF;
+            break;
+        }
+        // A seek out of the blocks read ahead starts reading again from there.
+        if (r->nb_queued ? r->pos < block->offset || r->pos >= r->next_offset : r->pos != r->next_offset) {
+            r->generation++;
+            r->head        = 0;
+            r->nb_queued   = 0;
+            r->next_offset = r->pos;
+            pthread_cond_broadcast(&r->cond);
+            continue;
+        }
+        if (!r->nb_queued || !block->ready) {
+            if (r->error) {
+                n = r->error;
+                break;
+            }
+            if (!wait_start)
+                wait_start = av_gettime_relative();
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+
+        if (r->pos < block->offset + block->size) {
+            n = FFMIN(size, block->offset + block->size - r->pos);
+            memcpy(buf, block->data + (r->pos - block->offset), n);
+            r->pos += n;
+        } else if (block->size < r->block_size) {
+            // The file is shorter than it was when opened.
+            n = AVERROR_EOF;
+            break;
+        } else {
+            n = 0;
+        }
+
+        // A block read to its end is given back for the thread to read further ahead.
+        if (r->pos >= block->offset + block->size) {
+            r->head = (r->head + 1) % r->nb_blocks;
+            r->nb_queued--;
+            pthread_cond_broadcast(&r->cond);
+        }
+        if (n)
+            break;
+    }
+
+    if (wait_start) {
+        r->stats.misses++;
+        r->stats.wait += (av_gettime_relative() - wait_start) * 1000;
+    } else if (n > 0) {
+        r->stats.hits++;
+    }
+
+    pthread_mutex_unlock(&r->lock);
+
+    return n;
+}
+
+// Seeks only move the offset of the next read; the blocks are dropped by the next read outside of them.
+static int64_t reader_seek(void *opaque, int64_t offset, int whence)
+{
+    Reader *r = opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return r->file_size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += r->pos;
+        break;
+    case SEEK_END:
+        offset += r->file_size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    return r->pos = offset;
+}
+
+static void reader_free(Reader **r)
+{
+    if (!*r)
+        return;
+
+    if ((*r)->fd >= 0)
+        close((*r)->fd);
+    for (int i = 0 ; i < (*r)->nb_blocks ; i++)
+        av_freep(&(*r)->blocks[i].data);
+    av_freep(&(*r)->blocks);
+    pthread_mutex_destroy(&(*r)->lock);
+    pthread_cond_destroy(&(*r)->cond);
+    av_freep(r);
+}
+
+int mixer_io_open_input(AVIOContext **pb, const char *filename, int block_size, int nb_blocks)
+{
+    const char *protocol = avio_find_protocol_name(filename);
+    uint8_t *buffer = NULL;
+    struct stat st;
+    Reader *r;
+    int fd, error;
+
+    *pb = NULL;
+    if (!protocol || strcmp(protocol, "file") || block_size <= 0 || nb_blocks <= 0)
+        return 0;
+    av_strstart(filename, "file:", &filename);
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    // Pipes and devices are left to libavformat.
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (!(r = av_mallocz(sizeof(*r)))) {
+        close(fd);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->fd         = fd;
+    r->file_size  = st.st_size;
+    r->block_size = block_size;
+
+    if (!(r->blocks = av_calloc(nb_blocks, sizeof(*r->blocks)))) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    for ( ; r->nb_blocks < nb_blocks ; r->nb_blocks++) {
+        if (!(r->blocks[r->nb_blocks].data = av_malloc(block_size))) {
+            error = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+
+    if (!(buffer = av_malloc(INPUT_BUFFER_SIZE)) ||
+        !(*pb = avio_alloc_context(buffer, INPUT_BUFFER_SIZE, 0, r, reader_read_packet, NULL, reader_seek))) {
+        av_free(buffer);
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+    (*pb)->seekable = AVIO_SEEKABLE_NORMAL;
+
+    if ((error = pthread_create(&r->thread, NULL, reader_thread, r))) {
+        error = AVERROR(error);
+        goto fail;
+    }
+
+    return 0;
+
+    fail:
+        if (*pb) {
+            av_freep(&(*pb)->buffer);
+            avio_context_free(pb);
+        }
+        reader_free(&r);
+
+    return error;
+}
+
+void mixer_io_get_stats(AVIOContext *pb, MixerIOStats *stats)
+{
+    Reader *r;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!pb || pb->read_packet != reader_read_packet)
+        return;
+    r = pb->opaque;
+
+    pthread_mutex_lock(&r->lock);
+    *stats = r->stats;
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int reader_close(AVIOContext **pb)
+{
+    Reader *r = (*pb)->opaque;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+
+    reader_free(&r);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+
+    return 0;
+}
+
+int mixer_io_close(AVIOContext **pb)
+{
+    Writer *w;
+    int error;
+
+    if (!*pb)
+        return 0;
+    if ((*pb)->read_packet == reader_read_packet)
+        return reader_close(pb);
+    if ((*pb)->write_packet != writer_write_packet)
+        return avio_closep(pb);
+
+    w = (*pb)->opaque;
+    avio_flush(*pb);
+    error = (*pb)->error;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->current >= 0)
+        queue_block(w, w->current);
+    // The header goes last, once everything it describes is written.
+    if (w->header >= 0)
+        queue_block(w, w->header);
+    w->current = w->header = -1;
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    if (!error)
+        error = w->error;
+    // Give back what was preallocated beyond the end.
+    if (!error && ftruncate(w->fd, w->size) < 0)
+        error = AVERROR(errno);
+    if (close(w->fd) < 0 && !error)
+        error = AVERROR(errno);
+    w->fd = -1;
+
+    writer_free(&w);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+
+    if (error < 0)
+        av_log(NULL, AV_LOG_ERROR, "Could not write the output file (error '%s')\n", av_err2str(error));
+
+    return error;
+}
@@ -0,0 +1,57 @@
+#ifndef MIXER_IO_H
+#define MIXER_IO_H
+
+#include <stdint.h>
+
+#include "libavformat/avio.h"
+
+/**
+ * Files read and written from threads of their own.
+ * Output files: the muxer writes into large blocks held in memory; full
+ * blocks are handed to a writer thread that stores them with pwrite(), or
+ * with io_uring when built with HAVE_LIBURING and the kernel supports it,
+ * so a slow disk or network volume does not stall the thread that mixes.
+ * Every block carries its own file offset, so the seeks of the muxer cost
+ * no system call. The block at the start of the file is kept in memory
+ * until the file is closed: the muxers that patch their header once the
+ * sizes are known (WAV, AIFF) do it there, and the final header is written
+ * once, last.
+ * Input files: a reader thread keeps a few blocks of the file read ahead
+ * of the demuxer, and asks the kernel for the range after them with
+ * posix_fadvise(), so the demuxer finds its data in memory instead of
+ * waiting on the disk.
+ * URLs with another protocol than file: go through libavformat as usual.
+ */
+
+typedef struct MixerIOStats {
+    // Reads served from the blocks read ahead, and reads that had to wait for the disk.
+    int64_t hits;
+    int64_t misses;
+    // Nanoseconds spent waiting.
+    int64_t wait;
+} MixerIOStats;
+
+// Open filename for writing, truncating it.
+int mixer_io_open(AVIOContext **pb, const char *filename);
+
+// Reserve size bytes for the file, when its size can be told in advance.
+void mixer_io_preallocate(AVIOContext *pb, int64_t size);
+
+/**
+ * Open filename for reading, with nb_blocks blocks of block_size bytes read
+ * ahead. For what is not a regular file, *pb is set to NULL and 0 returned:
+ * libavformat opens it itself.
+ */
+int mixer_io_open_input(AVIOContext **pb, const char *filename, int block_size, int nb_blocks);
+
+// Counters of an input opened by mixer_io_open_input(); zero for any other context.
+void mixer_io_get_stats(AVIOContext *pb, MixerIOStats *stats);
+
+/**
+ * Close a file opened by either function. For outputs, write what is left
+ * and wait for the writer thread first: write errors surface here at the
+ * latest, so the result must be checked.
+ */
+int mixer_io_close(AVIOContext **pb);
+
+#endif // MIXER_IO_H
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/avutil.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/mem.h"
+
+#include "mixer_pcm_cache.h"
+#include "mixer_probe.h"
+
+// The size of the header of an entry: RIFF, fmt (WAVE_FORMAT_EXTENSIBLE), abr and data chunk headers
+#define HEADER_SIZE 84
+// The most samples a WAV data chunk can describe, in bytes
+#define MAX_DATA_SIZE (UINT32_MAX - HEADER_SIZE)
+
+// An entry of the directory, for the eviction of the least used ones.
+typedef struct CacheFile {
+    char *name;
+    int64_t size;
+    int64_t mtime;
+} CacheFile;
+
+int pcm_cache_path(const char *dir, const char *filename, char **path)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    char stamp[64];
+    FileKey key;
+
+    *path = NULL;
+    if (!probe_file_key(filename, &key))
+        return 0;
+
+    // 64 bit FNV-1a of the path, the size and the modification time.
+    snprintf(stamp, sizeof(stamp), "\n%" PRId64 "\n%" PRId64, key.size, key.mtime);
+    for (const unsigned char *p = (const unsigned char *)key.path ; *p ; p++)
+        hash = (hash ^ *p) * UINT64_C(0x100000001b3);
+    for (const unsigned char *p = (const unsigned char *)stamp ; *p ; p++)
+        hash = (hash ^ *p) * UINT64_C(0x100000001b3);
+
+    if (!(*path = av_asprintf("%s/%016" PRIx64 ".wav", dir, hash)))
+        return AVERROR(ENOMEM);
+
+    return 1;
+}
+
+void pcm_cache_touch(const char *path)
+{
+    utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+static void write_header(uint8_t *header, int sample_rate, int channels, uint64_t channel_layout,
+                         int64_t bit_rate, int64_t data_size)
+{
+    static const uint8_t float_guid[16] = {
+        0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71,
+    };
+    int block_align = channels * 4;
+
+    memcpy(header, "RIFF", 4);
+    AV_WL32(header + 4, HEADER_SIZE - 8 + data_size);
+    memcpy(header + 8, "WAVE", 4);
+
+    memcpy(header + 12, "fmt ", 4);
+    AV_WL32(header + 16, 40);
+    AV_WL16(header + 20, 0xFFFE);
+    AV_WL16(header + 22, channels);
+    AV_WL32(header + 24, sample_rate);
+    AV_WL32(header + 28, sample_rate * block_align);
+    AV_WL16(header + 32, block_align);
+    AV_WL16(header + 34, 32);
+    AV_WL16(header + 36, 22);
+    AV_WL16(header + 38, 32);
+    AV_WL32(header + 40, channel_layout);
+    memcpy(header + 44, float_guid, sizeof(float_guid));
+
+    // The bit rate of the source, for the encoders that take it from the first input.
+    memcpy(header + 60, "abr ", 4);
+    AV_WL32(header + 64, 8);
+    AV_WL64(header + 68, bit_rate);
+
+    memcpy(header + 76, "data", 4);
+    AV_WL32(header + 80, data_size);
+}
+
+int pcm_cache_writer_open(PcmCacheWriter *w, const char *dir, const char *path, int sample_rate,
+                          int channels, uint64_t channel_layout, int64_t bit_rate, int64_t max_size)
+{
+    uint8_t header[HEADER_SIZE];
+    int fd, error;
+
+    memset(w, 0, sizeof(*w));
+    w->block_align = channels * 4;
+    w->cache_size  = max_size;
+    w->max_size    = FFMIN(max_size, MAX_DATA_SIZE);
+
+    if (!(w->dir = av_strdup(dir)) || !(w->path = av_strdup(path)) ||
+        !(w->tmp = av_asprintf("%s.XXXXXX", path))) {
+        error = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    // Written aside and renamed, so that other processes only ever see complete entries.
+    if ((fd = mkstemp(w->tmp)) < 0) {
+        error = AVERROR(errno);
+        goto fail;
+    }
+    // mkstemp() only lets the owner read; the cache is shared with the jobs of other users.
+    if (fchmod(fd, 0644) < 0 || !(w->f = fdopen(fd, "w"))) {
+        error = AVERROR(errno);
+        close(fd);
+        unlink(w->tmp);
+        goto fail;
+    }
+
+    write_header(header, sample_rate, channels, channel_layout, bit_rate, 0);
+    if (fwrite(header, sizeof(header), 1, w->f) != 1)
+        return pcm_cache_writer_close(w, AVERROR(errno));
+
+    return 0;
+
+    fail:
+        av_freep(&w->dir);
+        av_freep(&w->path);
+        av_freep(&w->tmp);
+
+    return error;
+}
+
+int pcm_cache_writer_write(PcmCacheWriter *w, const float *samples, int nb_samples)
+{
+    int64_t size = (int64_t)nb_samples * w->block_align;
+
+    if (w->data_size + size > w->max_size)
+        return AVERROR(EFBIG);
+    // A short write may leave errno unset; it must still fail, or the size in the header would be wrong.
+    if (fwrite(samples, 1, size, w->f) != size)
+        return errno ? AVERROR(errno) : AVERROR(EIO);
+    w->data_size += size;
+
+    return 0;
+}
+
+static int compare_mtime(const void *a, const void *b)
+{
+    const CacheFile *fa = a, *fb = b;
+
+    return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+// Delete the entries used least recently until the cache in dir holds at most max_size bytes.
+static void evict(const char *dir, int64_t max_size)
+{
+    CacheFile *files = NULL;
+    int nb_files = 0;
+    int64_t total = 0;
+    struct dirent *de;
+    DIR *d;
+
+    if (!(d = opendir(dir)))
+        return;
+
+    while ((de = readdir(d))) {
+        size_t length = strlen(de->d_name);
+        CacheFile file;
+        struct stat st;
+
+        if (length < 4 || strcmp(de->d_name + length - 4, ".wav") ||
+            fstatat(dirfd(d), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        file = (CacheFile) {
+            .name  = av_strdup(de->d_name),
+            .size  = st.st_size,
+            .mtime = st.st_mtim.tv_sec * INT64_C(1000000000) + st.st_mtim.tv_nsec,
+        };
+        if (!file.name || !av_dynarray2_add((void **)&files, &nb_files, sizeof(file), (uint8_t *)&file)) {
+            av_free(file.name);
+            break;
+        }
+        total += file.size;
+    }
+
+    if (total > max_size) {
+        qsort(files, nb_files, sizeof(*files), compare_mtime);
+        for (int i = 0 ; i < nb_files && total > max_size ; i++) {
+            // Mixes still mapping the entry keep their mapping.
+            if (!unlinkat(dirfd(d), files[i].name, 0)) {
+                av_log(NULL, AV_LOG_VERBOSE, "Evicted '%s/%s' from the PCM cache\n", dir, files[i].name);
+                total -= files[i].size;
+            }
+        }
+    }
+
+    for (int i = 0 ; i < nb_files ; i++)
+        av_free(files[i].name);
+    av_free(files);
+    closedir(d);
+}
+
+int pcm_cache_writer_close(PcmCacheWriter *w, int error)
+{
+    uint8_t sizes[8];
+
+    if (!w->f)
+        return error;
+
+    // Only the sizes of the RIFF and data chunks change.
+    AV_WL32(sizes, HEADER_SIZE - 8 + w->data_size);
+    AV_WL32(sizes + 4, w->data_size);
+    if (error >= 0 &&
+        (fseeko(w->f, 4, SEEK_SET) < 0 || fwrite(sizes, 4, 1, w->f) != 1 ||
+         fseeko(w->f, HEADER_SIZE - 4, SEEK_SET) < 0 || fwrite(sizes + 4, 4, 1, w->f) != 1))
+        error = AVERROR(errno);
+    if (fclose(w->f) && error >= 0)
+        error = AVERROR(errno);
+    w->f = NULL;
+
+    if (error >= 0 && rename(w->tmp, w->path) < 0)
+        error = AVERROR(errno);
+    if (error < 0)
+        unlink(w->tmp);
+    else
+        evict(w->dir, w->cache_size);
+
+    av_freep(&w->dir);
+    av_freep(&w->path);
+    av_freep(&w->tmp);
+
+    return error;
+}
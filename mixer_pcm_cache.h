@@ -0,0 +1,56 @@
+#ifndef MIXER_PCM_CACHE_H
+#define MIXER_PCM_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Decoded samples of compressed inputs kept on disk (MixerOptions.pcm_cache).
+ * The first mix of an MP3 or AAC asset decodes it into a float WAV file of
+ * the cache directory; the next mixes, in any process, map that file like
+ * any PCM WAV input, with neither demuxer nor decoder, and share its pages
+ * through the page cache. An entry is named after the path, size and
+ * modification time of its source, so a changed source gets a new entry
+ * and the old one ages out. The directory is kept under a size limit by
+ * deleting the entries used least recently; using an entry sets its
+ * modification time.
+ */
+
+typedef struct PcmCacheWriter {
+    FILE *f;
+    char *dir;
+    char *path;
+    char *tmp;
+    int block_align;
+    int64_t data_size;
+    // The largest entry, and the size the cache is kept under.
+    int64_t max_size;
+    int64_t cache_size;
+} PcmCacheWriter;
+
+/**
+ * Set *path to the entry of filename in dir, to be freed with av_free().
+ * Returns 0, leaving *path NULL, for what is not a regular local file.
+ */
+int pcm_cache_path(const char *dir, const char *filename, char **path);
+
+// Mark the entry at path as used now.
+void pcm_cache_touch(const char *path);
+
+/**
+ * Start writing the entry at path of the cache in dir, for interleaved
+ * float samples decoded from a file of bit_rate. Entries over max_size
+ * bytes are dropped, as are the least used ones once the cache is over it.
+ */
+int pcm_cache_writer_open(PcmCacheWriter *w, const char *dir, const char *path, int sample_rate,
+                          int channels, uint64_t channel_layout, int64_t bit_rate, int64_t max_size);
+
+int pcm_cache_writer_write(PcmCacheWriter *w, const float *samples, int nb_samples);
+
+/**
+ * Put the entry in place, or drop it when error is an error. Returns error,
+ * or the error of finishing the entry.
+ */
+int pcm_cache_writer_close(PcmCacheWriter *w, int error);
+
+#endif // MIXER_PCM_CACHE_H
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/avutil.h"
+#include "libavutil/mem.h"
+
+#include "mixer_probe.h"
+
+// Bumped whenever the entries change, so that the older ones are probed again
+#define PROBE_CACHE_VERSION 1
+// The largest extradata an entry keeps; the inputs with more are probed every time
+#define MAX_EXTRADATA_SIZE 32768
+// The longest line of an entry: the extradata, in hex
+#define MAX_LINE_SIZE (2 * MAX_EXTRADATA_SIZE + 64)
+
+// The integer fields of AVCodecParameters an entry keeps, by name.
+typedef struct ParField {
+    const char *name;
+    size_t offset;
+    size_t size;
+} ParField;
+
+#define PAR_FIELD(field) { #field, offsetof(AVCodecParameters, field), sizeof(((AVCodecParameters *)0)->field) }
+
+static const ParField par_fields[] = {
+    PAR_FIELD(codec_tag),
+    PAR_FIELD(bit_rate),
+    PAR_FIELD(bits_per_coded_sample),
+    PAR_FIELD(bits_per_raw_sample),
+    PAR_FIELD(profile),
+    PAR_FIELD(level),
+    PAR_FIELD(channel_layout),
+    PAR_FIELD(channels),
+    PAR_FIELD(sample_rate),
+    PAR_FIELD(block_align),
+    PAR_FIELD(frame_size),
+    PAR_FIELD(initial_padding),
+    PAR_FIELD(trailing_padding),
+    PAR_FIELD(seek_preroll),
+};
+
+int probe_file_key(const char *filename, FileKey *key)
+{
+    const char *protocol = avio_find_protocol_name(filename);
+    struct stat st;
+
+    if (!protocol || strcmp(protocol, "file"))
+        return 0;
+    av_strstart(filename, "file:", &filename);
+
+    if (!realpath(filename, key->path) || stat(key->path, &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+    key->size  = st.st_size;
+    key->mtime = st.st_mtim.tv_sec * INT64_C(1000000000) + st.st_mtim.tv_nsec;
+
+    return 1;
+}
+
+// Entries are named after a 64 bit FNV-1a hash of the path; the path in the entry settles collisions.
+static void entry_path(const char *dir, const FileKey *key, char *path, size_t size)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+    for (const unsigned char *p = (const unsigned char *)key->path ; *p ; p++)
+        hash = (hash ^ *p) * UINT64_C(0x100000001b3);
+
+    snprintf(path, size, "%s/%016" PRIx64 ".probe", dir, hash);
+}
+
+static int64_t *field_int64(AVCodecParameters *par, const ParField *field)
+{
+    return (int64_t *)((uint8_t *)par + field->offset);
+}
+
+static int *field_int(AVCodecParameters *par, const ParField *field)
+{
+    return (int *)((uint8_t *)par + field->offset);
+}
+
+static int parse_extradata(AVCodecParameters *par, const char *hex)
+{
+    int size = strlen(hex) / 2;
+
+    if (!size)
+        return 1;
+    if (size > MAX_EXTRADATA_SIZE || !(par->extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE)))
+        return 0;
+    par->extradata_size = size;
+
+    for (int i = 0 ; i < size ; i++) {
+        unsigned value;
+
+        if (sscanf(hex + 2 * i, "%2x", &value) != 1)
+            return 0;
+        par->extradata[i] = value;
+    }
+
+    return 1;
+}
+
+/**
+ * Set the field name of entry to value. Returns 0 when the entry turns out
+ * not to be for key, or when the value is not valid.
+ */
+static int parse_field(ProbeEntry *entry, const FileKey *key, const char *name, const char *value)
+{
+    AVCodecParameters *par = entry->par;
+    int64_t n = strtoll(value, NULL, 10);
+
+    if (!strcmp(name, "version"))
+        return n == PROBE_CACHE_VERSION;
+    // Entries written by another libavformat are probed again, as its demuxers may tell more.
+    if (!strcmp(name, "libavformat"))
+        return n == avformat_version();
+    if (!strcmp(name, "path"))
+        return !strcmp(value, key->path);
+    if (!strcmp(name, "size"))
+        return n == key->size;
+    if (!strcmp(name, "mtime"))
+        return n == key->mtime;
+
+    if (!strcmp(name, "format"))
+        return av_strlcpy(entry->format, value, sizeof(entry->format)) < sizeof(entry->format);
+    if (!strcmp(name, "codec")) {
+        const AVCodecDescriptor *descriptor = avcodec_descriptor_get_by_name(value);
+
+        par->codec_id = descriptor ? descriptor->id : AV_CODEC_ID_NONE;
+        return descriptor && descriptor->type == AVMEDIA_TYPE_AUDIO;
+    }
+    if (!strcmp(name, "sample_fmt"))
+        return (par->format = av_get_sample_fmt(value)) != AV_SAMPLE_FMT_NONE;
+    if (!strcmp(name, "time_base"))
+        return sscanf(value, "%d/%d", &entry->time_base.num, &entry->time_base.den) == 2 &&
+               entry->time_base.num > 0 && entry->time_base.den > 0;
+    if (!strcmp(name, "start_time")) {
+        entry->start_time = n;
+        return 1;
+    }
+    if (!strcmp(name, "duration")) {
+        entry->duration = n;
+        return 1;
+    }
+    if (!strcmp(name, "extradata"))
+        return parse_extradata(par, value);
+
+    for (int i = 0 ; i < FF_ARRAY_ELEMS(par_fields) ; i++) {
+        if (strcmp(name, par_fields[i].name))
+            continue;
+        if (par_fields[i].size == sizeof(int64_t))
+            *field_int64(par, &par_fields[i]) = n;
+        else
+            *field_int(par, &par_fields[i]) = n;
+        return 1;
+    }
+
+    // Fields of later versions are skipped.
+    return 1;
+}
+
+int probe_cache_read(const char *dir, const char *filename, ProbeEntry *entry)
+{
+    char path[PATH_MAX + 64];
+    char *line = NULL;
+    FileKey key;
+    FILE *f;
+    int valid = 1;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->start_time = AV_NOPTS_VALUE;
+    entry->duration   = AV_NOPTS_VALUE;
+
+    if (!probe_file_key(filename, &key))
+        return 0;
+    entry_path(dir, &key, path, sizeof(path));
+    if (!(f = fopen(path, "r")))
+        return 0;
+
+    if (!(entry->par = avcodec_parameters_alloc()) || !(line = av_malloc(MAX_LINE_SIZE)))
+        valid = 0;
+    else
+        entry->par->codec_type = AVMEDIA_TYPE_AUDIO;
+
+    while (valid && fgets(line, MAX_LINE_SIZE, f)) {
+        char *value = strchr(line, '=');
+
+        if (!value) {
+            valid = 0;
+            break;
+        }
+        *value++ = 0;
+        value[strcspn(value, "\n")] = 0;
+        valid = parse_field(entry, &key, line, value);
+    }
+    fclose(f);
+    av_free(line);
+
+    // A damaged entry is as good as none; it is replaced once the file is probed again.
+    if (!valid || !entry->format[0] || !entry->par->codec_id || !entry->time_base.num) {
+        probe_entry_uninit(entry);
+        return 0;
+    }
+
+    return 1;
+}
+
+int probe_entry_apply(const ProbeEntry *entry, AVFormatContext *ic, int validate)
+{
+    const AVCodecParameters *header;
+    AVStream *stream;
+    int error;
+
+    if (ic->nb_streams != 1)
+        return 0;
+    stream = ic->streams[0];
+    header = stream->codecpar;
+
+    // Only what the demuxer read from the header is checked; nothing is decoded.
+    if (validate &&
+        ((header->codec_id && header->codec_id != entry->par->codec_id) ||
+         (header->sample_rate && header->sample_rate != entry->par->sample_rate) ||
+         (header->channels && header->channels != entry->par->channels)))
+        return 0;
+
+    if ((error = avcodec_parameters_copy(stream->codecpar, entry->par)) < 0)
+        return error;
+    // The demuxer sets the time base of its packets; the times are only filled in where it did not tell them.
+    if (stream->start_time == AV_NOPTS_VALUE && entry->start_time != AV_NOPTS_VALUE)
+        stream->start_time = av_rescale_q(entry->start_time, entry->time_base, stream->time_base);
+    if (stream->duration == AV_NOPTS_VALUE && entry->duration != AV_NOPTS_VALUE)
+        stream->duration = av_rescale_q(entry->duration, entry->time_base, stream->time_base);
+
+    return 1;
+}
+
+void probe_entry_uninit(ProbeEntry *entry)
+{
+    avcodec_parameters_free(&entry->par);
+}
+
+void probe_cache_write(const char *dir, const char *filename, const AVFormatContext *ic)
+{
+    const AVStream *stream = ic->streams[0];
+    AVCodecParameters *par = stream->codecpar;
+    char path[PATH_MAX + 64], tmp[PATH_MAX + 64];
+    FileKey key;
+    FILE *f;
+    int fd;
+
+    if (ic->nb_streams != 1 || par->codec_type != AVMEDIA_TYPE_AUDIO ||
+        par->extradata_size > MAX_EXTRADATA_SIZE || !probe_file_key(filename, &key))
+        return;
+    entry_path(dir, &key, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+    if ((fd = mkstemp(tmp)) < 0 || !(f = fdopen(fd, "w"))) {
+        av_log(NULL, AV_LOG_WARNING, "Could not write the probe cache entry of '%s' (%s)\n",
+               filename, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return;
+    }
+
+    fprintf(f, "version=%d\nlibavformat=%u\npath=%s\nsize=%" PRId64 "\nmtime=%" PRId64 "\n",
+            PROBE_CACHE_VERSION, avformat_version(), key.path, key.size, key.mtime);
+    // A demuxer with several names is found by its first one.
+    fprintf(f, "format=%.*s\n", (int)strcspn(ic->iformat->name, ","), ic->iformat->name);
+    fprintf(f, "codec=%s\n", avcodec_get_name(par->codec_id));
+    if (par->format != AV_SAMPLE_FMT_NONE)
+        fprintf(f, "sample_fmt=%s\n", av_get_sample_fmt_name(par->format));
+    for (int i = 0 ; i < FF_ARRAY_ELEMS(par_fields) ; i++) {
+        if (par_fields[i].size == sizeof(int64_t))
+            fprintf(f, "%s=%" PRId64 "\n", par_fields[i].name, *field_int64(par, &par_fields[i]));
+        else
+            fprintf(f, "%s=%d\n", par_fields[i].name, *field_int(par, &par_fields[i]));
+    }
+    fprintf(f, "time_base=%d/%d\nstart_time=%" PRId64 "\nduration=%" PRId64 "\nextradata=",
+            stream->time_base.num, stream->time_base.den, stream->start_time, stream->duration);
+    for (int i = 0 ; i < par->extradata_size ; i++)
+        fprintf(f, "%02x", par->extradata[i]);
+    fprintf(f, "\n");
+
+    // The entry only appears once complete, so a concurrent reader sees the old one or the new one.
+    if (fclose(f) || rename(tmp, path) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Could not write the probe cache entry of '%s' (%s)\n",
+               filename, strerror(errno));
+        unlink(tmp);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef MIXER_PROBE_H
+#define MIXER_PROBE_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "libavformat/avformat.h"
+
+/**
+ * On-disk cache of what probing an input file learns about it
+ * (MixerOptions.probe_cache).
+ * avformat_find_stream_info() decodes the start of a file just to learn its
+ * format, which is most of the time of opening a short input. The same
+ * beds, stingers and station IDs go into thousands of mixes, so the format
+ * name, the codec parameters, the time base and the duration of their
+ * stream are kept in a directory, one small text file per input, named
+ * after its path. An entry is only used while the file has the size and
+ * modification time it was probed with. Entries are replaced with rename(),
+ * so several processes can share a directory.
+ */
+
+// Identity of a file: an entry is only valid for the file as it was when written.
+typedef struct FileKey {
+    char path[PATH_MAX];
+    int64_t size;
+    // Nanoseconds.
+    int64_t mtime;
+} FileKey;
+
+typedef struct ProbeEntry {
+    // First name of the demuxer, for av_find_input_format().
+    char format[32];
+    AVCodecParameters *par;
+    AVRational time_base;
+    int64_t start_time;
+    int64_t duration;
+} ProbeEntry;
+
+// Find the key of filename. Returns 0 for what is not a regular local file.
+int probe_file_key(const char *filename, FileKey *key);
+
+/**
+ * Read the entry of filename from the cache in dir. Returns 1 when there is
+ * one for the file as it is now, 0 when there is none; entry must then be
+ * freed with probe_entry_uninit().
+ */
+int probe_cache_read(const char *dir, const char *filename, ProbeEntry *entry);
+
+/**
+ * Set the only stream of ic from entry, in place of probing it. With
+ * validate, the parameters the header of the file gave are checked first:
+ * returns 0, leaving the stream alone, when they disagree with the entry.
+ */
+int probe_entry_apply(const ProbeEntry *entry, AVFormatContext *ic, int validate);
+
+void probe_entry_uninit(ProbeEntry *entry);
+
+/**
+ * Store what probing learned of the only stream of ic in the cache in dir.
+ * Failures are only logged: the file is probed again next time.
+ */
+void probe_cache_write(const char *dir, const char *filename, const AVFormatContext *ic);
+
+#endif // MIXER_PROBE_H
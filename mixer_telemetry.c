@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libavutil/avutil.h"
+#include "libavutil/mem.h"
+
+#include "mixer_telemetry.h"
+
+// The most events a track records; later ones are only counted.
+#define MAX_TRACE_EVENTS (1 << 20)
+
+static const char *const stage_names[NB_STAGES] = {
+    [STAGE_OPEN]   = "open",
+    [STAGE_DEMUX]  = "demux",
+    [STAGE_DECODE] = "decode",
+    [STAGE_PUSH]   = "push",
+    [STAGE_PULL]   = "pull",
+    [STAGE_MIX]    = "mix",
+    [STAGE_ENCODE] = "encode",
+    [STAGE_MUX]    = "mux",
+};
+
+static int64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+int telemetry_init(Telemetry *t, int nb_inputs, int enabled, int tracing)
+{
+    telemetry_uninit(t);
+
+    if (!(t->tracks = av_calloc(TRACK_INPUT + nb_inputs, sizeof(*t->tracks))))
+        return AVERROR(ENOMEM);
+    t->nb_tracks = TRACK_INPUT + nb_inputs;
+    t->origin    = clock_ns(CLOCK_MONOTONIC);
+
+    for (int i = 0 ; i < t->nb_tracks ; i++) {
+        TelemetryTrack *track = &t->tracks[i];
+
+        if (i == TRACK_MIX)
+            snprintf(track->name, sizeof(track->name), "mix");
+        else if (i == TRACK_ENCODER)
+            snprintf(track->name, sizeof(track->name), "encoder");
+        else
+            snprintf(track->name, sizeof(track->name), "input %d", i - TRACK_INPUT);
+        track->enabled = enabled || tracing;
+        track->tracing = tracing;
+        track->origin  = t->origin;
+    }
+
+    return 0;
+}
+
+void telemetry_uninit(Telemetry *t)
+{
+    for (int i = 0 ; i < t->nb_tracks ; i++)
+        av_freep(&t->tracks[i].events);
+    av_freep(&t->tracks);
+    t->nb_tracks = 0;
+    t->elapsed   = 0;
+}
+
+void telemetry_finish(Telemetry *t)
+{
+    t->elapsed = clock_ns(CLOCK_MONOTONIC) - t->origin;
+}
+
+static void add_event(TelemetryTrack *track, int64_t start, int64_t value, int stage)
+{
+    if (track->nb_events == track->events_size) {
+        int size = FFMAX(track->events_size * 2, 1024);
+        TraceEvent *events;
+
+        if (size > MAX_TRACE_EVENTS ||
+            !(events = av_realloc_array(track->events, size, sizeof(*events)))) {
+            track->nb_dropped++;
+            return;
+        }
+        track->events      = events;
+        track->events_size = size;
+    }
+
+    track->events[track->nb_events++] = (TraceEvent) {
+        .start = start - track->origin,
+        .value = value,
+        .stage = stage,
+    };
+}
+
+void telemetry_span_start(const TelemetryTrack *track, TelemetrySpan *span)
+{
+    if (!track->enabled)
+        return;
+
+    span->wall = clock_ns(CLOCK_MONOTONIC);
+    span->cpu  = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void telemetry_span_end(TelemetryTrack *track, enum TelemetryStage stage, const TelemetrySpan *span)
+{
+    StageTimes *times = &track->stages[stage];
+    int64_t wall;
+
+    if (!track->enabled)
+        return;
+
+    wall = clock_ns(CLOCK_MONOTONIC);
+    times->count++;
+    times->wall += wall - span->wall;
+    times->cpu  += clock_ns(CLOCK_THREAD_CPUTIME_ID) - span->cpu;
+
+    if (track->tracing)
+        add_event(track, span->wall, wall - span->wall, stage);
+}
+
+void telemetry_queue_depth(TelemetryTrack *track, int depth)
+{
+    track->max_queue_depth = FFMAX(track->max_queue_depth, depth);
+    track->queue_depth_sum += depth;
+    track->nb_queue_samples++;
+
+    if (track->tracing)
+        add_event(track, clock_ns(CLOCK_MONOTONIC), depth, NB_STAGES);
+}
+
+void telemetry_merge(Telemetry *dst, const Telemetry *src)
+{
+    for (int i = 0 ; i < FFMIN(dst->nb_tracks, src->nb_tracks) ; i++) {
+        TelemetryTrack *track = &dst->tracks[i];
+
+        for (int j = 0 ; j < NB_STAGES ; j++) {
+            track->stages[j].count += src->tracks[i].stages[j].count;
+            track->stages[j].wall  += src->tracks[i].stages[j].wall;
+            track->stages[j].cpu   += src->tracks[i].stages[j].cpu;
+        }
+        track->nb_frames  += src->tracks[i].nb_frames;
+        track->nb_samples += src->tracks[i].nb_samples;
+        track->nb_packets += src->tracks[i].nb_packets;
+        track->nb_bytes   += src->tracks[i].nb_bytes;
+        track->io_hits    += src->tracks[i].io_hits;
+        track->io_misses  += src->tracks[i].io_misses;
+        track->io_wait    += src->tracks[i].io_wait;
+        track->nb_graph_calls += src->tracks[i].nb_graph_calls;
+        track->max_queue_depth   = FFMAX(track->max_queue_depth, src->tracks[i].max_queue_depth);
+        track->queue_depth_sum  += src->tracks[i].queue_depth_sum;
+        track->nb_queue_samples += src->tracks[i].nb_queue_samples;
+    }
+}
+
+const char *telemetry_stage_name(enum TelemetryStage stage)
+{
+    return stage_names[stage];
+}
+
+void telemetry_stage_totals(const Telemetry *t, StageTimes *totals)
+{
+    memset(totals, 0, NB_STAGES * sizeof(*totals));
+
+    for (int i = 0 ; i < t->nb_tracks ; i++) {
+        for (int j = 0 ; j < NB_STAGES ; j++) {
+            totals[j].count += t->tracks[i].stages[j].count;
+            totals[j].wall  += t->tracks[i].stages[j].wall;
+            totals[j].cpu   += t->tracks[i].stages[j].cpu;
+        }
+    }
+}
+
+void telemetry_json_string(AVBPrint *bp, const char *str)
+{
+    av_bprint_chars(bp, '"', 1);
+    for (const unsigned char *p = (const unsigned char *)str ; *p ; p++) {
+        if (*p == '"' || *p == '\\')
+            av_bprintf(bp, "\\%c", *p);
+        else if (*p < 0x20)
+            av_bprintf(bp, "\\u%04x", *p);
+        else
+            av_bprint_chars(bp, *p, 1);
+    }
+    av_bprint_chars(bp, '"', 1);
+}
+
+/**
+ * Every track is a thread of the timeline, with its stages as complete
+ * ("X") events and the depth of the queue it feeds as a counter ("C").
+ * Timestamps are in microseconds.
+ */
+int telemetry_write_trace(const Telemetry *t, const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    const char *separator = "";
+
+    if (!f) {
+        int error = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not open trace file '%s' (error '%s')\n",
+               filename, av_err2str(error));
+        return error;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int i = 0 ; i < t->nb_tracks ; i++) {
+        const TelemetryTrack *track = &t->tracks[i];
+
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", separator, i, track->name);
+        separator = ",\n";
+
+        for (int j = 0 ; j < track->nb_events ; j++) {
+            const TraceEvent *event = &track->events[j];
+
+            if (event->stage == NB_STAGES)
+                fprintf(f, ",\n{\"name\":\"queue %s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"args\":{\"frames\":%" PRId64 "}}",
+                        track->name, i, event->start / 1000.0, event->value);
+            else
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"mixer\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%.3f,\"dur\":%.3f}",
+                        stage_names[event->stage], i, event->start / 1000.0, event->value / 1000.0);
+        }
+        if (track->nb_dropped)
+            av_log(NULL, AV_LOG_WARNING, "Trace of %s: %" PRId64 " events dropped\n",
+                   track->name, track->nb_dropped);
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f)) {
+        int error = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "Could not write trace file '%s' (error '%s')\n",
+               filename, av_err2str(error));
+        return error;
+    }
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#ifndef MIXER_TELEMETRY_H
+#define MIXER_TELEMETRY_H
+
+#include <stdint.h>
+
+#include "libavutil/bprint.h"
+
+/**
+ * Stage timings of one mix (MixerOptions.telemetry).
+ * The work of a mix is split into tracks, one per thread of the pipeline:
+ * the mixing loop, the encoder and one decoder per input. Without a
+ * pipeline all of them run on the calling thread, one after the other. A
+ * track is only written by the thread running it, so nothing here takes a
+ * lock; the tracks are read once the mix is over.
+ */
+
+enum TelemetryStage {
+    STAGE_OPEN,     // opening the files, the codecs and the graph
+    STAGE_DEMUX,
+    STAGE_DECODE,
+    STAGE_PUSH,     // av_buffersrc_add_frame_flags(), or the FIFOs of the native engine
+    STAGE_PULL,     // avfilter_graph_request_oldest() and av_buffersink_get_frame_flags()
+    STAGE_MIX,      // native engine
+    STAGE_ENCODE,
+    STAGE_MUX,
+    NB_STAGES,
+};
+
+// Tracks of a mix; the decoder of input i is TRACK_INPUT + i.
+enum {
+    TRACK_MIX,
+    TRACK_ENCODER,
+    TRACK_INPUT,
+};
+
+typedef struct StageTimes {
+    int64_t count;
+    // Nanoseconds spent in the stage, on the clock and on the CPU.
+    int64_t wall;
+    int64_t cpu;
+} StageTimes;
+
+typedef struct TraceEvent {
+    // Nanoseconds since the start of the mix.
+    int64_t start;
+    // Nanoseconds, or the depth of the queue for queue samples.
+    int64_t value;
+    // A stage, or NB_STAGES for a queue sample.
+    int stage;
+} TraceEvent;
+
+typedef struct TelemetryTrack {
+    char name[32];
+    int enabled;
+    int tracing;
+    int64_t origin;
+
+    StageTimes stages[NB_STAGES];
+
+    // Frames, samples per channel, packets and bytes that went through the track.
+    int64_t nb_frames;
+    int64_t nb_samples;
+    int64_t nb_packets;
+    int64_t nb_bytes;
+
+    // Reads of the input files served from the read-ahead, reads that
+    // waited for the disk, and the nanoseconds waited.
+    int64_t io_hits;
+    int64_t io_misses;
+    int64_t io_wait;
+
+    // Calls into the filter graph: frames pushed, requests and frames pulled.
+    int64_t nb_graph_calls;
+
+    // Depth of the queue the track feeds, sampled on every push.
+    int max_queue_depth;
+    int64_t queue_depth_sum;
+    int64_t nb_queue_samples;
+
+    TraceEvent *events;
+    int nb_events;
+    int events_size;
+    int64_t nb_dropped;
+} TelemetryTrack;
+
+typedef struct TelemetrySpan {
+    int64_t wall;
+    int64_t cpu;
+} TelemetrySpan;
+
+typedef struct Telemetry {
+    TelemetryTrack *tracks;
+    int nb_tracks;
+    // Start and duration of the whole run, in nanoseconds.
+    int64_t origin;
+    int64_t elapsed;
+} Telemetry;
+
+// Reset t for a mix of nb_inputs inputs. Counters are always kept; the
+// stages are only timed when enabled, and recorded when tracing.
+int telemetry_init(Telemetry *t, int nb_inputs, int enabled, int tracing);
+
+void telemetry_uninit(Telemetry *t);
+
+// Set elapsed to the time since telemetry_init().
+void telemetry_finish(Telemetry *t);
+
+void telemetry_span_start(const TelemetryTrack *track, TelemetrySpan *span);
+
+// Account the time since telemetry_span_start() to stage.
+void telemetry_span_end(TelemetryTrack *track, enum TelemetryStage stage, const TelemetrySpan *span);
+
+// Sample the depth of the queue fed by the track.
+void telemetry_queue_depth(TelemetryTrack *track, int depth);
+
+// Add the stage times and the counters of every track of src to dst; the events are not copied.
+void telemetry_merge(Telemetry *dst, const Telemetry *src);
+
+const char *telemetry_stage_name(enum TelemetryStage stage);
+
+// Sum of every stage over all the tracks.
+void telemetry_stage_totals(const Telemetry *t, StageTimes *totals);
+
+// Append str as a quoted JSON string.
+void telemetry_json_string(AVBPrint *bp, const char *str);
+
+// Write the recorded events in the Chrome trace event format.
+int telemetry_write_trace(const Telemetry *t, const char *filename);
+
+#endif // MIXER_TELEMETRY_H